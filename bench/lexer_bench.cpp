@@ -0,0 +1,42 @@
+#include "../src/lexer.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+/// A large data-as-code program: a global per row of a table, with the sort of
+/// comments, names, numbers and strings generated files are full of
+static std::string generate(int rows) {
+  std::string source = "/* generated: one global per row */\n";
+  for (int i = 0; i < rows; i++) {
+    std::string n = std::to_string(i);
+    source += "let row" + n + " = makeRow(" + n + ", " + n + ".25, " +
+              "\"description of row number " + n + "\", true, null);\n";
+    source += "    // checksum " + n + " for row " + n + "\n";
+  }
+  return source;
+}
+
+int main(int argc, char *argv[]) {
+  const int runs = argc > 1 ? std::atoi(argv[1]) : 5;
+  const int rows = argc > 2 ? std::atoi(argv[2]) : 200000;
+
+  std::string source = generate(rows);
+  double mb = source.size() / (1024.0 * 1024.0);
+
+  double best = 0;
+  size_t count = 0;
+  for (int i = 0; i < runs; i++) {
+    auto start = std::chrono::steady_clock::now();
+    count = Lexer(source).lex().size();
+    auto end = std::chrono::steady_clock::now();
+
+    double s = std::chrono::duration<double>(end - start).count();
+    if (i == 0 || s < best)
+      best = s;
+  }
+
+  std::printf("scan: %s\n", SIMD_SCAN ? "simd" : "scalar");
+  std::printf("%.1f MB, %zu tokens: %.2f ms, %.1f MB/s\n", mb, count,
+              best * 1000, mb / best);
+}
@@ -0,0 +1,130 @@
+#include "../src/closure_vm.h"
+#include "../src/reg_vm.h"
+#include "../src/vm.h"
+#include <chrono>
+#include <cstdio>
+
+// Each workload leans on a different mix of opcodes.  There are no loops in
+// the language yet, so work is repeated by fanning out recursive calls.
+struct Workload {
+  const char *name;
+  const char *source;
+};
+
+static const Workload workloads[] = {
+    {"calls",
+     "fn fib(n) {"
+     "  if n { } else { return n; }"
+     "  if n - 1 { } else { return n; }"
+     "  return fib(n - 1) + fib(n - 2);"
+     "}"
+     "return fib(24);"},
+    {"arith",
+     "fn work(a, b) {"
+     "  return (a * b + a - b) * (a + b) - (a * a - b * b) / (b + 1) + a * 3 -"
+     "         b * 2 + (a - 1) * (b - 1) * 2 + (a + b + a + b) / 2;"
+     "}"
+     "fn tree(d) {"
+     "  if d { return tree(d - 1) + tree(d - 1); }"
+     "  return work(7, 3) + work(11, 5) + work(2, 9) + work(4, 4);"
+     "}"
+     "return tree(15);"},
+    {"locals",
+     "fn work(a) {"
+     "  let b = a; let c = b; let d = c;"
+     "  { let e = d; b = e; c = b; d = c; a = d; }"
+     "  { let f = a; a = f; b = a; c = b; d = c; }"
+     "  return d;"
+     "}"
+     "fn tree(d) {"
+     "  if d { return tree(d - 1) + tree(d - 1); }"
+     "  return work(1) + work(2) + work(3) + work(4);"
+     "}"
+     "return tree(15);"},
+    {"globals",
+     "let x = 1; let y = 2; let z = 3;"
+     "fn work() {"
+     "  x = y; y = z; z = x;"
+     "  return x + y + z + x + y + z + x + y + z;"
+     "}"
+     "fn tree(d) {"
+     "  if d { return tree(d - 1) + tree(d - 1); }"
+     "  return work() + work() + work() + work();"
+     "}"
+     "return tree(15);"},
+    {"branches",
+     "fn work(a) {"
+     "  if a - 1 { if a - 2 { if a - 3 { return 4; } else { return 3; } }"
+     "             else { return 2; } }"
+     "  else if a { return 1; }"
+     "  else { return 0; }"
+     "}"
+     "fn tree(d) {"
+     "  if d { return tree(d - 1) + tree(d - 1); }"
+     "  return work(1) + work(2) + work(3) + work(4);"
+     "}"
+     "return tree(15);"},
+    {"tail_calls",
+     "fn count(n, acc) {"
+     "  if n { return count(n - 1, acc + 1); }"
+     "  return acc;"
+     "}"
+     "return count(1000000, 0);"},
+};
+
+/// Best time over `runs` runs of `w`, leaving its result in `result`
+template <typename VMType>
+static double time_workload(const Workload &w, const VMOptions &options,
+                            int runs, Value &result) {
+  double best = 0;
+
+  for (int i = 0; i < runs; i++) {
+    VMType vm(options);
+    auto start = std::chrono::steady_clock::now();
+    result = vm.eval(w.source);
+    auto end = std::chrono::steady_clock::now();
+
+    double ms = std::chrono::duration<double, std::milli>(end - start).count();
+    if (i == 0 || ms < best)
+      best = ms;
+  }
+
+  return best;
+}
+
+int main(int argc, char *argv[]) {
+  const int runs = argc > 1 ? std::atoi(argv[1]) : 5;
+  const char *jit = argc > 2 ? argv[2] : "off";
+  const char *engine_name = argc > 3 ? argv[3] : "stack";
+
+  VMOptions options;
+  std::optional<JitMode> mode = parse_jit_mode(jit);
+  std::optional<Engine> engine = parse_engine(engine_name);
+  if (!mode || !engine || (*engine != Engine::stack && *mode != JitMode::off)) {
+    std::fprintf(stderr,
+                 "usage: %s [runs] [off|on|always|trace] "
+                 "[stack|register|closure]\n"
+                 "  (only the stack engine has a JIT)\n",
+                 argv[0]);
+    return 1;
+  }
+  options.jit = *mode;
+
+  std::printf("dispatch: %s, jit: %s, engine: %s\n",
+              THREADED_DISPATCH ? "threaded" : "switch", jit, engine_name);
+
+  for (const Workload &w : workloads) {
+    Value result;
+    double best;
+    if (*engine == Engine::register_) {
+      best = time_workload<RegVM>(w, options, runs, result);
+    } else if (*engine == Engine::closure) {
+      best = time_workload<ClosureVM>(w, options, runs, result);
+    } else {
+      best = time_workload<VM>(w, options, runs, result);
+    }
+
+    std::printf("%-10s %10.2f ms   (result: %s)\n", w.name, best,
+                result.to_string().c_str());
+  }
+}
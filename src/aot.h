@@ -0,0 +1,250 @@
+#pragma once
+
+#include "compiler.h"
+#include <iomanip>
+#include <set>
+#include <sstream>
+#include <unordered_map>
+
+/// Translates compiled chunks into a standalone C++ program built against
+/// `aot_runtime.h`.  Each function becomes a C++ function whose stack slots
+/// are locals at statically known indexes, so the C++ compiler can keep them
+/// in registers and inline the arithmetic on `Value`s.  Chunks must be
+/// compiled without superinstructions.
+class AotCompiler {
+public:
+  std::string compile(const Function &script, const GlobalTable &globals) {
+    out = std::stringstream();
+    functions.clear();
+    indexes.clear();
+    constants = std::stringstream();
+    constant_count = 0;
+
+    collect(script);
+
+    out << "// Generated by dangc\n\n";
+    out << "#include \"aot_runtime.h\"\n\n";
+
+    out << "static aot::Global globals[] = {\n";
+    for (size_t i = 0; i < globals.size(); i++) {
+      out << "    {" << string_literal(globals.name(i)) << "},\n";
+    }
+    out << "    {nullptr},\n};\n\n";
+
+    for (size_t i = 0; i < functions.size(); i++) {
+      out << "static Value fn_" << i << "(Value *fp);\n";
+    }
+    out << "\n";
+
+    std::stringstream bodies;
+    std::swap(out, bodies);
+    for (size_t i = 0; i < functions.size(); i++) {
+      emit_function(i);
+    }
+    std::swap(out, bodies);
+
+    out << constants.str() << "\n" << bodies.str();
+    out << "int main() { return aot::run(fn_0); }\n";
+
+    return out.str();
+  }
+
+private:
+  /// Numbers `function` and every function defined inside it
+  void collect(const Function &function) {
+    indexes[function.chunk.get()] = functions.size();
+    functions.push_back(function);
+
+    for (const Value &v : function.chunk->constants) {
+      if (v.type() == ValueType::function) {
+        collect(v.function_value());
+      }
+    }
+  }
+
+  void emit_function(size_t index) {
+    const Function &function = functions[index];
+    const Chunk &chunk = *function.chunk;
+    arity = function.arity;
+
+    // forward jumps only, so the depth at each target is the depth reached by
+    // scanning linearly (see `op_stack_effect`)
+    std::set<size_t> targets;
+    for (size_t offset = 0; offset < chunk.code.size();) {
+      Op op = (Op)chunk.code[offset];
+      if (op == Op::jump || op == Op::jump_if_zero) {
+        targets.insert(offset + 2 + chunk.code[offset + 1]);
+      }
+      offset += 1 + op_n_args(op);
+    }
+
+    out << "// " << function.name << "\n";
+    out << "static Value fn_" << index << "(Value *fp) {\n";
+    out << "  Value s[" << std::max(1, chunk.max_stack) << "];\n";
+    out << "start:\n";
+
+    // next free slot, relative to `fp`
+    int sp = arity + 1;
+    for (size_t offset = 0; offset < chunk.code.size();) {
+      if (targets.contains(offset)) {
+        out << "L" << offset << ":\n";
+      }
+
+      Op op = unquickened((Op)chunk.code[offset]);
+      assert(!superinstruction(op));
+      int arg = op_n_args(op) > 0 ? chunk.code[offset + 1] : 0;
+      size_t next = offset + 1 + op_n_args(op);
+
+      out << "  ";
+      switch (op) {
+      case Op::load_const:
+        out << slot(sp++) << " = " << constant(chunk.constants[arg]) << ";";
+        break;
+      case Op::define_global:
+        out << "aot::define_global(globals[" << arg << "], " << slot(--sp)
+            << ");";
+        break;
+      case Op::get_global:
+        out << slot(sp++) << " = aot::get_global(globals[" << arg << "]);";
+        break;
+      case Op::set_global:
+        out << "aot::set_global(globals[" << arg << "], " << slot(--sp)
+            << ");";
+        break;
+      case Op::get_local:
+        out << slot(sp++) << " = " << slot(arg + 1) << ";";
+        break;
+      case Op::set_local:
+        sp--;
+        out << slot(arg + 1) << " = std::move(" << slot(sp) << ");";
+        break;
+      case Op::add:
+      case Op::subtract:
+      case Op::multiply:
+      case Op::divide:
+        sp--;
+        out << slot(sp - 1) << " " << arithmetic_operator(op)
+            << "= " << slot(sp) << ";";
+        break;
+      case Op::pop:
+        out << slot(--sp) << " = Value();";
+        break;
+      case Op::jump:
+        out << "goto L" << next + arg << ";";
+        break;
+      case Op::jump_if_zero:
+        out << "if (!" << slot(--sp) << ") goto L" << next + arg << ";";
+        break;
+      case Op::call:
+        sp -= arg + 1;
+        out << slot(sp) << " = aot::call(&" << slot(sp) << ", " << arg << ");";
+        sp++;
+        break;
+      case Op::return_:
+        out << "return std::move(" << slot(--sp) << ");";
+        break;
+      case Op::tail_call:
+        sp -= arg + 1;
+        if (arg == arity) {
+          // calling itself reuses the frame, so it runs in constant stack
+          out << "if (aot::is_function(" << slot(sp) << ", fn_" << index
+              << ")) {\n";
+          for (int i = 0; i <= arg; i++) {
+            out << "    fp[" << i << "] = std::move(" << slot(sp + i)
+                << ");\n";
+          }
+          out << "    goto start;\n  }\n  ";
+        }
+        out << "return aot::call(&" << slot(sp) << ", " << arg << ");";
+        break;
+      default:
+        std::cerr << "dangc: unsupported op " << to_string(op) << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      out << "\n";
+
+      offset = next;
+    }
+
+    out << "}\n\n";
+  }
+
+  /// Slot `n` relative to the frame pointer: the function and its arguments
+  /// are in the caller's slots at `fp`, the rest are locals
+  std::string slot(int n) const {
+    if (n <= arity) {
+      return "fp[" + std::to_string(n) + "]";
+    }
+    return "s[" + std::to_string(n - arity - 1) + "]";
+  }
+
+  /// An expression for the constant `v`, hoisting heap allocated ones into
+  /// statics
+  std::string constant(const Value &v) {
+    std::stringstream s;
+    switch (v.type()) {
+    case ValueType::null_:
+      return "Value()";
+    case ValueType::int_:
+      return "Value::of(" + std::to_string(v.int_value()) + ")";
+    case ValueType::double_:
+      s << "Value::of(" << std::hexfloat << v.double_value() << ")";
+      return s.str();
+    case ValueType::boolean:
+      return v.bool_value() ? "Value::of(true)" : "Value::of(false)";
+    case ValueType::string:
+      s << "Value::of(" << string_literal(v.string_value()) << ")";
+      break;
+    case ValueType::function: {
+      const Function &f = v.function_value();
+      s << "Value::of(Function{.name = " << string_literal(f.name)
+        << ", .arity = " << f.arity << ", .native = fn_"
+        << indexes.at(f.chunk.get()) << "})";
+      break;
+    }
+    }
+
+    std::string name = "k" + std::to_string(constant_count++);
+    constants << "static const Value " << name << " = " << s.str() << ";\n";
+    return name;
+  }
+
+  static std::string string_literal(const std::string &str) {
+    std::stringstream s;
+    s << '"';
+    for (unsigned char c : str) {
+      if (c == '"' || c == '\\') {
+        s << '\\' << c;
+      } else if (c >= 0x20 && c < 0x7f) {
+        s << c;
+      } else {
+        // always 3 digits, so a following digit can't extend the escape
+        s << '\\' << std::oct << std::setw(3) << std::setfill('0') << (int)c
+          << std::dec;
+      }
+    }
+    s << '"';
+    return s.str();
+  }
+
+  static char arithmetic_operator(Op op) {
+    switch (op) {
+    case Op::add:
+      return '+';
+    case Op::subtract:
+      return '-';
+    case Op::multiply:
+      return '*';
+    default:
+      return '/';
+    }
+  }
+
+  std::stringstream out;
+  std::vector<Function> functions;
+  std::unordered_map<const Chunk *, size_t> indexes;
+  /// Definitions of the hoisted constants
+  std::stringstream constants;
+  int constant_count = 0;
+  int arity = 0;
+};
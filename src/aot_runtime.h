@@ -0,0 +1,90 @@
+#pragma once
+
+// Runtime for programs compiled ahead of time by `dangc`.  Generated code
+// includes this (and through it `value.h`, `native_stack.h` and
+// `runtime_checks.h`) and nothing else, and reports errors the same way the
+// VM does.
+
+#include "native_stack.h"
+#include "runtime_checks.h"
+#include "value.h"
+#include <iostream>
+
+namespace aot {
+
+/// A global's slot, named as there's no `GlobalTable` to look it up in
+struct Global {
+  const char *name;
+  Value value;
+  bool defined = false;
+};
+
+[[noreturn]] inline void global_error(const Global &global,
+                                      const char *message) {
+  ::global_error(global.name, message);
+}
+
+inline void define_global(Global &global, const Value &v) {
+  if (global.defined) {
+    global_error(global, "already defined");
+  }
+  global.value = v;
+  global.defined = true;
+}
+
+inline const Value &get_global(const Global &global) {
+  if (!global.defined) {
+    global_error(global, "not defined");
+  }
+  return global.value;
+}
+
+inline void set_global(Global &global, const Value &v) {
+  if (!global.defined) {
+    global_error(global, "not defined");
+  }
+  global.value = v;
+}
+
+/// Calls nested deeper than this fail with a "stack overflow" error, as in
+/// the VM
+constexpr int MAX_CALL_DEPTH = 64 * 1024;
+inline int call_depth = 0;
+/// Native stack calls may use, below `main`
+inline NativeStack native_stack;
+
+/// Calls the function at `callee` with the arguments that follow it
+inline Value call(Value *callee, int arg_count) {
+  const Function &f = check_call(*callee, arg_count);
+
+  if (++call_depth > MAX_CALL_DEPTH) {
+    call_depth_error(MAX_CALL_DEPTH);
+  } else if (native_stack.exhausted()) {
+    NativeStack::overflow_error();
+  }
+
+  Value result = f.native(callee);
+  call_depth--;
+  return result;
+}
+
+/// Whether `callee` is the compiled function `native`, for turning self tail
+/// calls into loops
+inline bool is_function(const Value &callee, Value (*native)(Value *)) {
+  return callee.type() == ValueType::function &&
+         callee.function_value().native == native;
+}
+
+/// Runs the top level of the program and prints its result, like `dang`
+inline int run(Value (*script)(Value *)) {
+  native_stack.start(NativeStack::DEFAULT_SIZE);
+
+  Value fp[] = {
+      Value::of(Function{.name = "(script)", .arity = 0, .native = script})};
+  Value result = script(fp);
+
+  std::cout << result.to_string() << std::endl;
+  return 0;
+}
+
+} // namespace aot
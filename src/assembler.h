@@ -0,0 +1,252 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+/// x86-64 general purpose registers, numbered as in their encoding
+enum class Reg : uint8_t {
+  rax,
+  rcx,
+  rdx,
+  rbx,
+  rsp,
+  rbp,
+  rsi,
+  rdi,
+  r8,
+  r9,
+  r10,
+  r11,
+  r12,
+  r13,
+  r14,
+  r15,
+};
+
+enum class Xmm : uint8_t { xmm0, xmm1 };
+
+enum class Cond : uint8_t { e = 0x4, ne = 0x5, l = 0xc, ge = 0xd };
+
+/// A position in the code.  May be jumped to before it's bound, in which case
+/// the jumps are patched when it is.
+struct Label {
+  int offset = -1;
+  std::vector<int> fixups;
+};
+
+/// Emits x86-64 machine code into a byte buffer.  Only covers the handful of
+/// instructions the JIT needs, and memory operands are always [base + disp32].
+class Assembler {
+public:
+  const std::vector<uint8_t> &code() const { return buffer; }
+  size_t size() const { return buffer.size(); }
+
+  void push(Reg r) {
+    rex(false, 0, r);
+    byte(0x50 + low(r));
+  }
+
+  void pop(Reg r) {
+    rex(false, 0, r);
+    byte(0x58 + low(r));
+  }
+
+  void ret() { byte(0xc3); }
+
+  /// mov dst, src (64 bit)
+  void mov(Reg dst, Reg src) { op_rr(true, 0x89, src, dst); }
+
+  /// mov dst, imm64
+  void mov(Reg dst, uint64_t imm) {
+    rex(true, 0, dst);
+    byte(0xb8 + low(dst));
+    u64(imm);
+  }
+
+  /// mov dst, [base + disp] (64 bit)
+  void load(Reg dst, Reg base, int32_t disp) {
+    op_rm(true, 0x8b, (int)dst, base, disp);
+  }
+
+  /// mov dst, [base + disp] (32 bit, zero extended)
+  void load32(Reg dst, Reg base, int32_t disp) {
+    op_rm(false, 0x8b, (int)dst, base, disp);
+  }
+
+  /// mov [base + disp], src (64 bit)
+  void store(Reg base, int32_t disp, Reg src) {
+    op_rm(true, 0x89, (int)src, base, disp);
+  }
+
+  /// lea dst, [base + disp]
+  void lea(Reg dst, Reg base, int32_t disp) {
+    op_rm(true, 0x8d, (int)dst, base, disp);
+  }
+
+  /// 32 bit arithmetic, which zero extends into the upper half of `dst`
+  void add32(Reg dst, Reg src) { op_rr(false, 0x01, src, dst); }
+  void sub32(Reg dst, Reg src) { op_rr(false, 0x29, src, dst); }
+  void imul32(Reg dst, Reg src) {
+    rex(false, (int)dst, src);
+    byte(0x0f);
+    byte(0xaf);
+    modrm(3, low(dst), low(src));
+  }
+  void test32(Reg a, Reg b) { op_rr(false, 0x85, b, a); }
+
+  /// cmp r, imm32 (32 bit)
+  void cmp32(Reg r, int32_t imm) {
+    rex(false, 0, r);
+    byte(0x81);
+    modrm(3, 7, low(r));
+    i32(imm);
+  }
+
+  /// or/and/cmp dst, src (64 bit)
+  void or_(Reg dst, Reg src) { op_rr(true, 0x09, src, dst); }
+  void and_(Reg dst, Reg src) { op_rr(true, 0x21, src, dst); }
+  void cmp(Reg a, Reg b) { op_rr(true, 0x39, b, a); }
+
+  /// Sign extends eax into edx, then divides edx:eax by `r` (32 bit)
+  void cdq_idiv32(Reg r) {
+    byte(0x99);
+    rex(false, 0, r);
+    byte(0xf7);
+    modrm(3, 7, low(r));
+  }
+
+  /// movq xmm, r64 and back
+  void movq(Xmm dst, Reg src) { sse(0x66, true, 0x6e, (int)dst, src); }
+  void movq(Reg dst, Xmm src) { sse(0x66, true, 0x7e, (int)src, dst); }
+
+  /// Scalar double arithmetic, dst op= src
+  void addsd(Xmm dst, Xmm src) {
+    sse(0xf2, false, 0x58, (int)dst, (Reg)src);
+  }
+  void mulsd(Xmm dst, Xmm src) {
+    sse(0xf2, false, 0x59, (int)dst, (Reg)src);
+  }
+  void subsd(Xmm dst, Xmm src) {
+    sse(0xf2, false, 0x5c, (int)dst, (Reg)src);
+  }
+  void divsd(Xmm dst, Xmm src) {
+    sse(0xf2, false, 0x5e, (int)dst, (Reg)src);
+  }
+
+  /// shr r, imm (64 bit)
+  void shr(Reg r, uint8_t imm) {
+    rex(true, 0, r);
+    byte(0xc1);
+    modrm(3, 5, low(r));
+    byte(imm);
+  }
+
+  /// call r
+  void call(Reg r) {
+    rex(false, 0, r);
+    byte(0xff);
+    modrm(3, 2, low(r));
+  }
+
+  /// Calls an absolute address, clobbering rax
+  void call(const void *fn) {
+    mov(Reg::rax, (uint64_t)(uintptr_t)fn);
+    call(Reg::rax);
+  }
+
+  void jmp(Label &target) {
+    byte(0xe9);
+    rel32(target);
+  }
+
+  void jcc(Cond cond, Label &target) {
+    byte(0x0f);
+    byte(0x80 + (uint8_t)cond);
+    rel32(target);
+  }
+
+  void bind(Label &label) {
+    assert(label.offset == -1);
+    label.offset = (int)buffer.size();
+    for (int fixup : label.fixups) {
+      patch32(fixup, label.offset - (fixup + 4));
+    }
+    label.fixups.clear();
+  }
+
+private:
+  static int low(Reg r) { return (int)r & 7; }
+  static int high(int r) { return (r >> 3) & 1; }
+
+  void byte(uint8_t b) { buffer.push_back(b); }
+
+  void i32(int32_t v) {
+    for (int i = 0; i < 4; i++) {
+      byte((uint8_t)((uint32_t)v >> (8 * i)));
+    }
+  }
+
+  void u64(uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+      byte((uint8_t)(v >> (8 * i)));
+    }
+  }
+
+  void patch32(int offset, int32_t v) {
+    for (int i = 0; i < 4; i++) {
+      buffer[offset + i] = (uint8_t)((uint32_t)v >> (8 * i));
+    }
+  }
+
+  void rel32(Label &target) {
+    if (target.offset >= 0) {
+      i32(target.offset - ((int)buffer.size() + 4));
+    } else {
+      target.fixups.push_back((int)buffer.size());
+      i32(0);
+    }
+  }
+
+  /// Emits a REX prefix if one is needed for 64 bit operands or r8-r15
+  void rex(bool w, int reg, Reg rm) {
+    uint8_t r = 0x40 | (w << 3) | (high(reg) << 2) | high((int)rm);
+    if (r != 0x40) {
+      byte(r);
+    }
+  }
+
+  void modrm(int mod, int reg, int rm) {
+    byte((uint8_t)((mod << 6) | ((reg & 7) << 3) | (rm & 7)));
+  }
+
+  /// `opcode` with a register-direct ModRM: reg = `reg`, rm = `rm`
+  void op_rr(bool w, uint8_t opcode, Reg reg, Reg rm) {
+    rex(w, (int)reg, rm);
+    byte(opcode);
+    modrm(3, low(reg), low(rm));
+  }
+
+  /// SSE `prefix 0f opcode` with a register-direct ModRM
+  void sse(uint8_t prefix, bool w, uint8_t opcode, int reg, Reg rm) {
+    byte(prefix);
+    rex(w, reg, rm);
+    byte(0x0f);
+    byte(opcode);
+    modrm(3, reg, low(rm));
+  }
+
+  /// `opcode` with a [base + disp32] memory operand
+  void op_rm(bool w, uint8_t opcode, int reg, Reg base, int32_t disp) {
+    rex(w, reg, base);
+    byte(opcode);
+    modrm(2, reg, low(base));
+    if (low(base) == (int)Reg::rsp) {
+      // rsp and r12 as a base need a SIB byte
+      byte(0x24);
+    }
+    i32(disp);
+  }
+
+  std::vector<uint8_t> buffer;
+};
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/// Allocates AST nodes in large blocks, and frees them all at once when it's
+/// destroyed, rather than each node owning (and copying) its children
+class ASTArena {
+public:
+  ASTArena() = default;
+  ASTArena(const ASTArena &) = delete;
+  ASTArena &operator=(const ASTArena &) = delete;
+
+  ~ASTArena() {
+    for (auto it = destructors.rbegin(); it != destructors.rend(); it++) {
+      it->destroy(it->node);
+    }
+  }
+
+  template <typename T> T *make(T &&node) {
+    T *p = new (allocate(sizeof(T), alignof(T))) T(std::move(node));
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+      destructors.push_back(
+          {.node = p, .destroy = [](void *p) { static_cast<T *>(p)->~T(); }});
+    }
+    return p;
+  }
+
+private:
+  void *allocate(size_t size, size_t align) {
+    size_t offset = (used + align - 1) & ~(align - 1);
+    if (blocks.empty() || offset + size > BLOCK_SIZE) {
+      blocks.push_back(
+          std::make_unique<std::byte[]>(std::max(size, BLOCK_SIZE)));
+      offset = 0;
+    }
+    used = offset + size;
+    return blocks.back().get() + offset;
+  }
+
+  static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+  /// Nodes that own memory outside of the arena, like their vectors
+  struct Destructor {
+    void *node;
+    void (*destroy)(void *);
+  };
+
+  std::vector<std::unique_ptr<std::byte[]>> blocks;
+  size_t used = 0;
+  std::vector<Destructor> destructors;
+};
+
+/// A child node, in the arena that owns it.  Copying one copies the pointer,
+/// but comparing two compares the nodes they point to.
+template <typename T> class ast_ptr {
+public:
+  ast_ptr() = default;
+  ast_ptr(T *ptr) : ptr(ptr) {}
+
+  T *get() const { return ptr; }
+  T &operator*() const { return *ptr; }
+  T *operator->() const { return ptr; }
+  explicit operator bool() const { return ptr != nullptr; }
+
+  bool operator==(const ast_ptr &other) const {
+    return ptr == other.ptr || (ptr && other.ptr && *ptr == *other.ptr);
+  }
+
+private:
+  T *ptr = nullptr;
+};
@@ -1,235 +1,229 @@
 #pragma once
 
-#include "parser.h"
-#include "value-ptr.hpp"
+#include "flat_ast.h"
 #include <sstream>
 #include <string>
 
-template <typename Root> class ASTPrinter {
+/// Prints a flat AST as the tree of `ASTNode` initializers it came from, as
+/// written in the parser tests
+class ASTPrinter {
 public:
-  ASTPrinter(Root root) : root(std::move(root)) {}
+  ASTPrinter(const FlatAST &ast) : ast(ast) {}
 
   std::string print() {
-    (*this)(root);
+    if (ast.kind(FlatAST::root) == Kind::program) {
+      begin_struct("ASTNodeProgram");
+      statements("body", FlatAST::root);
+      end_struct();
+    } else {
+      function_def(FlatAST::root);
+    }
     return output.str();
   }
 
-  void operator()(const ASTNodeProgram &node) {
-    begin_struct("ASTNodeProgram");
-    begin_vector_field("body");
+private:
+  using Index = FlatAST::Index;
+  using Kind = FlatAST::Kind;
+
+  void statements(const std::string &name, Index node) {
+    begin_vector_field(name);
+
+    for (Index stmt = ast.first_child(node); stmt != FlatAST::none;
+         stmt = ast.next_sibling(stmt)) {
+      begin_struct("ASTNodeStmt");
+      begin_variant_field("child");
+      statement(stmt);
+      end_variant_field();
+      end_struct();
 
-    for (const auto &stmt : node.body) {
-      (*this)(stmt);
       put_indent();
       output << ",\n";
     }
 
     end_vector_field();
-    end_struct();
   }
 
-  void operator()(const ASTNodeStmt &node) {
-    begin_struct("ASTNodeStmt");
-    begin_variant_field("child");
-
-    std::visit(*this, node.child);
-
-    end_variant_field();
-    end_struct();
+  void statement(Index node) {
+    switch (ast.kind(node)) {
+    case Kind::return_:
+      begin_struct("ASTNodeReturn");
+      expr_field("expr", ast.first_child(node));
+      end_struct();
+      break;
+    case Kind::let:
+    case Kind::assign:
+      begin_struct(ast.kind(node) == Kind::let ? "ASTNodeLet"
+                                               : "ASTNodeAssign");
+      field("identifier", ast.token(node));
+      expr_field("expr", ast.first_child(node));
+      end_struct();
+      break;
+    case Kind::scope:
+      scope(node);
+      break;
+    case Kind::if_:
+      conditional("ASTNodeIf", node);
+      break;
+    case Kind::function_def:
+      function_def(node);
+      break;
+    default:
+      break;
+    }
   }
 
-  void operator()(const ASTNodeReturn &node) {
-    begin_struct("ASTNodeReturn");
-    begin_field("expr");
-    (*this)(node.expr);
-    end_field();
+  void scope(Index node) {
+    begin_struct("ASTNodeScope");
+    statements("body", node);
     end_struct();
   }
 
-  void operator()(const ASTNodeLet &node) {
-    begin_struct("ASTNodeLet");
-    field("identifier", node.identifier);
-    begin_field("expr");
-    (*this)(node.expr);
+  void scope_field(const std::string &name, Index node) {
+    begin_field(name);
+    scope(node);
     end_field();
-    end_struct();
   }
 
-  void operator()(const ASTNodeAssign &node) {
-    begin_struct("ASTNodeAssign");
-    field("identifier", node.identifier);
-    begin_field("expr");
-    (*this)(node.expr);
-    end_field();
-    end_struct();
-  }
+  /// An if or else-if, and what follows it
+  void conditional(const std::string &name, Index node) {
+    begin_struct(name);
 
-  void operator()(const ASTNodeScope &node) {
-    begin_struct("ASTNodeScope");
-    begin_vector_field("body");
+    Index condition = ast.first_child(node);
+    Index body = ast.next_sibling(condition);
+    Index rest = ast.next_sibling(body);
+    expr_field("condition", condition);
+    scope_field("body", body);
 
-    for (const auto &stmt : node.body) {
-      (*this)(stmt);
+    if (rest == FlatAST::none) {
       put_indent();
-      output << ",\n";
-    }
-
-    end_vector_field();
-    end_struct();
-  }
-
-  void operator()(const ASTNodeIf &node) {
-    begin_struct("ASTNodeIf");
-
-    begin_field("condition");
-    (*this)(node.condition);
-    end_field();
-
-    begin_field("body");
-    (*this)(node.body);
-    end_field();
-
-    if (std::holds_alternative<std::monostate>(node.rest)) {
       output << ".rest = std::monostate{},\n";
     } else {
       begin_variant_field("rest");
-      std::visit(*this, node.rest);
+      if (ast.kind(rest) == Kind::else_if) {
+        conditional("ASTNodeElseIf", rest);
+      } else {
+        begin_struct("ASTNodeElse");
+        scope_field("body", ast.first_child(rest));
+        end_struct();
+      }
       end_variant_field();
     }
 
     end_struct();
   }
 
-  void operator()(const ASTNodeElseIf &node) {
-    begin_struct("ASTNodeElseIf");
+  void function_def(Index node) {
+    begin_struct("ASTNodeFunctionDef");
 
-    begin_field("condition");
-    (*this)(node.condition);
-    end_field();
+    field("name", ast.token(node));
 
-    begin_field("body");
-    (*this)(node.body);
-    end_field();
+    std::vector<Token> arg_names;
+    Index child = ast.first_child(node);
+    for (; ast.kind(child) == Kind::parameter;
+         child = ast.next_sibling(child)) {
+      arg_names.push_back(ast.token(child));
+    }
+    field("arg_names", arg_names);
 
-    if (std::holds_alternative<std::monostate>(node.rest)) {
-      output << ".rest = std::monostate{},\n";
+    if (ast.kind(child) == Kind::skipped_body) {
+      auto [begin, end] = ast.skipped_body(child);
+      put_indent();
+      output << ".skipped_body = {{" << begin << ", " << end << "}},\n";
     } else {
-      begin_variant_field("rest");
-      std::visit(*this, node.rest);
-      end_variant_field();
+      scope_field("body", child);
     }
 
     end_struct();
   }
 
-  void operator()(const ASTNodeFunctionDef &node) {
-    begin_struct("ASTNodeFunctionDef");
-
-    field("name", node.name);
-    field("arg_names", node.arg_names);
-
-    begin_field("body");
-    (*this)(node.body);
-    end_field();
-
-    end_struct();
-  }
-
-  void operator()(const ASTNodeElse &node) {
-    begin_struct("ASTNodeElse");
-
-    begin_field("body");
-    (*this)(node.body);
+  void expr_field(const std::string &name, Index node) {
+    begin_field(name);
+    expr(node);
     end_field();
-
-    end_struct();
   }
 
-  void operator()(const ASTNodeExpr &node) {
+  void expr(Index node) {
     begin_struct("ASTNodeExpr");
     begin_variant_field("child");
-    std::visit(*this, node.child);
-    end_variant_field();
-    end_struct();
-  }
-
-  void operator()(const ASTNodeTerm &node) {
-    begin_struct("ASTNodeTerm");
-    begin_variant_field("child");
-    std::visit(*this, node.child);
-    end_variant_field();
-    end_struct();
-  }
-
-  void operator()(const ASTNodeBinExpr &node) {
-    begin_struct("ASTNodeBinExpr");
-
-    begin_field("lhs");
-    (*this)(node.lhs);
-    end_field();
-
-    begin_field("rhs");
-    (*this)(node.rhs);
-    end_field();
 
-    put_indent();
-    output << ".op = BinOp::" << to_string(node.op) << ",\n";
+    if (ast.kind(node) == Kind::bin_expr) {
+      begin_struct("ASTNodeBinExpr");
 
-    end_struct();
-  }
+      Index lhs = ast.first_child(node);
+      expr_field("lhs", lhs);
+      expr_field("rhs", ast.next_sibling(lhs));
 
-  void operator()(const ASTNodeIntegerLiteral &node) {
-    begin_struct("ASTNodeIntegerLiteral");
-    field("token", node.token);
-    end_struct();
-  }
-
-  void operator()(const ASTNodeDoubleLiteral &node) {
-    begin_struct("ASTNodeDoubleLiteral");
-    field("token", node.token);
-    end_struct();
-  }
+      put_indent();
+      output << ".op = BinOp::"
+             << to_string(*bin_op_for_token(ast.token(node).type)) << ",\n";
 
-  void operator()(const ASTNodeIdentifier &node) {
-    begin_struct("ASTNodeIdentifier");
-    field("token", node.token);
-    end_struct();
-  }
+      end_struct();
+    } else {
+      term(node);
+    }
 
-  void operator()(const ASTNodeParenExpr &node) {
-    begin_struct("ASTNodeParenExpr");
-    begin_field("child");
-    (*this)(node.child);
-    end_field();
+    end_variant_field();
     end_struct();
   }
 
-  void operator()(const ASTNodeFunctionCall &node) {
-    begin_struct("ASTNodeFunctionCall");
-    field("name", node.name);
+  void term(Index node) {
+    begin_struct("ASTNodeTerm");
+    begin_variant_field("child");
 
-    begin_vector_field("body");
+    switch (ast.kind(node)) {
+    case Kind::integer_literal:
+      token_struct("ASTNodeIntegerLiteral", node);
+      break;
+    case Kind::double_literal:
+      token_struct("ASTNodeDoubleLiteral", node);
+      break;
+    case Kind::boolean_literal:
+      token_struct("ASTNodeBooleanLiteral", node);
+      break;
+    case Kind::null_literal:
+      token_struct("ASTNodeNullLiteral", node);
+      break;
+    case Kind::string_literal:
+      token_struct("ASTNodeStringLiteral", node);
+      break;
+    case Kind::identifier:
+      token_struct("ASTNodeIdentifier", node);
+      break;
+    case Kind::paren_expr:
+      begin_struct("ASTNodeParenExpr");
+      expr_field("child", ast.first_child(node));
+      end_struct();
+      break;
+    case Kind::function_call:
+      begin_struct("ASTNodeFunctionCall");
+      field("name", ast.token(node));
+
+      begin_vector_field("body");
+      for (Index arg = ast.first_child(node); arg != FlatAST::none;
+           arg = ast.next_sibling(arg)) {
+        expr(arg);
+        put_indent();
+        output << ",\n";
+      }
+      end_vector_field();
 
-    for (const auto &argument : node.arguments) {
-      (*this)(argument);
-      put_indent();
-      output << ",\n";
+      end_struct();
+      break;
+    default:
+      break;
     }
 
-    end_vector_field();
-
+    end_variant_field();
     end_struct();
   }
 
-  void operator()(const std::monostate &node) {
-    // printing of monostate handled nicer elsewhere
-  }
-
-  template <typename T> void operator()(const valuable::value_ptr<T> &ptr) {
-    return (*this)(*ptr);
+  /// A node that's just a token
+  void token_struct(const std::string &name, Index node) {
+    begin_struct(name);
+    field("token", ast.token(node));
+    end_struct();
   }
 
-private:
   void begin_struct(const std::string &name) {
     put_indent();
     output << "(" << name << "){\n";
@@ -327,7 +321,7 @@ private:
     }
   }
 
-  Root root;
+  const FlatAST &ast;
 
   std::stringstream output{};
   int indent = 0;
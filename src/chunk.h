@@ -0,0 +1,323 @@
+#pragma once
+
+#include "value.h"
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <string>
+#include <vector>
+
+enum Op : int {
+  // load_const  X :  Pushes constant X from constant table
+  load_const,
+  // define_global  X :  Define global in slot X of the global table
+  define_global,
+  // get_global  X :  Gets global in slot X of the global table
+  get_global,
+  // set_global  X :  Sets global in slot X of the global table to value at top
+  // of stack (and pops it)
+  set_global,
+  // get_local  N :  Gets local variable (N is relative to frame pointer)
+  get_local,
+  // set_local  N :  Sets local variable to value at top of stack (and pops it)
+  set_local,
+  // add :  Adds top 2 elements on stack
+  add,
+  // subtract :  Subtracts top 2 elements on stack (a=pop(); b=pop(); push(b -
+  // a))
+  subtract,
+  // multiply :  Multiplies top 2 elements on stack
+  multiply,
+  // divide :  Divides top 2 elements on the stack (a=pop(); b=pop(); push(b/a))
+  divide,
+  // pop : Pops one element off the top of the stack
+  pop,
+  // jump N : Jumps N instructions
+  jump,
+  // jump_if_zero N : Jumps N instructions if top of stack is zero (and pops it)
+  jump_if_zero,
+  // call N :  Calls function with N args.  Args are last N values on stack, and
+  //           function to be called is below that.  Pops function & args, and
+  //           pushes result.
+  call,
+  // return :  Returns top value on stack
+  return_,
+  // tail_call N :  Like `call` followed by `return`, but reuses the current
+  //                frame: the function & args replace the caller's frame
+  tail_call,
+
+  // Quickened arithmetic.  The VM rewrites a generic arithmetic op into one of
+  // these in place based on the operand types it sees the first time it runs,
+  // and rewrites it back to the generic op if the types later change.
+  add_int_int,
+  add_double_double,
+  subtract_int_int,
+  subtract_double_double,
+  multiply_int_int,
+  multiply_double_double,
+  divide_int_int,
+  divide_double_double,
+
+  // Superinstructions, fused from common opcode sequences by
+  // `fuse_superinstructions`.  Each takes the arguments of the ops it replaces,
+  // in order.
+  get_local_load_const_subtract,
+  get_local_get_local,
+  get_local_jump_if_zero,
+  load_const_return,
+  add_return,
+
+  // constant for
+  OP_COUNT
+};
+
+inline std::string to_string(Op op) {
+  switch (op) {
+  case load_const:
+    return "load_const";
+  case define_global:
+    return "define_global";
+  case get_global:
+    return "get_global";
+  case set_global:
+    return "set_global";
+  case get_local:
+    return "get_local";
+  case set_local:
+    return "set_local";
+  case add:
+    return "add";
+  case subtract:
+    return "subtract";
+  case multiply:
+    return "multiply";
+  case divide:
+    return "divide";
+  case pop:
+    return "pop";
+  case jump:
+    return "jump";
+  case jump_if_zero:
+    return "jump_if_zero";
+  case call:
+    return "call";
+  case return_:
+    return "return_";
+  case tail_call:
+    return "tail_call";
+  case add_int_int:
+    return "add_int_int";
+  case add_double_double:
+    return "add_double_double";
+  case subtract_int_int:
+    return "subtract_int_int";
+  case subtract_double_double:
+    return "subtract_double_double";
+  case multiply_int_int:
+    return "multiply_int_int";
+  case multiply_double_double:
+    return "multiply_double_double";
+  case divide_int_int:
+    return "divide_int_int";
+  case divide_double_double:
+    return "divide_double_double";
+  case get_local_load_const_subtract:
+    return "get_local_load_const_subtract";
+  case get_local_get_local:
+    return "get_local_get_local";
+  case get_local_jump_if_zero:
+    return "get_local_jump_if_zero";
+  case load_const_return:
+    return "load_const_return";
+  case add_return:
+    return "add_return";
+  case OP_COUNT:
+    return "<invalid>";
+  }
+  return "<invalid>";
+}
+
+inline int op_n_args(Op op) {
+  switch (op) {
+  case load_const:
+    return 1;
+  case define_global:
+  case get_global:
+  case set_global:
+    return 1;
+  case get_local:
+  case set_local:
+    return 1;
+  case add:
+  case subtract:
+  case multiply:
+  case divide:
+  case pop:
+    return 0;
+  case add_int_int:
+  case add_double_double:
+  case subtract_int_int:
+  case subtract_double_double:
+  case multiply_int_int:
+  case multiply_double_double:
+  case divide_int_int:
+  case divide_double_double:
+    return 0;
+  case get_local_load_const_subtract:
+  case get_local_get_local:
+  case get_local_jump_if_zero:
+    return 2;
+  case load_const_return:
+    return 1;
+  case add_return:
+    return 0;
+  case jump:
+  case jump_if_zero:
+    return 1;
+  case call:
+    return 1;
+  case return_:
+    return 0;
+  case tail_call:
+    return 1;
+  case OP_COUNT:
+    return 0;
+  }
+
+  return 0;
+}
+
+/// Net change in stack depth from running `op` with argument `arg`.  Returns
+/// are treated as popping their result, so a linear scan over a chunk sees the
+/// same depth at a jump target as the code jumping there.  Only defined for ops
+/// the compiler emits directly (not superinstructions).
+inline int op_stack_effect(Op op, int arg) {
+  switch (op) {
+  case load_const:
+  case get_global:
+  case get_local:
+    return 1;
+  case define_global:
+  case set_global:
+  case set_local:
+  case pop:
+  case jump_if_zero:
+  case return_:
+    return -1;
+  case add:
+  case subtract:
+  case multiply:
+  case divide:
+  case add_int_int:
+  case add_double_double:
+  case subtract_int_int:
+  case subtract_double_double:
+  case multiply_int_int:
+  case multiply_double_double:
+  case divide_int_int:
+  case divide_double_double:
+    return -1;
+  case jump:
+    return 0;
+  case call:
+    // pops function & args, pushes result
+    return -arg;
+  case tail_call:
+    return -arg - 1;
+  case get_local_load_const_subtract:
+  case get_local_get_local:
+  case get_local_jump_if_zero:
+  case load_const_return:
+  case add_return:
+  case OP_COUNT:
+    assert(false);
+  }
+
+  return 0;
+}
+
+/// The generic op a quickened op was specialized from
+inline Op unquickened(Op op) {
+  switch (op) {
+  case Op::add_int_int:
+  case Op::add_double_double:
+    return Op::add;
+  case Op::subtract_int_int:
+  case Op::subtract_double_double:
+    return Op::subtract;
+  case Op::multiply_int_int:
+  case Op::multiply_double_double:
+    return Op::multiply;
+  case Op::divide_int_int:
+  case Op::divide_double_double:
+    return Op::divide;
+  default:
+    return op;
+  }
+}
+
+struct LazyBody;
+struct NativeCode;
+struct TraceTree;
+
+/// How far a function's code has been promoted.  Each tier costs more to
+/// produce than the last, so only functions that get hot reach the later ones.
+enum class Tier { bytecode, superinstructions, native };
+
+inline std::string to_string(Tier tier) {
+  switch (tier) {
+  case Tier::bytecode:
+    return "bytecode";
+  case Tier::superinstructions:
+    return "superinstructions";
+  case Tier::native:
+    return "native";
+  }
+  return "<invalid>";
+}
+
+struct Chunk {
+  /// Set until the function is first called, when its body is compiled (see
+  /// `CompilerOptions::lazy`).  Until then the rest of the chunk is empty.
+  std::shared_ptr<LazyBody> lazy;
+
+  std::vector<int> code;
+  std::vector<Value> constants;
+  /// Most stack slots the code uses above its arguments, so the VM can check
+  /// for room once per call rather than on every push
+  int max_stack = 0;
+
+  /// Number of calls so far, used by the VM to decide when to promote the
+  /// code to its next tier
+  int call_count = 0;
+  Tier tier = Tier::bytecode;
+  /// Code from before superinstructions were fused in, kept alive for frames
+  /// that were still running it
+  std::vector<int> unfused_code;
+  /// JIT compiled machine code, once the function is hot
+  std::shared_ptr<NativeCode> native;
+  /// Set if the JIT can't compile this chunk, so it isn't retried
+  bool jit_failed = false;
+  /// Traces recorded from the function's entry, with `--jit=trace`
+  std::shared_ptr<TraceTree> trace;
+  /// Times the call op at each offset of `code` has run, for picking where
+  /// to record traces.  Empty until one is counted.
+  std::vector<int> call_site_counts;
+};
+
+inline int compute_max_stack(const Chunk &chunk) {
+  int depth = 0;
+  int max_depth = 0;
+
+  for (size_t offset = 0; offset < chunk.code.size();) {
+    Op op = (Op)chunk.code[offset];
+    int arg = op_n_args(op) > 0 ? chunk.code[offset + 1] : 0;
+
+    depth += op_stack_effect(op, arg);
+    max_depth = std::max(max_depth, depth);
+
+    offset += 1 + op_n_args(op);
+  }
+
+  return max_depth;
+}
@@ -0,0 +1,601 @@
+#pragma once
+
+#include "compiler.h"
+#include "native_stack.h"
+#include "runtime_checks.h"
+#include <functional>
+
+/// What a statement hands control to
+enum class Flow { next, return_, tail_call };
+
+/// An expression, evaluated in the frame whose slots start at `fp`.  Slots are
+/// laid out as in the stack VM: the function, its arguments, then its locals.
+using ClosureExpr = std::function<Value(Value *fp)>;
+using ClosureStmt = std::function<Flow(Value *fp)>;
+
+struct ClosureCode {
+  std::vector<ClosureStmt> body;
+  /// Slots the function uses, including the function and its arguments
+  int num_slots = 1;
+};
+
+/// State the compiled closures run against: globals, and calls, which recurse
+/// on the native stack
+class ClosureRuntime {
+public:
+  ClosureRuntime(int max_call_depth) : max_call_depth(max_call_depth) {}
+
+  /// Calls `callee` with `args`, evaluated in the caller's frame `fp`
+  Value call(Value callee, const std::vector<ClosureExpr> &args, Value *fp) {
+    int arg_count = args.size();
+    if (callee.type() != ValueType::function ||
+        callee.function_value().arity != arg_count) {
+      // the args are evaluated before the call is checked, as in the VMs
+      for (const ClosureExpr &arg : args) {
+        arg(fp);
+      }
+      check_call(callee, arg_count);
+    }
+
+    Frame frame(callee.function_value().closure_code->num_slots);
+    frame.fp[0] = std::move(callee);
+    for (int i = 0; i < arg_count; i++) {
+      frame.fp[i + 1] = args[i](fp);
+    }
+    return run(frame);
+  }
+
+  /// Calls the function at `callee` with the `arg_count` args after it,
+  /// which are moved from
+  Value call(Value *callee, int arg_count) {
+    const Function &f = check_call(*callee, arg_count);
+
+    Frame frame(f.closure_code->num_slots);
+    for (int i = 0; i <= arg_count; i++) {
+      frame.fp[i] = std::move(callee[i]);
+    }
+    return run(frame);
+  }
+
+  /// Starts a tail call of the function and args pushed to `tail_call_args`
+  Flow tail_call(int arg_count) {
+    tail_call_arg_count = arg_count;
+    return Flow::tail_call;
+  }
+
+  [[noreturn]] void global_error(int index, const char *message) {
+    ::global_error(global_table.name(index), message);
+  }
+
+  GlobalTable global_table;
+  std::vector<Global> globals;
+
+  /// Value of the `return` statement that ended the current function
+  Value result;
+  /// Tail calls' functions & args, pushed on top of those of any tail calls
+  /// their args are evaluated within
+  std::vector<Value> tail_call_args;
+
+  /// Native stack calls may recurse on
+  NativeStack native_stack;
+
+private:
+  /// Slots of a running function, kept on the native stack unless there are
+  /// more than a few
+  struct Frame {
+    static constexpr int INLINE_SLOTS = 8;
+
+    Frame(int num_slots) { reserve(num_slots); }
+
+    void reserve(int num_slots) {
+      if (num_slots > capacity) {
+        heap_slots = std::make_unique<Value[]>(num_slots);
+        fp = heap_slots.get();
+        capacity = num_slots;
+      }
+    }
+
+    Value inline_slots[INLINE_SLOTS];
+    std::unique_ptr<Value[]> heap_slots;
+    Value *fp = inline_slots;
+    int capacity = INLINE_SLOTS;
+  };
+
+  /// Runs the function in `frame` until it returns, following its tail calls
+  /// without growing the native stack
+  Value run(Frame &frame) {
+    if (call_depth == max_call_depth) {
+      call_depth_error(max_call_depth);
+    } else if (native_stack.exhausted()) {
+      NativeStack::overflow_error();
+    }
+    call_depth++;
+
+    while (true) {
+      Flow flow = Flow::next;
+      for (const ClosureStmt &stmt :
+           frame.fp[0].function_value().closure_code->body) {
+        if ((flow = stmt(frame.fp)) != Flow::next) {
+          break;
+        }
+      }
+
+      if (flow == Flow::tail_call) {
+        // move the function & args down over the current frame
+        size_t base = tail_call_args.size() - tail_call_arg_count - 1;
+        const Function &f =
+            check_call(tail_call_args[base], tail_call_arg_count);
+        frame.reserve(f.closure_code->num_slots);
+        for (int i = 0; i <= tail_call_arg_count; i++) {
+          frame.fp[i] = std::move(tail_call_args[base + i]);
+        }
+        tail_call_args.resize(base);
+        continue;
+      }
+
+      call_depth--;
+      // TODO: Switch to returning a nil instead
+      Value r = flow == Flow::return_ ? std::move(result) : Value::of(0);
+      return r;
+    }
+  }
+
+  int max_call_depth;
+  int call_depth = 0;
+  int tail_call_arg_count = 0;
+};
+
+/// Compiles the AST into a tree of closures, with every variable resolved to
+/// its slot or global index up front.  Running them skips bytecode and the
+/// dispatch loop entirely, at the cost of an indirect call per node - a good
+/// trade for code that runs once or only a few times.
+class ClosureCompiler {
+public:
+  ClosureCompiler(ClosureRuntime &runtime,
+                  CompilerKind kind = CompilerKind::script)
+      : runtime(runtime), locals(kind) {}
+
+  static Function compile(std::string_view source, ClosureRuntime &runtime) {
+    Lexer lexer(source);
+    Parser parser(lexer);
+    ClosureCompiler compiler(runtime, CompilerKind::script);
+    return compiler.compile(parser.parse());
+  }
+
+  Function compile(const ASTNodeProgram &node) {
+    for (const auto &stmt : node.body) {
+      code.body.push_back(statement(stmt));
+    }
+
+    return finish("(script)", 0);
+  }
+
+  Function compile(const ASTNodeFunctionDef &node) {
+    for (const auto &arg : node.arg_names) {
+      // args are effectively locals, so we can simply define them as locals
+      define_local(arg.value);
+    }
+
+    for (const auto &stmt : node.body.body) {
+      code.body.push_back(statement(stmt));
+    }
+
+    return finish(std::string(node.name.value), node.arg_names.size());
+  }
+
+private:
+  ClosureStmt statement(const ASTNodeStmt &node) {
+    return std::visit([this](const auto &child) { return (*this)(child); },
+                      node.child);
+  }
+
+  ClosureStmt operator()(const ASTNodeReturn &node) {
+    ClosureRuntime *rt = &runtime;
+
+    if (const ASTNodeFunctionCall *call = as_call(node.expr)) {
+      ClosureExpr callee = identifier(call->name.value);
+      std::vector<ClosureExpr> args = arguments(*call);
+      return [rt, callee, args](Value *fp) {
+        rt->tail_call_args.push_back(callee(fp));
+        for (const ClosureExpr &arg : args) {
+          rt->tail_call_args.push_back(arg(fp));
+        }
+        return rt->tail_call(args.size());
+      };
+    }
+
+    ClosureExpr e = expr(node.expr);
+    return [rt, e](Value *fp) {
+      rt->result = e(fp);
+      return Flow::return_;
+    };
+  }
+
+  ClosureStmt operator()(const ASTNodeLet &node) {
+    ClosureExpr e = expr(node.expr);
+    return define(node.identifier.value, std::move(e));
+  }
+
+  ClosureStmt operator()(const ASTNodeAssign &node) {
+    ClosureExpr e = expr(node.expr);
+
+    auto var = locals.lookup(node.identifier.value);
+    if (Vars::Local *local = std::get_if<Vars::Local>(&var)) {
+      int slot = local->index + 1;
+      return [slot, e](Value *fp) {
+        fp[slot] = e(fp);
+        return Flow::next;
+      };
+    }
+
+    ClosureRuntime *rt = &runtime;
+    int index = runtime.global_table.resolve(std::get<Vars::Global>(var).name);
+    return [rt, index, e](Value *fp) {
+      Value v = e(fp);
+      Global &global = rt->globals[index];
+      if (!global.defined) {
+        rt->global_error(index, "not defined");
+      }
+      global.value = std::move(v);
+      return Flow::next;
+    };
+  }
+
+  ClosureStmt operator()(const ast_ptr<ASTNodeScope> &node) {
+    return [body = block(*node)](Value *fp) { return run_block(body, fp); };
+  }
+
+  /// Compiles an if and its else-ifs into one closure that tries each
+  /// condition in turn, so a long chain neither nests closures nor recurses
+  ClosureStmt operator()(const ast_ptr<ASTNodeIf> &node) {
+    std::vector<Arm> arms;
+    arms.push_back({expr(node->condition), block(node->body)});
+
+    std::vector<ClosureStmt> otherwise;
+    const ASTNodeIf::Rest *rest = &node->rest;
+    while (auto *else_if = std::get_if<ast_ptr<ASTNodeElseIf>>(rest)) {
+      arms.push_back({expr((*else_if)->condition), block((*else_if)->body)});
+      rest = &(*else_if)->rest;
+    }
+    if (auto *else_ = std::get_if<ast_ptr<ASTNodeElse>>(rest)) {
+      otherwise = block((*else_)->body);
+    }
+
+    return [arms = std::move(arms),
+            otherwise = std::move(otherwise)](Value *fp) {
+      for (const Arm &arm : arms) {
+        if (arm.condition(fp)) {
+          return run_block(arm.body, fp);
+        }
+      }
+      return run_block(otherwise, fp);
+    };
+  }
+
+  ClosureStmt operator()(const ast_ptr<ASTNodeFunctionDef> &node) {
+    ClosureCompiler compiler(runtime, CompilerKind::function);
+    Value function = Value::of(compiler.compile(*node));
+    return define(node->name.value,
+                  [function](Value *) -> Value { return function; });
+  }
+
+  /// A condition of an if chain, and what runs if it's the first to hold
+  struct Arm {
+    ClosureExpr condition;
+    std::vector<ClosureStmt> body;
+  };
+
+  std::vector<ClosureStmt> block(const ASTNodeScope &node) {
+    locals.start_scope();
+
+    std::vector<ClosureStmt> body;
+    for (const auto &stmt : node.body) {
+      body.push_back(statement(stmt));
+    }
+
+    // slots of the scope's locals are reused, so needn't be cleared
+    locals.end_scope();
+    return body;
+  }
+
+  static Flow run_block(const std::vector<ClosureStmt> &body, Value *fp) {
+    for (const ClosureStmt &stmt : body) {
+      Flow flow = stmt(fp);
+      if (flow != Flow::next) {
+        return flow;
+      }
+    }
+    return Flow::next;
+  }
+
+  /// Defines `name` (after evaluating `e`, so it can't refer to itself)
+  ClosureStmt define(std::string_view name, ClosureExpr e) {
+    auto var = locals.define(name);
+    if (Vars::Local *local = std::get_if<Vars::Local>(&var)) {
+      int slot = local->index + 1;
+      code.num_slots = std::max(code.num_slots, slot + 1);
+      return [slot, e](Value *fp) {
+        fp[slot] = e(fp);
+        return Flow::next;
+      };
+    }
+
+    ClosureRuntime *rt = &runtime;
+    int index = runtime.global_table.resolve(std::get<Vars::Global>(var).name);
+    return [rt, index, e](Value *fp) {
+      Value v = e(fp);
+      Global &global = rt->globals[index];
+      if (global.defined) {
+        rt->global_error(index, "already defined");
+      }
+      global.value = std::move(v);
+      global.defined = true;
+      return Flow::next;
+    };
+  }
+
+  /// Reads a local's slot in place
+  struct LocalOperand {
+    int slot;
+    const Value &operator()(Value *fp) const { return fp[slot]; }
+  };
+
+  struct ConstantOperand {
+    Value value;
+    const Value &operator()(Value *) const { return value; }
+  };
+
+  /// Closures nested deeper than this for a single expression are left to
+  /// `steps`
+  static constexpr int MAX_NESTING = 64;
+
+  /// Compiles `node` into a tree of closures, or into `steps` if it nests too
+  /// deeply to build, run and destroy the tree without recursing as far
+  ClosureExpr expr(const ASTNodeExpr &node) {
+    if (nests_deeper(node, MAX_NESTING)) {
+      return steps(node);
+    }
+    return tree(node);
+  }
+
+  ClosureExpr tree(const ASTNodeExpr &node) {
+    if (auto *bin = std::get_if<ASTNodeBinExpr>(&node.child)) {
+      return arithmetic(*bin);
+    }
+
+    const ASTNodeTerm &term = std::get<ASTNodeTerm>(node.child);
+    if (std::optional<Value> k = literal(node)) {
+      return [v = std::move(*k)](Value *) -> Value { return v; };
+    } else if (auto *id = std::get_if<ASTNodeIdentifier>(&term.child)) {
+      return identifier(id->token.value);
+    } else if (auto *paren =
+                   std::get_if<ast_ptr<ASTNodeParenExpr>>(&term.child)) {
+      return tree(*(*paren)->child);
+    }
+
+    auto &call = std::get<ast_ptr<ASTNodeFunctionCall>>(term.child);
+    ClosureRuntime *rt = &runtime;
+    ClosureExpr callee = identifier(call->name.value);
+    std::vector<ClosureExpr> args = arguments(*call);
+    return [rt, callee, args](Value *fp) {
+      return rt->call(callee(fp), args, fp);
+    };
+  }
+
+  /// An operation of an expression compiled by `steps`
+  struct Step {
+    enum class Kind { push, arithmetic, call };
+
+    Kind kind;
+    /// What `push` pushes
+    ClosureExpr value;
+    BinOp op = BinOp::add;
+    int arg_count = 0;
+  };
+
+  /// Compiles `node` into steps run one after another on a stack of values,
+  /// like the stack VM's bytecode, leaving only its shallow subexpressions as
+  /// closures.  Operations wait on a stack until their operands have been
+  /// compiled.
+  ClosureExpr steps(const ASTNodeExpr &node) {
+    std::vector<Step> program;
+    std::vector<std::pair<const ASTNodeExpr *, bool>> pending = {
+        {&node, false}};
+
+    while (!pending.empty()) {
+      auto [e, operands_done] = pending.back();
+      pending.pop_back();
+
+      auto *bin = std::get_if<ASTNodeBinExpr>(&e->child);
+      const ASTNodeTerm *term = std::get_if<ASTNodeTerm>(&e->child);
+      auto *call =
+          term ? std::get_if<ast_ptr<ASTNodeFunctionCall>>(&term->child)
+               : nullptr;
+
+      if (operands_done && bin) {
+        program.push_back({.kind = Step::Kind::arithmetic, .op = bin->op});
+      } else if (operands_done) {
+        program.push_back({.kind = Step::Kind::call,
+                         .arg_count = (int)(*call)->arguments.size()});
+      } else if (!nests_deeper(*e, MAX_NESTING)) {
+        program.push_back({.kind = Step::Kind::push, .value = tree(*e)});
+      } else if (bin) {
+        pending.push_back({e, true});
+        pending.push_back({bin->rhs.get(), false});
+        pending.push_back({bin->lhs.get(), false});
+      } else if (call) {
+        program.push_back({.kind = Step::Kind::push,
+                         .value = identifier((*call)->name.value)});
+        pending.push_back({e, true});
+        const auto &args = (*call)->arguments;
+        for (auto it = args.rbegin(); it != args.rend(); it++) {
+          pending.push_back({&*it, false});
+        }
+      } else {
+        auto &paren = std::get<ast_ptr<ASTNodeParenExpr>>(term->child);
+        pending.push_back({paren->child.get(), false});
+      }
+    }
+
+    ClosureRuntime *rt = &runtime;
+    return [rt, program = std::move(program)](Value *fp) {
+      std::vector<Value> stack;
+      for (const Step &step : program) {
+        switch (step.kind) {
+        case Step::Kind::push:
+          stack.push_back(step.value(fp));
+          break;
+        case Step::Kind::arithmetic: {
+          Value rhs = std::move(stack.back());
+          stack.pop_back();
+          apply(step.op, stack.back(), rhs);
+          break;
+        }
+        case Step::Kind::call: {
+          size_t base = stack.size() - step.arg_count - 1;
+          Value result = rt->call(&stack[base], step.arg_count);
+          stack.resize(base);
+          stack.push_back(std::move(result));
+          break;
+        }
+        }
+      }
+      return std::move(stack.back());
+    };
+  }
+
+  /// Whether `node` nests more than `depth` levels deep
+  static bool nests_deeper(const ASTNodeExpr &node, int depth) {
+    if (depth == 0) {
+      return true;
+    } else if (auto *bin = std::get_if<ASTNodeBinExpr>(&node.child)) {
+      return nests_deeper(*bin->lhs, depth - 1) ||
+             nests_deeper(*bin->rhs, depth - 1);
+    }
+
+    const ASTNodeTerm &term = std::get<ASTNodeTerm>(node.child);
+    if (auto *paren = std::get_if<ast_ptr<ASTNodeParenExpr>>(&term.child)) {
+      return nests_deeper(*(*paren)->child, depth - 1);
+    } else if (auto *call =
+                   std::get_if<ast_ptr<ASTNodeFunctionCall>>(&term.child)) {
+      for (const auto &arg : (*call)->arguments) {
+        if (nests_deeper(arg, depth - 1)) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  ClosureExpr identifier(std::string_view name) {
+    auto var = locals.lookup(name);
+    if (Vars::Local *local = std::get_if<Vars::Local>(&var)) {
+      return [slot = local->index + 1](Value *fp) { return fp[slot]; };
+    }
+
+    ClosureRuntime *rt = &runtime;
+    int index = runtime.global_table.resolve(std::get<Vars::Global>(var).name);
+    return [rt, index](Value *) {
+      const Global &global = rt->globals[index];
+      if (!global.defined) {
+        rt->global_error(index, "not defined");
+      }
+      return global.value;
+    };
+  }
+
+  std::vector<ClosureExpr> arguments(const ASTNodeFunctionCall &node) {
+    std::vector<ClosureExpr> args;
+    for (const auto &arg : node.arguments) {
+      args.push_back(expr(arg));
+    }
+    return args;
+  }
+
+  /// Builds `lhs op rhs`, reading locals and constants in place rather than
+  /// through a closure of their own
+  ClosureExpr arithmetic(const ASTNodeBinExpr &node) {
+    std::optional<int> lhs_slot = local_slot(locals, *node.lhs);
+    std::optional<int> rhs_slot = local_slot(locals, *node.rhs);
+    std::optional<Value> k = literal(*node.rhs);
+
+    auto with_rhs = [&](auto lhs) -> ClosureExpr {
+      if (rhs_slot) {
+        return arithmetic(node.op, lhs, LocalOperand{*rhs_slot});
+      } else if (k) {
+        return arithmetic(node.op, lhs, ConstantOperand{std::move(*k)});
+      }
+      return arithmetic(node.op, lhs, tree(*node.rhs));
+    };
+
+    if (lhs_slot) {
+      return with_rhs(LocalOperand{*lhs_slot});
+    }
+    return with_rhs(tree(*node.lhs));
+  }
+
+  template <typename Lhs, typename Rhs>
+  static ClosureExpr arithmetic(BinOp op, Lhs lhs, Rhs rhs) {
+    switch (op) {
+    case BinOp::add:
+      return [lhs, rhs](Value *fp) {
+        Value a = lhs(fp);
+        a += rhs(fp);
+        return a;
+      };
+    case BinOp::subtract:
+      return [lhs, rhs](Value *fp) {
+        Value a = lhs(fp);
+        a -= rhs(fp);
+        return a;
+      };
+    case BinOp::multiply:
+      return [lhs, rhs](Value *fp) {
+        Value a = lhs(fp);
+        a *= rhs(fp);
+        return a;
+      };
+    case BinOp::divide:
+      return [lhs, rhs](Value *fp) {
+        Value a = lhs(fp);
+        a /= rhs(fp);
+        return a;
+      };
+    }
+    return nullptr;
+  }
+
+  static void apply(BinOp op, Value &a, const Value &b) {
+    switch (op) {
+    case BinOp::add:
+      a += b;
+      break;
+    case BinOp::subtract:
+      a -= b;
+      break;
+    case BinOp::multiply:
+      a *= b;
+      break;
+    case BinOp::divide:
+      a /= b;
+      break;
+    }
+  }
+
+  void define_local(std::string_view name) {
+    auto var = locals.define(name);
+    assert(std::holds_alternative<Vars::Local>(var));
+    code.num_slots =
+        std::max(code.num_slots, std::get<Vars::Local>(var).index + 2);
+  }
+
+  Function finish(const std::string &name, int arity) {
+    return Function{.name = name,
+                    .arity = arity,
+                    .closure_code = std::make_shared<ClosureCode>(code)};
+  }
+
+  ClosureCode code{};
+  ClosureRuntime &runtime;
+  Vars locals;
+};
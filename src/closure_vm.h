@@ -0,0 +1,39 @@
+#pragma once
+
+#include "closure_compiler.h"
+#include "vm.h"
+
+/// Runs programs compiled by `ClosureCompiler`.  There's nothing to dispatch:
+/// each node of the program calls its children directly.  Doesn't support the
+/// JIT.
+class ClosureVM {
+public:
+  ClosureVM(VMOptions options = {})
+      : runtime(options.max_call_depth),
+        stack_size(NativeStack::DEFAULT_SIZE +
+                   options.max_call_depth * STACK_PER_CALL) {}
+
+  Value eval(std::string_view source) {
+    Function function = ClosureCompiler::compile(source, runtime);
+    runtime.globals.resize(runtime.global_table.size());
+
+    // calls recurse on the native stack, so they run on one big enough to
+    // reach `max_call_depth`, as they can in the VMs
+    Value result;
+    NativeStack::run_with_stack(stack_size, [&](size_t size) {
+      runtime.native_stack.start(size);
+      result = runtime.call(Value::of(function), {}, nullptr);
+    });
+    return result;
+  }
+
+  Value eval(const Source &source) { return eval(source.text); }
+
+private:
+  /// Native stack allowed per call: about 600 bytes are used optimized, and
+  /// up to 3KB unoptimized with sanitizers
+  static constexpr size_t STACK_PER_CALL = 4 * 1024;
+
+  ClosureRuntime runtime;
+  size_t stack_size;
+};
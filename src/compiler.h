@@ -1,126 +1,23 @@
 #pragma once
 
+#include "chunk.h"
+#include "flat_ast.h"
 #include "lexer.h"
 #include "parser.h"
-#include "value-ptr.hpp"
+#include "superinstructions.h"
 #include "value.h"
+#include <algorithm>
+#include <cassert>
 #include <memory>
+#include <optional>
 #include <span>
 #include <sstream>
 #include <string>
 #include <unordered_map>
+#include <utility>
 
 enum class CompilerKind { script, function };
 
-enum Op : int {
-  // load_const  X :  Pushes constant X from constant table
-  load_const,
-  // define_global  X :  Define global named X from constant table
-  define_global,
-  // get_global  X :  Gets global named X from constant table
-  get_global,
-  // set_global  X :  Sets global named X from constant table to value at top of
-  // stack (and pops it)
-  set_global,
-  // get_local  N :  Gets local variable (N is relative to frame pointer)
-  get_local,
-  // set_local  N :  Sets local variable to value at top of stack (and pops it)
-  set_local,
-  // add :  Adds top 2 elements on stack
-  add,
-  // subtract :  Subtracts top 2 elements on stack (a=pop(); b=pop(); push(b -
-  // a))
-  subtract,
-  // multiply :  Multiplies top 2 elements on stack
-  multiply,
-  // divide :  Divides top 2 elements on the stack (a=pop(); b=pop(); push(b/a))
-  divide,
-  // pop : Pops one element off the top of the stack
-  pop,
-  // jump N : Jumps N instructions
-  jump,
-  // jump_if_zero N : Jumps N instructions if top of stack is zero (and pops it)
-  jump_if_zero,
-  // call N :  Calls function with N args.  Args are last N values on stack, and
-  //           function to be called is below that.  Pops function & args, and
-  //           pushes result.
-  call,
-  // return :  Returns top value on stack
-  return_,
-
-  // constant for
-  OP_COUNT
-};
-
-inline std::string to_string(Op op) {
-  switch (op) {
-  case load_const:
-    return "load_const";
-  case define_global:
-    return "define_global";
-  case get_global:
-    return "get_global";
-  case set_global:
-    return "set_global";
-  case get_local:
-    return "get_local";
-  case set_local:
-    return "set_local";
-  case add:
-    return "add";
-  case subtract:
-    return "subtract";
-  case multiply:
-    return "multiply";
-  case divide:
-    return "divide";
-  case pop:
-    return "pop";
-  case jump:
-    return "jump";
-  case jump_if_zero:
-    return "jump_if_zero";
-  case call:
-    return "call";
-  case return_:
-    return "return_";
-  case OP_COUNT:
-    return "<invalid>";
-  }
-  return "<invalid>";
-}
-
-inline int op_n_args(Op op) {
-  switch (op) {
-  case load_const:
-    return 1;
-  case define_global:
-  case get_global:
-  case set_global:
-    return 1;
-  case get_local:
-  case set_local:
-    return 1;
-  case add:
-  case subtract:
-  case multiply:
-  case divide:
-  case pop:
-    return 0;
-  case jump:
-  case jump_if_zero:
-    return 1;
-  case call:
-    return 1;
-  case return_:
-    return 0;
-  case OP_COUNT:
-    return 0;
-  }
-
-  return 0;
-}
-
 class Vars {
 public:
   struct Global {
@@ -139,18 +36,18 @@ public:
 
   Vars(CompilerKind compiler_kind) : compiler_kind(compiler_kind) {}
 
-  Ref lookup(const std::string &name) {
+  Ref lookup(std::string_view name) {
     auto it = std::find(vars.rbegin(), vars.rend(), name);
     if (it != vars.rend()) {
       int from_end = it - vars.rbegin();
       return Local{.index = (int)(vars.size() - from_end - 1)};
     }
-    return Global{.name = name};
+    return Global{.name = std::string(name)};
   }
 
-  Ref define(const std::string &name) {
+  Ref define(std::string_view name) {
     if (is_global_scope()) {
-      return Global{.name = name};
+      return Global{.name = std::string(name)};
     }
 
     auto it = std::find(vars.begin() + *scopes.rbegin(), vars.end(), name);
@@ -161,7 +58,7 @@ public:
     }
 
     int index = vars.size();
-    vars.push_back(name);
+    vars.emplace_back(name);
     return Local{.index = index};
   }
 
@@ -187,358 +84,550 @@ private:
   std::vector<size_t> scopes{0};
 };
 
-struct Chunk {
-  std::vector<int> code;
-  std::vector<Value> constants;
+/// Module-level table of global variables.  Names are assigned dense slot
+/// indices at compile time so the VM can index a flat array instead of hashing
+/// names at runtime.  The table outlives a single compilation, so a name used
+/// before it's defined (e.g. by a function from an earlier REPL line) resolves
+/// to the same slot as its later definition.
+class GlobalTable {
+public:
+  int resolve(std::string_view name) {
+    auto [it, inserted] =
+        indices.try_emplace(std::string(name), (int)names.size());
+    if (inserted) {
+      names.emplace_back(name);
+    }
+    return it->second;
+  }
+
+  const std::string &name(int index) const { return names.at(index); }
+
+  size_t size() const { return names.size(); }
+
+private:
+  std::unordered_map<std::string, int> indices;
+  std::vector<std::string> names;
+};
+
+// Helpers for the engines compiled from the parser's AST rather than the
+// flat one
+
+/// `node` with any parentheses around it stripped
+inline const ASTNodeExpr &without_parens(const ASTNodeExpr &node) {
+  const ASTNodeExpr *e = &node;
+  while (const ASTNodeTerm *term = std::get_if<ASTNodeTerm>(&e->child)) {
+    auto *paren = std::get_if<ast_ptr<ASTNodeParenExpr>>(&term->child);
+    if (!paren) {
+      break;
+    }
+    e = (*paren)->child.get();
+  }
+  return *e;
+}
+
+/// The slot of the local `node` consists of (ignoring parentheses), if it's
+/// just a local.  Slot 0 is the function, so locals start at 1.
+inline std::optional<int> local_slot(Vars &locals, const ASTNodeExpr &node) {
+  const ASTNodeTerm *term =
+      std::get_if<ASTNodeTerm>(&without_parens(node).child);
+  auto *id = term ? std::get_if<ASTNodeIdentifier>(&term->child) : nullptr;
+  if (id) {
+    auto var = locals.lookup(id->token.value);
+    if (Vars::Local *local = std::get_if<Vars::Local>(&var)) {
+      return local->index + 1;
+    }
+  }
+  return std::nullopt;
+}
+
+/// The value of `node` if it's a literal
+inline std::optional<Value> literal(const ASTNodeExpr &node) {
+  const ASTNodeTerm *term = std::get_if<ASTNodeTerm>(&node.child);
+  if (!term) {
+    return std::nullopt;
+  }
+
+  return std::visit(
+      [](const auto &child) -> std::optional<Value> {
+        using T = std::decay_t<decltype(child)>;
+        if constexpr (std::is_same_v<T, ASTNodeIntegerLiteral>) {
+          return Value::of(parse_int(child.token.value));
+        } else if constexpr (std::is_same_v<T, ASTNodeDoubleLiteral>) {
+          return Value::of(parse_double(child.token.value));
+        } else if constexpr (std::is_same_v<T, ASTNodeBooleanLiteral>) {
+          return Value::of(child.value);
+        } else if constexpr (std::is_same_v<T, ASTNodeNullLiteral>) {
+          return Value();
+        } else if constexpr (std::is_same_v<T, ASTNodeStringLiteral>) {
+          return Value::of(std::string(child.token.value));
+        } else {
+          return std::nullopt;
+        }
+      },
+      term->child);
+}
+
+/// The function call `expr` consists of (ignoring parentheses), if any
+inline const ASTNodeFunctionCall *as_call(const ASTNodeExpr &expr) {
+  const ASTNodeTerm *term =
+      std::get_if<ASTNodeTerm>(&without_parens(expr).child);
+  if (!term) {
+    return nullptr;
+  }
+  auto *call = std::get_if<ast_ptr<ASTNodeFunctionCall>>(&term->child);
+  return call ? call->get() : nullptr;
+}
+
+struct CompilerOptions {
+  /// Fuse common opcode sequences into superinstructions
+  bool superinstructions = true;
+  /// Leave function bodies to be parsed and compiled by
+  /// `Compiler::compile_body` when they're first called, so functions that
+  /// never run cost no more than a pre-parse matching their braces.  Only
+  /// applies when compiling from source, as that has to be kept around.
+  bool lazy = false;
+};
+
+/// A function body waiting to be compiled: its definition, the source its
+/// body is parsed from, and the globals it resolves names in (shared, as the
+/// function may outlive the VM that compiled it)
+struct LazyBody {
+  std::shared_ptr<const FlatAST> ast;
+  FlatAST::Index node;
+  Source source;
+  std::shared_ptr<GlobalTable> globals;
+  CompilerOptions options;
 };
 
 class Compiler {
 public:
-  Compiler(CompilerKind kind = CompilerKind::script) : locals(kind) {}
+  Compiler(GlobalTable &globals, CompilerKind kind = CompilerKind::script,
+           CompilerOptions options = {})
+      : globals(globals), locals(kind), options(options) {}
 
-  static Function compile(const std::string &source) {
-    Lexer lexer(source);
-    Parser parser(lexer.lex());
-    Compiler compiler(CompilerKind::script);
-    return compiler.compile(parser.parse());
+  static Function compile(std::string_view source) {
+    GlobalTable globals;
+    return compile(source, globals);
   }
 
-  Function compile(const ASTNodeProgram &node) {
-    // int result = 0;
+  /// Compiles `source`, which only has to outlive the call.  Lazy compiles
+  /// take the overload below, which shares the globals.
+  static Function compile(std::string_view source, GlobalTable &globals,
+                          CompilerOptions options = {}) {
+    assert(!options.lazy);
 
-    // vars.begin_scope();
+    Lexer lexer(source);
+    Parser parser(lexer);
+    Compiler compiler(globals, CompilerKind::script, options);
+    return compiler.compile(parser.parse());
+  }
 
-    for (const auto &stmt : node.body) {
-      (*this)(stmt);
+  /// Compiles `source`, holding on to it and `globals` for any bodies left to
+  /// compile later
+  static Function compile(Source source, std::shared_ptr<GlobalTable> globals,
+                          CompilerOptions options = {}) {
+    if (!options.lazy) {
+      return compile(source.text, *globals, options);
     }
 
-    if (chunk.code.size() == 0 ||
-        chunk.code.at(chunk.code.size() - 1) != Op::return_) {
-      // TODO: Switch to pushing a nil instead
-      Value value = Value{.value = 0};
+    Lexer lexer(source.text);
+    Parser parser(lexer, {.skip_function_bodies = true});
+    Compiler compiler(*globals, CompilerKind::script, options);
+    compiler.source = source;
+    compiler.shared_globals = std::move(globals);
+    return compiler.compile(parser.parse());
+  }
 
-      chunk.constants.push_back(value);
-      int index = chunk.constants.size() - 1;
+  /// Parses and compiles the body of a function left by a lazy compile, in
+  /// place
+  static void compile_body(Chunk &chunk) {
+    std::shared_ptr<LazyBody> lazy = std::move(chunk.lazy);
 
-      chunk.code.push_back(Op::load_const);
-      chunk.code.push_back(index);
-      chunk.code.push_back(Op::return_);
+    const FlatAST &ast = *lazy->ast;
+
+    // the definition again, this time with its body
+    ASTNodeFunctionDef node{.name = ast.token(lazy->node)};
+    Index child = ast.first_child(lazy->node);
+    for (; ast.kind(child) == Kind::parameter;
+         child = ast.next_sibling(child)) {
+      node.arg_names.push_back(ast.token(child));
     }
+    node.skipped_body = ast.skipped_body(child);
+
+    auto arena = std::make_shared<ASTArena>();
+    node.body = Parser::parse_function_body(node, lazy->source.text, arena,
+                                            {.skip_function_bodies = true});
+    node.skipped_body.reset();
+
+    Compiler compiler(*lazy->globals, CompilerKind::function, lazy->options);
+    compiler.ast = std::make_shared<const FlatAST>(FlatAST::flatten(node));
+    compiler.source = lazy->source;
+    compiler.shared_globals = lazy->globals;
+    chunk = std::move(*compiler.compile_function(FlatAST::root).chunk);
+  }
 
-    // vars.end_scope();
+  Function compile(const ASTNodeProgram &program) {
+    return compile(std::make_shared<const FlatAST>(FlatAST::flatten(program)));
+  }
 
-    return Function{.name = "(script)",
-                    .arity = 0,
-                    .chunk = std::make_shared<Chunk>(chunk)};
+  /// Compiles the program at the root of `ast`
+  Function compile(std::shared_ptr<const FlatAST> ast) {
+    this->ast = std::move(ast);
+
+    statements(FlatAST::root);
+    return finish("(script)", 0);
   }
 
-  Function compile(const ASTNodeFunctionDef &node) {
-    for (const auto &arg : node.arg_names) {
+private:
+  using Index = FlatAST::Index;
+  using Kind = FlatAST::Kind;
+
+  /// Compiles the function defined at `node`
+  Function compile_function(Index node) {
+    Index child = ast->first_child(node);
+    for (; ast->kind(child) == Kind::parameter;
+         child = ast->next_sibling(child)) {
       // args are effectively locals, so we can simply define them as locals
-      auto var = locals.define(arg.value);
+      auto var = locals.define(ast->token(child).value);
       assert(std::holds_alternative<Vars::Local>(var));
     }
 
-    for (const auto &stmt : node.body.body) {
-      (*this)(stmt);
-    }
+    // the body's statements, outside of a scope of their own
+    statements(child);
+    return finish(std::string(ast->token(node).value), arity(node));
+  }
 
-    if (chunk.code.size() == 0 ||
-        chunk.code.at(chunk.code.size() - 1) != Op::return_) {
+  /// Returns at the end of the code if it doesn't already, and wraps it up
+  Function finish(std::string name, int arity) {
+    if (last_op != Op::return_ || end_label == (int)chunk.code.size()) {
       // TODO: Switch to pushing a nil instead
-      Value value = Value{.value = 0};
+      load_constant(Value::of(0));
+      emit(Op::return_);
+    }
 
-      chunk.constants.push_back(value);
-      int index = chunk.constants.size() - 1;
+    // computed before fusing, superinstructions push the same values
+    chunk.max_stack = compute_max_stack(chunk);
 
-      chunk.code.push_back(Op::load_const);
-      chunk.code.push_back(index);
-      chunk.code.push_back(Op::return_);
+    if (options.superinstructions) {
+      fuse_superinstructions(chunk);
+      chunk.tier = Tier::superinstructions;
     }
 
-    return Function{.name = node.name.value,
-                    .arity = static_cast<int>(node.arg_names.size()),
+    return Function{.name = std::move(name),
+                    .arity = arity,
                     .chunk = std::make_shared<Chunk>(chunk)};
   }
 
-  void operator()(const ASTNodeStmt &node) {
-    return std::visit(*this, node.child);
+  /// Compiles the children of `node`, which are statements
+  void statements(Index node) {
+    for (Index stmt = ast->first_child(node); stmt != FlatAST::none;
+         stmt = ast->next_sibling(stmt)) {
+      statement(stmt);
+    }
   }
 
-  void operator()(const ASTNodeReturn &node) {
-    (*this)(node.expr);
+  void statement(Index node) {
+    switch (ast->kind(node)) {
+    case Kind::return_:
+      return return_stmt(node);
+    case Kind::let:
+      return let_stmt(node);
+    case Kind::assign:
+      return assign_stmt(node);
+    case Kind::scope:
+      return scope(node);
+    case Kind::if_:
+      return if_stmt(node);
+    case Kind::function_def:
+      return function_def(node);
+    default:
+      assert(false);
+    }
+  }
+
+  void return_stmt(Index node) {
+    Index expr = ast->first_child(node);
+    if (Index call = tail_call(expr); call != FlatAST::none) {
+      expression(call, Op::tail_call);
+      return;
+    }
+
+    expression(expr);
 
-    chunk.code.push_back(Op::return_);
+    emit(Op::return_);
   }
 
-  void operator()(const ASTNodeLet &node) {
-    auto var = locals.define(node.identifier.value);
+  void let_stmt(Index node) {
+    auto var = locals.define(ast->token(node).value);
     if (std::holds_alternative<Vars::Local>(var)) {
       // locals stored on stack
-      (*this)(node.expr);
+      expression(ast->first_child(node));
     } else {
       Vars::Global &global = std::get<Vars::Global>(var);
 
-      (*this)(node.expr);
-      chunk.code.push_back(Op::define_global);
-
-      chunk.constants.push_back(Value{.value = global.name});
-      int index = chunk.constants.size() - 1;
-
-      chunk.code.push_back(index);
+      expression(ast->first_child(node));
+      emit(Op::define_global, globals.resolve(global.name));
     }
   }
 
-  void operator()(const ASTNodeAssign &node) {
-    auto var = locals.lookup(node.identifier.value);
+  void assign_stmt(Index node) {
+    auto var = locals.lookup(ast->token(node).value);
     if (Vars::Local *local = std::get_if<Vars::Local>(&var)) {
-      (*this)(node.expr);
-      chunk.code.push_back(Op::set_local);
-      chunk.code.push_back(local->index);
+      expression(ast->first_child(node));
+      emit(Op::set_local, local->index);
     } else {
       Vars::Global &global = std::get<Vars::Global>(var);
 
-      (*this)(node.expr);
-      chunk.code.push_back(Op::set_global);
-
-      chunk.constants.push_back(Value{.value = global.name});
-      int index = chunk.constants.size() - 1;
-
-      chunk.code.push_back(index);
+      expression(ast->first_child(node));
+      emit(Op::set_global, globals.resolve(global.name));
     }
   }
 
-  void operator()(const ASTNodeScope &node) {
+  void scope(Index node) {
     locals.start_scope();
 
-    for (const auto &stmt : node.body) {
-      (*this)(stmt);
-    }
+    statements(node);
 
     int num = locals.end_scope();
     for (int i = 0; i < num; i++) {
-      chunk.code.push_back(Op::pop);
+      emit(Op::pop);
     }
   }
 
-  void operator()(const ASTNodeIf &node) {
+  void if_stmt(Index node) {
     std::vector<int> end_jump_offsets;
 
-    (*this)(node.condition);
+    Index condition = ast->first_child(node);
+    Index body = ast->next_sibling(condition);
+    expression(condition);
 
-    chunk.code.push_back(Op::jump_if_zero);
+    emit(Op::jump_if_zero, 0);
+    int i = chunk.code.size() - 1;
 
-    int i = chunk.code.size();
-    chunk.code.push_back(0);
+    scope(body);
 
-    (*this)(node.body);
-
-    const ASTNodeIf::Rest *rest = &node.rest;
-    const ASTNodeIf::Rest rest_end = std::monostate{};
-
-    while (!std::holds_alternative<std::monostate>(*rest)) {
-      chunk.code.push_back(Op::jump);
-      end_jump_offsets.push_back(chunk.code.size());
-      chunk.code.push_back(0);
+    for (Index rest = ast->next_sibling(body); rest != FlatAST::none;) {
+      emit(Op::jump, 0);
+      end_jump_offsets.push_back(chunk.code.size() - 1);
 
       // if previous condition was false, jump here
-      chunk.code[i] = chunk.code.size() - i - 1;
-
-      std::visit(
-          [&](const auto &node) {
-            if constexpr (std::is_same<
-                              decltype(node),
-                              const valuable::value_ptr<ASTNodeElseIf> &>()) {
-              (*this)(node->condition);
-              chunk.code.push_back(Op::jump_if_zero);
-
-              i = chunk.code.size();
-              chunk.code.push_back(0);
-
-              (*this)(node->body);
-              rest = &node->rest;
-
-            } else if constexpr (std::is_same<decltype(node),
-                                              const valuable::value_ptr<
-                                                  ASTNodeElse> &>()) {
-              i = -1;
-
-              (*this)(node->body);
-              rest = &rest_end;
-            }
-          },
-          *rest);
+      patch_jump(i);
+
+      if (ast->kind(rest) == Kind::else_if) {
+        condition = ast->first_child(rest);
+        body = ast->next_sibling(condition);
+        expression(condition);
+        emit(Op::jump_if_zero, 0);
+        i = chunk.code.size() - 1;
+
+        scope(body);
+        rest = ast->next_sibling(body);
+      } else {
+        i = -1;
+
+        scope(ast->first_child(rest));
+        rest = FlatAST::none;
+      }
     }
 
     for (int offset : end_jump_offsets) {
-      chunk.code[offset] = chunk.code.size() - offset - 1;
+      patch_jump(offset);
     }
 
     if (i >= 0) {
       // if previous condition was false, jump here
-      chunk.code[i] = chunk.code.size() - i - 1;
+      patch_jump(i);
     }
   }
 
-  void operator()(const ASTNodeElseIf &node) {
-    assert(false);
-    /*auto condition = (*this)(node.condition);
-
-    if (condition) {
-      return (*this)(node.body);
+  void function_def(Index node) {
+    Index body = ast->child(node, arity(node));
+
+    Function function;
+    if (ast->kind(body) == Kind::skipped_body) {
+      function = Function{.name = std::string(ast->token(node).value),
+                          .arity = arity(node),
+                          .chunk = std::make_shared<Chunk>()};
+      function.chunk->lazy = std::make_shared<LazyBody>(
+          LazyBody{.ast = ast,
+                   .node = node,
+                   .source = source,
+                   .globals = shared_globals,
+                   .options = options});
     } else {
-      return std::visit(*this, node.rest);
-    }*/
-  }
-
-  void operator()(const ASTNodeElse &node) {
-    assert(false);
-    // return (*this)(node.body);
-  }
-
-  void operator()(const std::monostate &node) {}
-
-  void operator()(const ASTNodeFunctionDef &node) {
-    Compiler compiler(CompilerKind::function);
-    Function function = compiler.compile(node);
+      Compiler compiler(globals, CompilerKind::function, options);
+      compiler.ast = ast;
+      compiler.source = source;
+      compiler.shared_globals = shared_globals;
+      function = compiler.compile_function(node);
+    }
 
-    chunk.constants.push_back(Value{.value = function});
-    int function_index = chunk.constants.size() - 1;
-    chunk.code.push_back(Op::load_const);
-    chunk.code.push_back(function_index);
+    load_constant(Value::of(function));
 
-    auto var = locals.define(node.name.value);
+    auto var = locals.define(ast->token(node).value);
     if (std::holds_alternative<Vars::Local>(var)) {
       // locals stored on stack - nothing else needed
     } else {
       Vars::Global &global = std::get<Vars::Global>(var);
 
-      chunk.code.push_back(Op::define_global);
-
-      chunk.constants.push_back(Value{.value = global.name});
-      int index = chunk.constants.size() - 1;
-
-      chunk.code.push_back(index);
+      emit(Op::define_global, globals.resolve(global.name));
     }
   }
 
-  void operator()(const ASTNodeExpr &node) {
-    return std::visit(*this, node.child);
+  /// Compiles the expression at `node`, leaving its value on the stack.  A
+  /// call at `node` itself is made with `call`.
+  ///
+  /// Operations wait on a stack until their operands have been compiled,
+  /// rather than recursing.  Nesting is only bounded by the program (a chain
+  /// of `+` nests a level per term), so recursing would eventually overflow
+  /// the native stack.  Flattening and the other engines' compilers work
+  /// the same way for the same reason.
+  void expression(Index node, Op call = Op::call) {
+    pending_exprs.push_back({node, false});
+    while (!pending_exprs.empty()) {
+      auto [expr, operands_done] = pending_exprs.back();
+      pending_exprs.pop_back();
+
+      switch (ast->kind(expr)) {
+      case Kind::bin_expr:
+        if (operands_done) {
+          arithmetic(expr);
+        } else {
+          pending_exprs.push_back({expr, true});
+          operands(expr);
+        }
+        break;
+      case Kind::paren_expr:
+        pending_exprs.push_back({ast->first_child(expr), false});
+        break;
+      case Kind::function_call:
+        if (operands_done) {
+          emit(expr == node ? call : Op::call, ast->child_count(expr));
+        } else {
+          // push function on stack, then args
+          get_variable(ast->token(expr).value);
+          pending_exprs.push_back({expr, true});
+          operands(expr);
+        }
+        break;
+      default:
+        term(expr);
+      }
+    }
   }
 
-  void operator()(const ASTNodeTerm &node) {
-    return std::visit(*this, node.child);
+  /// Queues the children of `node` to be compiled, first to last
+  void operands(Index node) {
+    size_t begin = pending_exprs.size();
+    for (Index child = ast->first_child(node); child != FlatAST::none;
+         child = ast->next_sibling(child)) {
+      pending_exprs.push_back({child, false});
+    }
+    std::reverse(pending_exprs.begin() + begin, pending_exprs.end());
   }
 
-  void operator()(const ASTNodeBinExpr &node) {
-    (*this)(*node.lhs);
-    (*this)(*node.rhs);
+  /// Compiles an expression with no children
+  void term(Index node) {
+    switch (ast->kind(node)) {
+    case Kind::null_literal:
+      return load_constant(Value());
+    case Kind::integer_literal:
+      return load_constant(Value::of(parse_int(ast->token(node).value)));
+    case Kind::double_literal:
+      return load_constant(Value::of(parse_double(ast->token(node).value)));
+    case Kind::boolean_literal:
+      return load_constant(
+          Value::of(ast->token(node).type == TokenType::kw_true));
+    case Kind::string_literal:
+      return load_constant(Value::of(std::string(ast->token(node).value)));
+    case Kind::identifier:
+      return get_variable(ast->token(node).value);
+    default:
+      assert(false);
+    }
+  }
 
-    switch (node.op) {
+  /// The operation of a binary expression, once its operands are compiled
+  void arithmetic(Index node) {
+    switch (*bin_op_for_token(ast->token(node).type)) {
     case BinOp::add:
-      chunk.code.push_back(Op::add);
+      emit(Op::add);
       return;
     case BinOp::subtract:
-      chunk.code.push_back(Op::subtract);
+      emit(Op::subtract);
       return;
     case BinOp::multiply:
-      chunk.code.push_back(Op::multiply);
+      emit(Op::multiply);
       return;
     case BinOp::divide:
-      chunk.code.push_back(Op::divide);
+      emit(Op::divide);
       return;
     }
   }
 
-  void operator()(const ASTNodeNullLiteral &node) {
-    Value value;
-
-    chunk.constants.push_back(value);
-    int index = chunk.constants.size() - 1;
-
-    chunk.code.push_back(Op::load_const);
-    chunk.code.push_back(index);
-  }
-
-  void operator()(const ASTNodeIntegerLiteral &node) {
-    Value value = Value{.value = std::stoi(node.token.value)};
-
-    chunk.constants.push_back(value);
-    int index = chunk.constants.size() - 1;
-
-    chunk.code.push_back(Op::load_const);
-    chunk.code.push_back(index);
-  }
-
-  void operator()(const ASTNodeDoubleLiteral &node) {
-    Value value = Value{.value = std::stod(node.token.value)};
-
-    chunk.constants.push_back(value);
-    int index = chunk.constants.size() - 1;
-
-    chunk.code.push_back(Op::load_const);
-    chunk.code.push_back(index);
-  }
-
-  void operator()(const ASTNodeBooleanLiteral &node) {
-    Value value = Value{.value = node.value};
-
-    chunk.constants.push_back(value);
-    int index = chunk.constants.size() - 1;
-
-    chunk.code.push_back(Op::load_const);
-    chunk.code.push_back(index);
-  }
-
-  void operator()(const ASTNodeStringLiteral &node) {
-    Value value = Value{.value = node.token.value};
-
+  void load_constant(Value value) {
     chunk.constants.push_back(value);
     int index = chunk.constants.size() - 1;
 
-    chunk.code.push_back(Op::load_const);
-    chunk.code.push_back(index);
+    emit(Op::load_const, index);
   }
 
-  void operator()(const ASTNodeIdentifier &node) {
-    auto var = locals.lookup(node.token.value);
+  void get_variable(std::string_view name) {
+    auto var = locals.lookup(name);
     if (Vars::Local *local = std::get_if<Vars::Local>(&var)) {
-      chunk.code.push_back(Op::get_local);
-      chunk.code.push_back(local->index);
+      emit(Op::get_local, local->index);
     } else {
       Vars::Global &global = std::get<Vars::Global>(var);
 
-      chunk.code.push_back(Op::get_global);
-
-      chunk.constants.push_back(Value{.value = global.name});
-      int index = chunk.constants.size() - 1;
-
-      chunk.code.push_back(index);
+      emit(Op::get_global, globals.resolve(global.name));
     }
   }
 
-  void operator()(const ASTNodeParenExpr &node) { return (*this)(node.child); }
-
-  void operator()(const ASTNodeFunctionCall &node) {
-    // push function on stack
+  template <typename... Args> void emit(Op op, Args... args) {
+    chunk.code.push_back(op);
+    (chunk.code.push_back(args), ...);
+    last_op = op;
+  }
 
-    // TODO: should this ASTNodeIdentifier elsewhere?
-    (*this)(ASTNodeIdentifier{.token = node.name});
+  /// Points the jump operand at `offset` to the end of the code
+  void patch_jump(int offset) {
+    chunk.code[offset] = chunk.code.size() - offset - 1;
+    end_label = chunk.code.size();
+  }
 
-    // push args on stack
-    for (auto &arg : node.arguments) {
-      (*this)(arg);
+  /// The function call `expr` consists of (ignoring parentheses), if any
+  Index tail_call(Index expr) const {
+    while (ast->kind(expr) == Kind::paren_expr) {
+      expr = ast->first_child(expr);
     }
-
-    chunk.code.push_back(Op::call);
-    chunk.code.push_back(node.arguments.size());
+    return ast->kind(expr) == Kind::function_call ? expr : FlatAST::none;
   }
 
-  template <typename T> void operator()(const valuable::value_ptr<T> &ptr) {
-    return (*this)(*ptr);
+  /// Number of parameters of the function defined at `node`
+  int arity(Index node) const {
+    int count = 0;
+    for (Index c = ast->first_child(node);
+         c != FlatAST::none && ast->kind(c) == Kind::parameter;
+         c = ast->next_sibling(c)) {
+      count++;
+    }
+    return count;
   }
 
-private:
   Chunk chunk{};
+  /// The op most recently emitted, to tell if the code ends in a return
+  Op last_op = Op::OP_COUNT;
+  /// The offset most recently jumped to
+  int end_label = -1;
+  GlobalTable &globals;
   Vars locals;
+  CompilerOptions options;
+  std::shared_ptr<const FlatAST> ast;
+  /// Expressions `expression` has yet to compile, and whether their operands
+  /// have been
+  std::vector<std::pair<Index, bool>> pending_exprs;
+  /// What a lazy compile's `ast` was parsed from, and the owner of `globals`,
+  /// for compiling the bodies it skipped
+  Source source;
+  std::shared_ptr<GlobalTable> shared_globals;
 };
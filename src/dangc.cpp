@@ -0,0 +1,108 @@
+#include "aot.h"
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#ifndef DANG_RUNTIME_DIR
+#define DANG_RUNTIME_DIR "src"
+#endif
+
+static std::string read_program(const std::string &path) {
+  std::ifstream f(path);
+  if (!f) {
+    std::cerr << "failed to open file: " << path << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  std::stringstream s;
+  s << f.rdbuf();
+  return s.str();
+}
+
+static void write_file(const std::string &path, const std::string &contents) {
+  std::ofstream f(path);
+  if (!f || !(f << contents)) {
+    std::cerr << "failed to write file: " << path << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+/// `str` quoted for the shell
+static std::string quote(const std::string &str) {
+  std::string quoted = "'";
+  for (char c : str) {
+    quoted += c == '\'' ? std::string("'\\''") : std::string(1, c);
+  }
+  return quoted + "'";
+}
+
+static void usage(const char *argv0) {
+  std::cerr << "usage:" << std::endl;
+  std::cerr << "  " << argv0 << " [options] path/to/program.dang" << std::endl;
+  std::cerr << "options:" << std::endl;
+  std::cerr << "  -o path       where to write the executable (default: the "
+               "program without .dang)"
+            << std::endl;
+  std::cerr << "  --emit-cpp    write the generated C++ instead of building it"
+            << std::endl;
+  std::cerr << "environment:" << std::endl;
+  std::cerr << "  CXX           C++ compiler to build with (default: c++)"
+            << std::endl;
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  std::string path;
+  std::string output;
+  bool emit_cpp = false;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-o" && i + 1 < argc) {
+      output = argv[++i];
+    } else if (arg == "--emit-cpp") {
+      emit_cpp = true;
+    } else if (path.empty() && !arg.starts_with("-")) {
+      path = arg;
+    } else {
+      std::cerr << "error: invalid arguments" << std::endl;
+      usage(argv[0]);
+    }
+  }
+
+  if (path.empty()) {
+    usage(argv[0]);
+  }
+  if (output.empty()) {
+    output = path.ends_with(".dang") ? path.substr(0, path.size() - 5)
+                                     : path + ".out";
+    if (emit_cpp) {
+      output += ".cpp";
+    }
+  }
+
+  GlobalTable globals;
+  Function script = Compiler::compile(read_program(path), globals,
+                                      {.superinstructions = false});
+  std::string cpp = AotCompiler().compile(script, globals);
+
+  if (emit_cpp) {
+    write_file(output, cpp);
+    return 0;
+  }
+
+  std::string cpp_path = output + ".cpp";
+  write_file(cpp_path, cpp);
+
+  const char *cxx = getenv("CXX");
+  std::string command = std::string(cxx ? cxx : "c++") +
+                        " -std=c++20 -O2 -I " + quote(DANG_RUNTIME_DIR) + " " +
+                        quote(cpp_path) + " -o " + quote(output);
+  int status = std::system(command.c_str());
+  std::remove(cpp_path.c_str());
+
+  if (status != 0) {
+    std::cerr << "dangc: failed to build " << output << std::endl;
+    return EXIT_FAILURE;
+  }
+}
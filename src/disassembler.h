@@ -18,6 +18,11 @@ private:
   void print_function(Function function) {
     out << "== " << function.name << " ==\n";
 
+    if (function.chunk->lazy) {
+      out << "(not compiled until first called)\n";
+      return;
+    }
+
     print_code(*function.chunk);
 
     for (const Value &v : function.chunk->constants) {
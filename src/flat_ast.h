@@ -0,0 +1,324 @@
+#pragma once
+
+#include "parser.h"
+#include <cassert>
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <optional>
+#include <utility>
+#include <variant>
+#include <vector>
+
+/// The AST as parallel arrays with an entry per node, rather than nested
+/// structs.  Nodes are stored in pre-order, so a node's first child directly
+/// follows it, and passes over the tree mostly walk forward through memory.
+///
+/// Expressions have no `ASTNodeExpr`/`ASTNodeTerm` wrappers.  Each node has
+/// at most one token, which for a binary expression is its operator.
+struct FlatAST {
+  enum class Kind : uint8_t {
+    program,       // children: statements
+    return_,       // children: expression
+    let,           // token: name; children: expression
+    assign,        // token: name; children: expression
+    scope,         // children: statements
+    if_,           // children: condition, scope, then an else_if or else_
+    else_if,       // the same as if_
+    else_,         // children: scope
+    function_def,  // token: name; children: parameters, then a scope or
+                   // skipped_body
+    parameter,     // token: name
+    skipped_body,  // no token, see `skipped_body()`
+    bin_expr,      // token: operator; children: lhs, rhs
+    integer_literal,
+    double_literal,
+    boolean_literal,
+    null_literal,
+    string_literal,
+    identifier,
+    paren_expr,    // children: expression
+    function_call, // token: name; children: arguments
+  };
+
+  using Index = uint32_t;
+  static constexpr Index none = UINT32_MAX;
+
+  std::vector<Kind> kinds;
+  /// Index of each node's token in `token_table`, or `none`.  A
+  /// `skipped_body` has its index in `skipped_bodies` instead.
+  std::vector<Index> tokens;
+  std::vector<Index> first_children;
+  std::vector<Index> next_siblings;
+
+  std::vector<Token> token_table;
+  /// Source ranges of function bodies a pre-parse skipped, as in
+  /// `ASTNodeFunctionDef::skipped_body`
+  std::vector<std::pair<size_t, size_t>> skipped_bodies;
+
+  /// The root: a program or function definition
+  static constexpr Index root = 0;
+
+  size_t size() const { return kinds.size(); }
+  Kind kind(Index node) const { return kinds[node]; }
+  const Token &token(Index node) const {
+    assert(kind(node) != Kind::skipped_body);
+    return token_table[tokens[node]];
+  }
+  Index first_child(Index node) const { return first_children[node]; }
+  Index next_sibling(Index node) const { return next_siblings[node]; }
+
+  /// The source range of a `skipped_body` node
+  const std::pair<size_t, size_t> &skipped_body(Index node) const {
+    assert(kind(node) == Kind::skipped_body);
+    return skipped_bodies[tokens[node]];
+  }
+
+  /// The `n`th child of `node`
+  Index child(Index node, int n) const {
+    Index c = first_child(node);
+    for (int i = 0; i < n; i++) {
+      c = next_sibling(c);
+    }
+    return c;
+  }
+
+  int child_count(Index node) const {
+    int count = 0;
+    for (Index c = first_child(node); c != none; c = next_sibling(c)) {
+      count++;
+    }
+    return count;
+  }
+
+  /// Copies the tree the parser built.  Most of the time goes on filling
+  /// the arrays, so they're sized up front from the parser's token count.
+  static FlatAST flatten(const ASTNodeProgram &program) {
+    FlatAST ast;
+    Flattener flattener{ast};
+    flattener.reserve(program.token_count + 1);
+    flattener(program);
+    return ast;
+  }
+
+  static FlatAST flatten(const ASTNodeFunctionDef &function) {
+    FlatAST ast;
+    Flattener flattener{ast};
+    flattener(function);
+    return ast;
+  }
+
+private:
+  /// Adds the nodes of a tree AST, in pre-order, from a stack of nodes
+  /// waiting to be added.  A node's first child skips the stack, as it's
+  /// always added straight after the node.
+  class Flattener {
+  public:
+    explicit Flattener(FlatAST &ast) : ast(ast) {}
+
+    /// Makes room for `n` nodes
+    void reserve(size_t n) {
+      ast.kinds.reserve(n);
+      ast.tokens.reserve(n);
+      ast.first_children.reserve(n);
+      ast.next_siblings.reserve(n);
+      ast.token_table.reserve(n);
+      last_children.reserve(n);
+    }
+
+    template <typename Root> void operator()(const Root &root) {
+      next = {&root, none};
+      while (next || !pending.empty()) {
+        if (!next) {
+          next = pending.back();
+          pending.pop_back();
+        }
+        auto [node, parent] = *std::exchange(next, std::nullopt);
+        std::visit([&](auto *node) { add(*node, parent); }, node);
+      }
+    }
+
+  private:
+    using Node =
+        std::variant<const ASTNodeProgram *, const ASTNodeStmt *,
+                     const ASTNodeScope *, const ASTNodeElseIf *,
+                     const ASTNodeElse *, const ASTNodeFunctionDef *,
+                     const ASTNodeExpr *>;
+
+    /// A node waiting to be added, as a child of `parent`
+    struct Pending {
+      Node node;
+      Index parent;
+    };
+
+    /// Adds a node, after any children `parent` already has
+    Index append(Kind kind, Index parent, const Token *token = nullptr) {
+      Index node = ast.kinds.size();
+      ast.kinds.push_back(kind);
+      ast.first_children.push_back(none);
+      ast.next_siblings.push_back(none);
+      if (token) {
+        ast.tokens.push_back(ast.token_table.size());
+        ast.token_table.push_back(*token);
+      } else {
+        ast.tokens.push_back(none);
+      }
+
+      last_children.push_back(none);
+      if (parent != none) {
+        Index &last = last_children[parent];
+        if (last == none) {
+          ast.first_children[parent] = node;
+        } else {
+          ast.next_siblings[last] = node;
+        }
+        last = node;
+      }
+      return node;
+    }
+
+    /// Adds `children` of `parent`, after the node just added.  The first is
+    /// added next, and the rest wait on `pending`.
+    void later(Index parent, std::initializer_list<Node> children) {
+      for (auto it = std::rbegin(children); it + 1 != std::rend(children);
+           it++) {
+        pending.push_back({*it, parent});
+      }
+      next = {*children.begin(), parent};
+    }
+
+    template <typename Child>
+    void later(Index parent, const std::vector<Child> &children) {
+      if (children.empty()) {
+        return;
+      }
+      for (auto it = children.rbegin(); it + 1 != children.rend(); it++) {
+        pending.push_back({&*it, parent});
+      }
+      next = {&children.front(), parent};
+    }
+
+    /// An if or else-if
+    void conditional(Kind kind, Index parent, const ASTNodeExpr &condition,
+                     const ASTNodeScope &body, const ASTNodeIf::Rest &rest) {
+      Index node = append(kind, parent);
+      // what follows it waits until the condition and body are added
+      if (auto *else_if = std::get_if<ast_ptr<ASTNodeElseIf>>(&rest)) {
+        pending.push_back({else_if->get(), node});
+      } else if (auto *else_ = std::get_if<ast_ptr<ASTNodeElse>>(&rest)) {
+        pending.push_back({else_->get(), node});
+      }
+      later(node, {&condition, &body});
+    }
+
+    void add(const ASTNodeProgram &node, Index parent) {
+      later(append(Kind::program, parent), node.body);
+    }
+
+    void add(const ASTNodeStmt &node, Index parent) {
+      std::visit([&](const auto &child) { add(child, parent); }, node.child);
+    }
+
+    void add(const ASTNodeReturn &node, Index parent) {
+      later(append(Kind::return_, parent), {&node.expr});
+    }
+
+    void add(const ASTNodeLet &node, Index parent) {
+      later(append(Kind::let, parent, &node.identifier), {&node.expr});
+    }
+
+    void add(const ASTNodeAssign &node, Index parent) {
+      later(append(Kind::assign, parent, &node.identifier), {&node.expr});
+    }
+
+    void add(const ASTNodeScope &node, Index parent) {
+      later(append(Kind::scope, parent), node.body);
+    }
+
+    void add(const ASTNodeIf &node, Index parent) {
+      conditional(Kind::if_, parent, node.condition, node.body, node.rest);
+    }
+
+    void add(const ASTNodeElseIf &node, Index parent) {
+      conditional(Kind::else_if, parent, node.condition, node.body,
+                  node.rest);
+    }
+
+    void add(const ASTNodeElse &node, Index parent) {
+      later(append(Kind::else_, parent), {&node.body});
+    }
+
+    void add(const ASTNodeFunctionDef &node, Index parent) {
+      Index function = append(Kind::function_def, parent, &node.name);
+      // parameters are leaves before the body, so can be added right away
+      for (const Token &arg : node.arg_names) {
+        append(Kind::parameter, function, &arg);
+      }
+
+      if (node.skipped_body) {
+        Index body = append(Kind::skipped_body, function);
+        ast.tokens[body] = ast.skipped_bodies.size();
+        ast.skipped_bodies.push_back(*node.skipped_body);
+      } else {
+        later(function, {&node.body});
+      }
+    }
+
+    void add(const ASTNodeExpr &node, Index parent) {
+      std::visit([&](const auto &child) { add(child, parent); }, node.child);
+    }
+
+    void add(const ASTNodeTerm &node, Index parent) {
+      std::visit([&](const auto &child) { add(child, parent); }, node.child);
+    }
+
+    void add(const ASTNodeBinExpr &node, Index parent) {
+      Token op{.type = token_for_bin_op(node.op)};
+      later(append(Kind::bin_expr, parent, &op),
+            {node.lhs.get(), node.rhs.get()});
+    }
+
+    void add(const ASTNodeIntegerLiteral &node, Index parent) {
+      append(Kind::integer_literal, parent, &node.token);
+    }
+
+    void add(const ASTNodeDoubleLiteral &node, Index parent) {
+      append(Kind::double_literal, parent, &node.token);
+    }
+
+    void add(const ASTNodeBooleanLiteral &node, Index parent) {
+      append(Kind::boolean_literal, parent, &node.token);
+    }
+
+    void add(const ASTNodeNullLiteral &node, Index parent) {
+      append(Kind::null_literal, parent, &node.token);
+    }
+
+    void add(const ASTNodeStringLiteral &node, Index parent) {
+      append(Kind::string_literal, parent, &node.token);
+    }
+
+    void add(const ASTNodeIdentifier &node, Index parent) {
+      append(Kind::identifier, parent, &node.token);
+    }
+
+    void add(const ASTNodeParenExpr &node, Index parent) {
+      later(append(Kind::paren_expr, parent), {node.child.get()});
+    }
+
+    void add(const ASTNodeFunctionCall &node, Index parent) {
+      later(append(Kind::function_call, parent, &node.name), node.arguments);
+    }
+
+    template <typename T> void add(const ast_ptr<T> &ptr, Index parent) {
+      add(*ptr, parent);
+    }
+
+    FlatAST &ast;
+    /// The next node to add, if it's known without looking at `pending`
+    std::optional<Pending> next;
+    std::vector<Pending> pending;
+    /// The last child added to each node so far
+    std::vector<Index> last_children;
+  };
+};
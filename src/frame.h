@@ -0,0 +1,11 @@
+#pragma once
+
+#include "value.h"
+
+struct Frame {
+  /// Function being run.  Owned by the value at `fp`, which lives for as long
+  /// as the frame does.
+  const Function *function;
+  int *ip;
+  Value *fp; // correct name?
+};
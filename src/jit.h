@@ -0,0 +1,501 @@
+#pragma once
+
+#include "assembler.h"
+#include "chunk.h"
+#include "frame.h"
+#include "superinstructions.h"
+#include "value.h"
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// The JIT emits x86-64 code for the System V ABI, into mmap'd memory
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_SUPPORTED 1
+#include <sys/mman.h>
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+class VM;
+
+/// Runtime functions the generated code calls for anything off its fast paths
+struct JitHelpers {
+  void (*copy)(Value *dst, const Value *src);
+  /// `lhs[0] op= lhs[1]`
+  void (*add)(Value *lhs);
+  void (*subtract)(Value *lhs);
+  void (*multiply)(Value *lhs);
+  void (*divide)(Value *lhs);
+  int (*truthy)(const Value *v);
+  void (*define_global)(VM *vm, Value *v, int index);
+  void (*get_global)(VM *vm, Value *v, int index);
+  void (*set_global)(VM *vm, Value *v, int index);
+  /// Calls the function at `callee`, leaving the result in its place
+  void (*call)(VM *vm, Frame *frame, Value *callee, int arg_count);
+  /// Returns non-zero if the call was set up in `frame` as a self tail call,
+  /// in which case the code jumps back to its start.  Otherwise the function
+  /// returns to `VM::call_native` to make the call.
+  int (*tail_call)(VM *vm, Frame *frame, Value *callee, int arg_count);
+  /// Leaves a trace at side exit `exit`, see `TraceExit`
+  void (*exit)(VM *vm, Frame *frame, int exit);
+};
+
+/// Machine code for a function.  Calling `entry` runs the function set up in
+/// `frame`, returning the stack slot holding the result, or nullptr if it
+/// finished with a tail call to a different function.
+struct NativeCode {
+  using Entry = Value *(*)(VM *vm, Frame *frame);
+
+  Entry entry = nullptr;
+  void *memory = nullptr;
+  size_t size = 0;
+
+  NativeCode() = default;
+  NativeCode(const NativeCode &) = delete;
+  NativeCode &operator=(const NativeCode &) = delete;
+
+  ~NativeCode() {
+#if JIT_SUPPORTED
+    if (memory) {
+      munmap(memory, size);
+    }
+#endif
+  }
+
+  /// Copies `code` into executable memory, returning nullptr on failure
+  static std::shared_ptr<NativeCode> load(const std::vector<uint8_t> &code) {
+#if JIT_SUPPORTED
+    void *memory = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+      return nullptr;
+    }
+
+    auto native = std::make_shared<NativeCode>();
+    native->memory = memory;
+    native->size = code.size();
+
+    std::memcpy(memory, code.data(), code.size());
+    if (mprotect(memory, code.size(), PROT_READ | PROT_EXEC) != 0) {
+      return nullptr;
+    }
+
+    native->entry = (Entry)memory;
+    return native;
+#else
+    return nullptr;
+#endif
+  }
+};
+
+/// Code generation shared by the JIT compilers.  Generated functions have the
+/// `NativeCode::Entry` signature, and keep values in their stack slots,
+/// addressed off the frame pointer at offsets fixed at compile time.
+///
+/// Register use in generated code:
+///   rbx: frame pointer (`Frame::fp`), reloaded after calls as the stack can
+///        move when it grows
+///   r12: VM
+///   r13: current Frame
+class CodeEmitter {
+protected:
+  CodeEmitter(const JitHelpers &helpers) : helpers(helpers) {}
+
+  static constexpr uint64_t INT_TAG = Value::INT_TAG;
+  static constexpr uint64_t QNAN = Value::QNAN;
+  static constexpr int OBJ_HIGH = Value::OBJ_TAG >> 48;
+  static constexpr int INT_HIGH = Value::INT_TAG >> 48;
+
+  static uint64_t bits(const Value &v) { return v.bits; }
+
+  /// Displacement of `fp[n]` from rbx
+  static int32_t slot(int n) { return n * (int32_t)sizeof(Value); }
+
+  Label &new_label() { return label_storage.emplace_back(); }
+
+  void prologue() {
+    a.push(Reg::rbx);
+    a.push(Reg::r12);
+    a.push(Reg::r13);
+    a.mov(Reg::r12, Reg::rdi);
+    a.mov(Reg::r13, Reg::rsi);
+    a.bind(entry);
+    a.load(Reg::rbx, Reg::r13, offsetof(Frame, fp));
+  }
+
+  /// Emits the shared return sequence, then the out of line slow paths
+  void epilogue_and_cold_paths() {
+    a.bind(epilogue);
+    a.pop(Reg::r13);
+    a.pop(Reg::r12);
+    a.pop(Reg::rbx);
+    a.ret();
+
+    // stubs may add more stubs
+    for (size_t i = 0; i < cold.size(); i++) {
+      cold[i]();
+    }
+  }
+
+  /// Jumps to `target` if the value is the object tag, clobbering rcx
+  void jump_if_obj(Reg value, Label &target) {
+    a.mov(Reg::rcx, value);
+    a.shr(Reg::rcx, 48);
+    a.cmp32(Reg::rcx, OBJ_HIGH);
+    a.jcc(Cond::e, target);
+  }
+
+  void jump_if_not_int(Reg value, Label &target) {
+    a.mov(Reg::rcx, value);
+    a.shr(Reg::rcx, 48);
+    a.cmp32(Reg::rcx, INT_HIGH);
+    a.jcc(Cond::ne, target);
+  }
+
+  void jump_if_not_double(Reg value, Label &target) {
+    a.mov(Reg::rcx, QNAN);
+    a.and_(Reg::rcx, value);
+    a.mov(Reg::r8, QNAN);
+    a.cmp(Reg::rcx, Reg::r8);
+    a.jcc(Cond::e, target);
+  }
+
+  /// `fp[dst] = fp[src]`, inline unless either side holds an object
+  void copy(int32_t src, int32_t dst) {
+    Label &slow = new_label(), &done = new_label();
+
+    a.load(Reg::rax, Reg::rbx, src);
+    jump_if_obj(Reg::rax, slow);
+    a.load(Reg::rdx, Reg::rbx, dst);
+    jump_if_obj(Reg::rdx, slow);
+    a.store(Reg::rbx, dst, Reg::rax);
+    a.bind(done);
+
+    cold.push_back([this, src, dst, &slow, &done] {
+      a.bind(slow);
+      a.lea(Reg::rdi, Reg::rbx, dst);
+      a.lea(Reg::rsi, Reg::rbx, src);
+      a.call((const void *)helpers.copy);
+      a.jmp(done);
+    });
+  }
+
+  void call_copy(int32_t dst, const Value *src) {
+    a.lea(Reg::rdi, Reg::rbx, dst);
+    a.mov(Reg::rsi, (uint64_t)(uintptr_t)src);
+    a.call((const void *)helpers.copy);
+  }
+
+  /// Releases any object a stale slot still points at, before it's
+  /// overwritten with raw bits
+  void release_slot(int32_t dst) {
+    Label &slow = new_label(), &done = new_label();
+
+    a.load(Reg::rdx, Reg::rbx, dst);
+    jump_if_obj(Reg::rdx, slow);
+    a.bind(done);
+
+    cold.push_back([this, dst, &slow, &done] {
+      static const Value null_value;
+      a.bind(slow);
+      call_copy(dst, &null_value);
+      a.jmp(done);
+    });
+  }
+
+  /// Stores the result of an inline operation in rax to `fp[dst]`
+  void store_result(int32_t dst) { a.store(Reg::rbx, dst, Reg::rax); }
+
+  void load_const(const Value &constant, int32_t dst) {
+    if (constant.is_obj()) {
+      call_copy(dst, &constant);
+    } else {
+      release_slot(dst);
+      a.mov(Reg::rax, constant.bits);
+      a.store(Reg::rbx, dst, Reg::rax);
+    }
+  }
+
+  void call_global(void (*helper)(VM *, Value *, int), int32_t v, int index) {
+    a.mov(Reg::rdi, Reg::r12);
+    a.lea(Reg::rsi, Reg::rbx, v);
+    a.mov(Reg::rdx, (uint64_t)index);
+    a.call((const void *)helper);
+  }
+
+  /// Integer `fp[lhs] op= fp[lhs + 1]` for add, subtract, multiply or divide,
+  /// jumping to `not_int` if either operand isn't an int
+  void int_arithmetic(Op op, int32_t lhs, Label &not_int) {
+    a.load(Reg::rax, Reg::rbx, lhs);
+    jump_if_not_int(Reg::rax, not_int);
+    a.load(Reg::rdx, Reg::rbx, lhs + slot(1));
+    jump_if_not_int(Reg::rdx, not_int);
+    switch (op) {
+    case Op::add:
+      a.add32(Reg::rax, Reg::rdx);
+      break;
+    case Op::subtract:
+      a.sub32(Reg::rax, Reg::rdx);
+      break;
+    case Op::multiply:
+      a.imul32(Reg::rax, Reg::rdx);
+      break;
+    default:
+      a.mov(Reg::r8, Reg::rdx);
+      a.cdq_idiv32(Reg::r8);
+      break;
+    }
+    a.mov(Reg::rcx, INT_TAG);
+    a.or_(Reg::rax, Reg::rcx);
+    store_result(lhs);
+  }
+
+  /// As `int_arithmetic`, for two doubles
+  void double_arithmetic(Op op, int32_t lhs, Label &not_double) {
+    a.load(Reg::rax, Reg::rbx, lhs);
+    jump_if_not_double(Reg::rax, not_double);
+    a.load(Reg::rdx, Reg::rbx, lhs + slot(1));
+    jump_if_not_double(Reg::rdx, not_double);
+    a.movq(Xmm::xmm0, Reg::rax);
+    a.movq(Xmm::xmm1, Reg::rdx);
+    switch (op) {
+    case Op::add:
+      a.addsd(Xmm::xmm0, Xmm::xmm1);
+      break;
+    case Op::subtract:
+      a.subsd(Xmm::xmm0, Xmm::xmm1);
+      break;
+    case Op::multiply:
+      a.mulsd(Xmm::xmm0, Xmm::xmm1);
+      break;
+    default:
+      a.divsd(Xmm::xmm0, Xmm::xmm1);
+      break;
+    }
+    // x86 only produces NaNs without payload bits, which box as themselves
+    a.movq(Reg::rax, Xmm::xmm0);
+    store_result(lhs);
+  }
+
+  /// The runtime helper for the generic version of an arithmetic op
+  void (*arithmetic_helper(Op op))(Value *) {
+    switch (op) {
+    case Op::add:
+      return helpers.add;
+    case Op::subtract:
+      return helpers.subtract;
+    case Op::multiply:
+      return helpers.multiply;
+    default:
+      return helpers.divide;
+    }
+  }
+
+  void call_arithmetic_helper(Op op, int32_t lhs) {
+    a.lea(Reg::rdi, Reg::rbx, lhs);
+    a.call((const void *)arithmetic_helper(op));
+  }
+
+  /// Jumps to `target` if `fp[v]` is falsy (or truthy, if `if_truthy`)
+  void branch(int32_t v, bool if_truthy, Label &target) {
+    Label &slow = new_label(), &done = new_label();
+    Cond cond = if_truthy ? Cond::ne : Cond::e;
+
+    a.load(Reg::rax, Reg::rbx, v);
+    jump_if_not_int(Reg::rax, slow);
+    a.test32(Reg::rax, Reg::rax);
+    a.jcc(cond, target);
+    a.bind(done);
+
+    cold.push_back([this, v, cond, &slow, &done, &target] {
+      a.bind(slow);
+      a.lea(Reg::rdi, Reg::rbx, v);
+      a.call((const void *)helpers.truthy);
+      a.test32(Reg::rax, Reg::rax);
+      a.jcc(cond, target);
+      a.jmp(done);
+    });
+  }
+
+  void call(int32_t callee, int arg_count) {
+    a.mov(Reg::rdi, Reg::r12);
+    a.mov(Reg::rsi, Reg::r13);
+    a.lea(Reg::rdx, Reg::rbx, callee);
+    a.mov(Reg::rcx, (uint64_t)arg_count);
+    a.call((const void *)helpers.call);
+    a.load(Reg::rbx, Reg::r13, offsetof(Frame, fp));
+  }
+
+  /// Loops back to the start for a self tail call, or else returns so the VM
+  /// can make the call
+  void tail_call(int32_t callee, int arg_count) {
+    a.mov(Reg::rdi, Reg::r12);
+    a.mov(Reg::rsi, Reg::r13);
+    a.lea(Reg::rdx, Reg::rbx, callee);
+    a.mov(Reg::rcx, (uint64_t)arg_count);
+    a.call((const void *)helpers.tail_call);
+    a.test32(Reg::rax, Reg::rax);
+    a.jcc(Cond::ne, entry);
+    a.mov(Reg::rax, (uint64_t)0);
+    a.jmp(epilogue);
+  }
+
+  void return_(int32_t result) {
+    a.lea(Reg::rax, Reg::rbx, result);
+    a.jmp(epilogue);
+  }
+
+  JitHelpers helpers;
+  Assembler a;
+  Label entry, epilogue;
+  std::deque<Label> label_storage;
+  /// Out of line slow paths, emitted after the function body
+  std::vector<std::function<void()>> cold;
+};
+
+/// Baseline JIT: translates a function's bytecode op by op into x86-64
+/// templates, so `sp` is never materialized.  Integer arithmetic and branches
+/// are inlined, everything else calls into `JitHelpers`.
+class JitCompiler : CodeEmitter {
+public:
+  JitCompiler(const JitHelpers &helpers) : CodeEmitter(helpers) {}
+
+  /// Returns nullptr if the function can't be compiled
+  std::shared_ptr<NativeCode> compile(const Function &function) {
+#if JIT_SUPPORTED
+    chunk = function.chunk.get();
+    const std::vector<int> &code = chunk->code;
+
+    labels = std::vector<Label>(code.size() + 1);
+    depth_at = std::vector<int>(code.size() + 1, -1);
+    edges.clear();
+
+    prologue();
+
+    depth = function.arity;
+    for (size_t offset = 0; offset < code.size();) {
+      a.bind(labels[offset]);
+      depth_at[offset] = depth;
+
+      Op op = (Op)code[offset];
+      size_t next = offset + 1 + op_n_args(op);
+      const int *args = &code[offset + 1];
+
+      if (const Superinstruction *s = superinstruction(op)) {
+        for (Op component : s->sequence) {
+          emit(component, op_n_args(component) ? *args : 0, next);
+          args += op_n_args(component);
+        }
+      } else {
+        emit(op, op_n_args(op) ? *args : 0, next);
+      }
+
+      offset = next;
+    }
+    a.bind(labels[code.size()]);
+    depth_at[code.size()] = depth;
+
+    // The depths are only static if every jump agrees with the straight-line
+    // depth at its target, which holds for code from our compiler
+    for (auto [target, target_depth] : edges) {
+      if (target > code.size() || depth_at[target] != target_depth) {
+        return nullptr;
+      }
+    }
+
+    epilogue_and_cold_paths();
+
+    return NativeCode::load(a.code());
+#else
+    return nullptr;
+#endif
+  }
+
+private:
+  void emit(Op op, int arg, size_t next) {
+    // quickened ops get the same code as the generic op, which already has an
+    // inline int path
+    op = unquickened(op);
+
+    switch (op) {
+    case Op::load_const:
+      load_const(chunk->constants[arg], slot(depth + 1));
+      break;
+    case Op::get_local:
+      copy(slot(arg + 1), slot(depth + 1));
+      break;
+    case Op::set_local:
+      copy(slot(depth), slot(arg + 1));
+      break;
+    case Op::define_global:
+      call_global(helpers.define_global, slot(depth), arg);
+      break;
+    case Op::get_global:
+      call_global(helpers.get_global, slot(depth + 1), arg);
+      break;
+    case Op::set_global:
+      call_global(helpers.set_global, slot(depth), arg);
+      break;
+    case Op::add:
+    case Op::subtract:
+    case Op::multiply:
+      arithmetic(op, slot(depth - 1));
+      break;
+    case Op::divide:
+      call_arithmetic_helper(op, slot(depth - 1));
+      break;
+    case Op::pop:
+      break;
+    case Op::jump:
+      a.jmp(labels[next + arg]);
+      edges.emplace_back(next + arg, depth);
+      break;
+    case Op::jump_if_zero:
+      branch(slot(depth), false, labels[next + arg]);
+      edges.emplace_back(next + arg, depth - 1);
+      break;
+    case Op::call:
+      call(slot(depth - arg), arg);
+      break;
+    case Op::return_:
+      return_(slot(depth));
+      break;
+    case Op::tail_call:
+      tail_call(slot(depth - arg), arg);
+      break;
+    default:
+      assert(false);
+    }
+
+    depth += op_stack_effect(op, arg);
+  }
+
+  void arithmetic(Op op, int32_t lhs) {
+    Label &slow = new_label(), &done = new_label();
+
+    int_arithmetic(op, lhs, slow);
+    a.bind(done);
+
+    cold.push_back([this, op, lhs, &slow, &done] {
+      a.bind(slow);
+      call_arithmetic_helper(op, lhs);
+      a.jmp(done);
+    });
+  }
+
+  const Chunk *chunk = nullptr;
+
+  /// Stack slots in use above `fp`, at the op being compiled
+  int depth = 0;
+  /// Code for each bytecode offset
+  std::vector<Label> labels;
+  std::vector<int> depth_at;
+  /// Jump targets, and the stack depth they're jumped to with
+  std::vector<std::pair<size_t, int>> edges;
+};
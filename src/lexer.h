@@ -1,9 +1,13 @@
 #pragma once
 
-#include <cctype>
+#include "scan.h"
+#include <array>
+#include <charconv>
 #include <iostream>
+#include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 enum class TokenType {
@@ -34,9 +38,11 @@ enum class TokenType {
   star,
 };
 
+/// A token, with its text if it has any beyond its type (literals and
+/// identifiers).  The text is a view into the source it was lexed from.
 struct Token {
   TokenType type{};
-  std::string value{};
+  std::string_view value{};
 
   bool operator==(const Token &) const = default;
 };
@@ -99,141 +105,242 @@ inline std::ostream &operator<<(std::ostream &os, Token const &token) {
   return os;
 }
 
+struct Keyword {
+  std::string_view text;
+  TokenType type;
+};
+
+inline constexpr Keyword keywords[] = {
+    {"return", TokenType::kw_return}, {"let", TokenType::kw_let},
+    {"if", TokenType::kw_if},         {"else", TokenType::kw_else},
+    {"fn", TokenType::kw_fn},         {"true", TokenType::kw_true},
+    {"false", TokenType::kw_false},   {"null", TokenType::kw_null},
+};
+
+/// Slot of `text` in the keyword table, from its length and first and last
+/// characters.  It's chosen to be perfect for `keywords`: if adding one makes
+/// two collide, the `static_assert` below fails, and the multipliers (or the
+/// table size) need adjusting.
+constexpr size_t keyword_slot(std::string_view text) {
+  return (text.length() + text.front() * 2 + text.back() * 5) % 16;
+}
+
+/// Each keyword in its slot, with the rest left as empty identifiers
+constexpr std::array<Keyword, 16> make_keyword_table() {
+  std::array<Keyword, 16> table{};
+  table.fill({"", TokenType::identifier});
+  for (const Keyword &keyword : keywords) {
+    table[keyword_slot(keyword.text)] = keyword;
+  }
+  return table;
+}
+
+inline constexpr std::array<Keyword, 16> keyword_table = make_keyword_table();
+
+constexpr bool keyword_table_is_perfect() {
+  for (const Keyword &keyword : keywords) {
+    if (keyword_table[keyword_slot(keyword.text)].text != keyword.text) {
+      return false;
+    }
+  }
+  return true;
+}
+static_assert(keyword_table_is_perfect(), "keywords share a slot");
+
+/// The keyword `text` is, or `identifier`.  `text` mustn't be empty.
+constexpr TokenType keyword_or_identifier(std::string_view text) {
+  const Keyword &keyword = keyword_table[keyword_slot(text)];
+  return keyword.text == text ? keyword.type : TokenType::identifier;
+}
+
+/// Program text, which tokens are views into.  `owner` keeps `text` alive for
+/// anything that holds on to tokens, like functions waiting to be compiled.
+struct Source {
+  std::string_view text;
+  std::shared_ptr<const void> owner;
+
+  /// A source owning a copy of `text`
+  static Source copy(std::string_view text) {
+    auto owned = std::make_shared<const std::string>(text);
+    return {.text = *owned, .owner = owned};
+  }
+};
+
+/// Value of an integer literal token
+inline int parse_int(std::string_view text) {
+  int value = 0;
+  const char *last = text.data() + text.size();
+  auto [end, error] = std::from_chars(text.data(), last, value);
+  if (error != std::errc() || end != last) {
+    std::cerr << "integer literal out of range: " << text << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return value;
+}
+
+/// Value of a double literal token
+inline double parse_double(std::string_view text) {
+  double value = 0;
+  const char *last = text.data() + text.size();
+  auto [end, error] = std::from_chars(text.data(), last, value);
+  if (error != std::errc() || end != last) {
+    std::cerr << "invalid double literal: " << text << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return value;
+}
+
+/// Splits source into tokens without copying it: token values are views into
+/// `src`, which must outlive them.  Tokens can be pulled one at a time with
+/// `next`, or all at once with `lex`.
 class Lexer {
 public:
-  Lexer(const std::string &src) : src(src) {}
+  /// Lexes `src` from `begin`.  Positions are always relative to the start of
+  /// `src`.
+  Lexer(std::string_view src, size_t begin = 0)
+      : src(src), current_position(begin) {}
 
+  /// All of the tokens
   std::vector<Token> lex() {
     std::vector<Token> tokens;
+    // tokens average a few characters, and growing the vector as it goes
+    // copies large files' tokens several times over
+    tokens.reserve((src.length() - current_position) / 4);
 
+    while (auto token = next()) {
+      tokens.push_back(*token);
+    }
+
+    return tokens;
+  }
+
+  /// The next token, or nothing at the end of the source
+  std::optional<Token> next() {
     while (auto ch = peek()) {
-      if (std::isspace(*ch)) {
-        consume();
+      token_start = current_position;
+
+      if (scan::is_space(*ch)) {
+        skip(scan::skip_space);
       } else if (*ch == '/' && peek(1) == '/') {
-        consume();
-        consume();
-        while (peek() != '\n') {
-          consume();
-        }
+        skip_to('\n');
       } else if (*ch == '/' && peek(1) == '*') {
         consume();
         consume();
 
-        while (peek() && peek() != '*' && peek(1) != '/') {
+        // up to and including the next `*/`, if there is one
+        while (skip_to('*'), peek()) {
           consume();
+          if (peek() == '/') {
+            consume();
+            break;
+          }
         }
-
-        if (peek()) {
-          consume();
-          consume();
-        }
-      } else if (std::isdigit(*ch)) {
-        std::string value =
-            consume_while([](char c) { return std::isdigit(c); });
+      } else if (scan::is_digit(*ch)) {
+        skip(scan::skip_digits);
         if (peek() == '.') {
           consume();
-          value += '.';
-          value += consume_while([](char c) { return std::isdigit(c); });
-          tokens.push_back({.type = TokenType::double_literal, .value = value});
+          skip(scan::skip_digits);
+          return Token{.type = TokenType::double_literal,
+                       .value = since(token_start)};
         } else {
-          tokens.push_back(
-              {.type = TokenType::integer_literal, .value = value});
+          return Token{.type = TokenType::integer_literal,
+                       .value = since(token_start)};
         }
-      } else if (std::isalpha(*ch)) {
-        auto value = consume_while([](char c) { return std::isalnum(c); });
-        if (value == "return") {
-          tokens.push_back({.type = TokenType::kw_return});
-        } else if (value == "let") {
-          tokens.push_back({.type = TokenType::kw_let});
-        } else if (value == "if") {
-          tokens.push_back({.type = TokenType::kw_if});
-        } else if (value == "else") {
-          tokens.push_back({.type = TokenType::kw_else});
-        } else if (value == "fn") {
-          tokens.push_back({.type = TokenType::kw_fn});
-        } else if (value == "true") {
-          tokens.push_back({.type = TokenType::kw_true});
-        } else if (value == "false") {
-          tokens.push_back({.type = TokenType::kw_false});
-        } else if (value == "null") {
-          tokens.push_back({.type = TokenType::kw_null});
+      } else if (scan::is_alpha(*ch)) {
+        skip(scan::skip_alnum);
+        std::string_view value = since(token_start);
+        TokenType type = keyword_or_identifier(value);
+        if (type == TokenType::identifier) {
+          return Token{.type = type, .value = value};
         } else {
-          tokens.push_back({.type = TokenType::identifier, .value = value});
+          return Token{.type = type};
         }
       } else if (*ch == '"') {
         consume();
-        auto value = consume_while([](char c) { return c != '"'; });
+        skip_to('"');
+        std::string_view value = since(token_start + 1);
         if (peek() != '"') {
           std::cerr << "expected \" to end string literal" << std::endl;
           exit(EXIT_FAILURE);
         }
         consume();
-        tokens.push_back({.type = TokenType::string_literal, .value = value});
+        return Token{.type = TokenType::string_literal, .value = value};
       } else if (*ch == '=') {
         consume();
-        tokens.push_back({.type = TokenType::equals});
+        return Token{.type = TokenType::equals};
       } else if (*ch == '(') {
         consume();
-        tokens.push_back({.type = TokenType::open_paren});
+        return Token{.type = TokenType::open_paren};
       } else if (*ch == ')') {
         consume();
-        tokens.push_back({.type = TokenType::close_paren});
+        return Token{.type = TokenType::close_paren};
       } else if (*ch == '{') {
         consume();
-        tokens.push_back({.type = TokenType::open_curly});
+        return Token{.type = TokenType::open_curly};
       } else if (*ch == '}') {
         consume();
-        tokens.push_back({.type = TokenType::close_curly});
+        return Token{.type = TokenType::close_curly};
       } else if (*ch == ',') {
         consume();
-        tokens.push_back({.type = TokenType::comma});
+        return Token{.type = TokenType::comma};
       } else if (*ch == '-') {
         consume();
-        tokens.push_back({.type = TokenType::minus});
+        return Token{.type = TokenType::minus};
       } else if (*ch == '+') {
         consume();
-        tokens.push_back({.type = TokenType::plus});
+        return Token{.type = TokenType::plus};
       } else if (*ch == ';') {
         consume();
-        tokens.push_back({.type = TokenType::semicolon});
+        return Token{.type = TokenType::semicolon};
       } else if (*ch == '/') {
         consume();
-        tokens.push_back({.type = TokenType::slash});
+        return Token{.type = TokenType::slash};
       } else if (*ch == '*') {
         consume();
-        tokens.push_back({.type = TokenType::star});
+        return Token{.type = TokenType::star};
       } else {
         std::cerr << "unexpected character: " << *ch << std::endl;
         exit(EXIT_FAILURE);
       }
     }
 
-    return tokens;
+    return std::nullopt;
   }
 
+  /// Where the token last returned by `next` starts in the source
+  size_t start() const { return token_start; }
+
 private:
   [[nodiscard]] std::optional<char> peek(int offset = 0) const {
     if (current_position + offset >= src.length()) {
       return std::nullopt;
     } else {
-      return src.at(current_position + offset);
+      return src[current_position + offset];
     }
   }
 
-  char consume() { return src.at(current_position++); }
+  char consume() { return src[current_position++]; }
 
-  template <typename F> std::string consume_while(F f) {
-    std::string result;
-    while (auto ch = peek()) {
-      if (f(*ch)) {
-        result += consume();
-      } else {
-        break;
-      }
-    }
-    return result;
+  /// Moves up to where `scan` stops, from the current position
+  template <typename Scan> void skip(Scan scan) {
+    const char *begin = src.data();
+    current_position =
+        scan(begin + current_position, begin + src.length()) - begin;
+  }
+
+  /// Moves up to the next `c`, or the end
+  void skip_to(char c) {
+    const char *begin = src.data();
+    current_position =
+        scan::find(begin + current_position, begin + src.length(), c) - begin;
+  }
+
+  /// The source from `from` up to the current position
+  std::string_view since(size_t from) const {
+    return src.substr(from, current_position - from);
   }
 
-  std::string src;
-  size_t current_position = 0;
+  std::string_view src;
+  size_t current_position;
+  size_t token_start = 0;
 };
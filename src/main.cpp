@@ -1,48 +1,84 @@
 #include "ast_printer.h"
+#include "closure_vm.h"
 #include "compiler.h"
 #include "disassembler.h"
 #include "linenoise.h"
+#include "reg_vm.h"
 #include "vm.h"
-#include <fstream>
+#include <fcntl.h>
 #include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-static std::string read_program(const char *path) {
+/// Reads the program at `path`, mapping files into memory rather than copying
+static Source read_program(const char *path) {
   if (std::string(path) == "-") {
     std::stringstream s;
     s << std::cin.rdbuf();
-    return s.str();
-  } else {
-    std::ifstream f(path);
-    if (!f) {
-      std::cerr << "failed to open file: " << path << std::endl;
-      exit(EXIT_FAILURE);
-    }
+    return Source::copy(s.str());
+  }
 
-    std::stringstream s;
-    s << f.rdbuf();
-    return s.str();
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    std::cerr << "failed to open file: " << path << std::endl;
+    exit(EXIT_FAILURE);
   }
-}
 
-int main(int argc, char *argv[]) {
-  if (argc > 2) {
-    std::cerr << "error: invalid arguments" << std::endl;
-    std::cerr << "usage:" << std::endl;
-    std::cerr << "  " << argv[0] << "                         # repl"
-              << std::endl;
-    std::cerr << "  " << argv[0] << " path/to/program.dang    # run a program"
-              << std::endl;
+  size_t size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    return Source::copy("");
+  }
+
+  void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    std::cerr << "failed to map file: " << path << std::endl;
     exit(EXIT_FAILURE);
-  } else if (argc == 2) {
-    std::string source = read_program(argv[1]);
+  }
+
+  return Source{
+      .text = std::string_view((const char *)p, size),
+      .owner = std::shared_ptr<const void>(
+          p, [size](const void *p) { munmap((void *)p, size); }),
+  };
+}
+
+static void usage(const char *argv0) {
+  std::cerr << "usage:" << std::endl;
+  std::cerr << "  " << argv0 << " [options]                         # repl"
+            << std::endl;
+  std::cerr << "  " << argv0
+            << " [options] path/to/program.dang    # run a program"
+            << std::endl;
+  std::cerr << "options:" << std::endl;
+  std::cerr << "  --jit=off|on|always    compile hot functions to machine code"
+            << std::endl;
+  std::cerr << "  --jit=trace            compile traces through hot call sites"
+            << std::endl;
+  std::cerr << "  --tier-stats           report functions' tier promotions"
+            << std::endl;
+  std::cerr << "  --engine=register      run on the register VM (without --jit)"
+            << std::endl;
+  std::cerr << "  --engine=closure       run as AST closures (without --jit)"
+            << std::endl;
+  exit(EXIT_FAILURE);
+}
+
+/// Runs the program at `path`, or a REPL if there isn't one
+template <typename VMType>
+static void run(const VMOptions &options, const char *path, bool tier_stats) {
+  VMType vm(options);
+
+  if (path) {
+    Source source = read_program(path);
 
-    VM vm;
     Value result = vm.eval(source);
 
     std::cout << result.to_string() << std::endl;
   } else {
-    VM vm;
-
     char *line;
     while ((line = linenoise("> ")) != NULL) {
       if (!line)
@@ -54,6 +90,60 @@ int main(int argc, char *argv[]) {
       linenoiseFree(line);
     }
   }
+
+  if constexpr (std::is_same_v<VMType, VM>) {
+    if (tier_stats) {
+      vm.print_tier_stats(std::cerr);
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  VMOptions options;
+  Engine engine = Engine::stack;
+  bool tier_stats = false;
+  const char *path = nullptr;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.starts_with("--jit=")) {
+      std::optional<JitMode> mode = parse_jit_mode(arg.substr(6));
+      if (!mode) {
+        std::cerr << "error: invalid jit mode: " << arg.substr(6) << std::endl;
+        usage(argv[0]);
+      }
+      options.jit = *mode;
+    } else if (arg == "--tier-stats") {
+      tier_stats = true;
+    } else if (arg.starts_with("--engine=")) {
+      std::optional<Engine> e = parse_engine(arg.substr(9));
+      if (!e) {
+        std::cerr << "error: invalid engine: " << arg.substr(9) << std::endl;
+        usage(argv[0]);
+      }
+      engine = *e;
+    } else if (!path && (arg == "-" || !arg.starts_with("-"))) {
+      path = argv[i];
+    } else {
+      std::cerr << "error: invalid arguments" << std::endl;
+      usage(argv[0]);
+    }
+  }
+
+  if (engine != Engine::stack && (options.jit != JitMode::off || tier_stats)) {
+    std::cerr << "error: --jit and --tier-stats are only supported by the "
+                 "stack engine"
+              << std::endl;
+    usage(argv[0]);
+  }
+
+  if (engine == Engine::register_) {
+    run<RegVM>(options, path, tier_stats);
+  } else if (engine == Engine::closure) {
+    run<ClosureVM>(options, path, tier_stats);
+  } else {
+    run<VM>(options, path, tier_stats);
+  }
 }
 
 /*int main() {
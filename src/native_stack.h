@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <pthread.h>
+
+/// Bounds the native stack used by code that recurses on it: calls between
+/// JIT compiled functions, closures and `dangc` output.  `start` marks how far
+/// below the caller's frame it may go, and recursing code checks `exhausted`
+/// on the way down.
+class NativeStack {
+public:
+  /// Leaves a good margin on the usual 8MB main thread stack
+  static constexpr size_t DEFAULT_SIZE = 4 * 1024 * 1024;
+
+  /// Allows `size` bytes of stack below the caller's frame
+  [[gnu::always_inline]] void start(size_t size) {
+    limit = (char *)__builtin_frame_address(0) - size;
+  }
+
+  /// Whether the caller's frame is past the end of the stack
+  [[gnu::always_inline]] bool exhausted() const {
+    return (char *)__builtin_frame_address(0) < limit;
+  }
+
+  [[noreturn]] static void overflow_error() {
+    std::cerr << "stack overflow: native stack exhausted" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  /// Calls `f` with how much stack it may `start` with, on a thread of its own
+  /// with a `size` byte stack (committed only as it's used), and waits for it.
+  /// Falls back to the caller's stack if the thread can't be made.
+  template <typename F> static void run_with_stack(size_t size, F f) {
+    struct Task {
+      F &f;
+      size_t size;
+    } task{f, size - RESERVED};
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_t thread;
+    bool started =
+        pthread_attr_setstacksize(&attr, size) == 0 &&
+        pthread_create(
+            &thread, &attr,
+            [](void *arg) -> void * {
+              Task *task = static_cast<Task *>(arg);
+              task->f(task->size);
+              return nullptr;
+            },
+            &task) == 0;
+    pthread_attr_destroy(&attr);
+
+    if (started) {
+      pthread_join(thread, nullptr);
+    } else {
+      f(DEFAULT_SIZE);
+    }
+  }
+
+private:
+  /// Stack a thread made by `run_with_stack` keeps for its thread locals and
+  /// the frames below the last check
+  static constexpr size_t RESERVED = 256 * 1024;
+
+  char *limit = nullptr;
+};
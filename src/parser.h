@@ -1,8 +1,10 @@
 #pragma once
 
+#include "ast_arena.h"
 #include "lexer.h"
-#include "value-ptr.hpp"
-#include <memory>
+#include <array>
+#include <cassert>
+#include <utility>
 #include <variant>
 
 enum class BinOp { add, subtract, multiply, divide };
@@ -16,6 +18,8 @@ inline int bin_op_prec(BinOp op) {
   case BinOp::divide:
     return 1;
   }
+  assert(false);
+  return 0;
 }
 
 inline std::optional<BinOp> bin_op_for_token(TokenType type) {
@@ -33,6 +37,21 @@ inline std::optional<BinOp> bin_op_for_token(TokenType type) {
   }
 }
 
+inline TokenType token_for_bin_op(BinOp op) {
+  switch (op) {
+  case BinOp::add:
+    return TokenType::plus;
+  case BinOp::subtract:
+    return TokenType::minus;
+  case BinOp::multiply:
+    return TokenType::star;
+  case BinOp::divide:
+    return TokenType::slash;
+  }
+  assert(false);
+  return TokenType::plus;
+}
+
 inline std::string to_string(BinOp op) {
   switch (op) {
   case BinOp::add:
@@ -44,6 +63,8 @@ inline std::string to_string(BinOp op) {
   case BinOp::divide:
     return "divide";
   }
+  assert(false);
+  return "";
 }
 
 struct ASTNodeNullLiteral {
@@ -90,8 +111,8 @@ struct ASTNodeFunctionCall;
 struct ASTNodeTerm {
   std::variant<ASTNodeIntegerLiteral, ASTNodeDoubleLiteral,
                ASTNodeBooleanLiteral, ASTNodeNullLiteral, ASTNodeStringLiteral,
-               ASTNodeIdentifier, valuable::value_ptr<ASTNodeParenExpr>,
-               valuable::value_ptr<ASTNodeFunctionCall>>
+               ASTNodeIdentifier, ast_ptr<ASTNodeParenExpr>,
+               ast_ptr<ASTNodeFunctionCall>>
       child;
 
   bool operator==(const ASTNodeTerm &) const = default;
@@ -100,7 +121,7 @@ struct ASTNodeTerm {
 struct ASTNodeExpr;
 
 struct ASTNodeParenExpr {
-  valuable::value_ptr<ASTNodeExpr> child;
+  ast_ptr<ASTNodeExpr> child;
 
   bool operator==(const ASTNodeParenExpr &) const = default;
 };
@@ -113,8 +134,8 @@ struct ASTNodeFunctionCall {
 };
 
 struct ASTNodeBinExpr {
-  valuable::value_ptr<ASTNodeExpr> lhs;
-  valuable::value_ptr<ASTNodeExpr> rhs;
+  ast_ptr<ASTNodeExpr> lhs;
+  ast_ptr<ASTNodeExpr> rhs;
   BinOp op;
 
   bool operator==(const ASTNodeBinExpr &) const = default;
@@ -152,9 +173,9 @@ struct ASTNodeFunctionDef;
 
 struct ASTNodeStmt {
   std::variant<ASTNodeReturn, ASTNodeLet, ASTNodeAssign,
-               valuable::value_ptr<ASTNodeScope>,
-               valuable::value_ptr<ASTNodeIf>,
-               valuable::value_ptr<ASTNodeFunctionDef>>
+               ast_ptr<ASTNodeScope>,
+               ast_ptr<ASTNodeIf>,
+               ast_ptr<ASTNodeFunctionDef>>
       child;
 
   bool operator==(const ASTNodeStmt &) const = default;
@@ -170,8 +191,8 @@ struct ASTNodeElseIf;
 struct ASTNodeElse;
 
 struct ASTNodeIf {
-  using Rest = std::variant<std::monostate, valuable::value_ptr<ASTNodeElseIf>,
-                            valuable::value_ptr<ASTNodeElse>>;
+  using Rest = std::variant<std::monostate, ast_ptr<ASTNodeElseIf>,
+                            ast_ptr<ASTNodeElse>>;
 
   ASTNodeExpr condition;
   ASTNodeScope body;
@@ -198,31 +219,71 @@ struct ASTNodeFunctionDef {
   Token name;
   std::vector<Token> arg_names;
   ASTNodeScope body;
+  /// Characters [first, second) of the source of the body, braces included,
+  /// if a pre-parse skipped it and left `body` empty.  See
+  /// `Parser::parse_function_body`.
+  std::optional<std::pair<size_t, size_t>> skipped_body;
+
+  bool operator==(const ASTNodeFunctionDef &) const = default;
 };
 
 struct ASTNodeProgram {
   std::vector<ASTNodeStmt> body;
+  /// Where the rest of the nodes are
+  std::shared_ptr<ASTArena> arena;
+  /// Tokens parsed.  Every node but the program consumes at least one, so
+  /// this bounds the size of a `FlatAST` copy.
+  size_t token_count = 0;
+
+  bool operator==(const ASTNodeProgram &other) const {
+    return body == other.body;
+  }
+};
 
-  bool operator==(const ASTNodeProgram &) const = default;
+struct ParserOptions {
+  /// Pre-parse: only match the braces of function bodies, recording where
+  /// they are rather than building their AST.  Syntax errors in a body aren't
+  /// found until it's parsed in full.
+  bool skip_function_bodies = false;
 };
 
+/// Parses tokens as `lexer` produces them, rather than lexing everything up
+/// front, so lexing and parsing are one pass over the source.  Only the few
+/// tokens of lookahead are buffered.
 class Parser {
 public:
-  Parser(const std::vector<Token> &tokens) : tokens(tokens) {}
+  /// Parses from `lexer`, allocating nodes in `arena`
+  Parser(Lexer &lexer, ParserOptions options = {},
+         std::shared_ptr<ASTArena> arena = std::make_shared<ASTArena>())
+      : lexer(lexer), options(options), arena(std::move(arena)) {}
+
+  /// Parses the body of `node` that a pre-parse skipped, from the same
+  /// source, into `arena`.  Functions inside it are skipped in turn if
+  /// `options` says to.
+  static ASTNodeScope parse_function_body(const ASTNodeFunctionDef &node,
+                                          std::string_view source,
+                                          std::shared_ptr<ASTArena> arena,
+                                          ParserOptions options) {
+    auto [begin, end] = *node.skipped_body;
+    Lexer lexer(source.substr(0, end), begin);
+    Parser parser(lexer, options, std::move(arena));
+    return *parser.parse_scope();
+  }
 
   ASTNodeProgram parse() {
     std::vector<ASTNodeStmt> body;
 
     while (peek()) {
       if (auto stmt = parse_stmt()) {
-        body.push_back(*stmt);
+        body.push_back(std::move(*stmt));
       } else {
         std::cerr << "expected statement" << std::endl;
         exit(EXIT_FAILURE);
       }
     }
 
-    return {.body = body};
+    return {
+        .body = std::move(body), .arena = arena, .token_count = consumed};
   }
 
   std::optional<ASTNodeStmt> parse_stmt() {
@@ -240,7 +301,7 @@ public:
       }
       must_consume(TokenType::semicolon, "expected `;`");
 
-      return {{.child = (ASTNodeReturn){.expr = *expr}}};
+      return {{.child = (ASTNodeReturn){.expr = std::move(*expr)}}};
     } else if (token->type == TokenType::kw_let) {
       consume();
 
@@ -254,7 +315,8 @@ public:
       }
       must_consume(TokenType::semicolon, "expected `;`");
 
-      return {{.child = (ASTNodeLet){.identifier = identifier, .expr = *expr}}};
+      return {{.child = (ASTNodeLet){.identifier = identifier,
+                                     .expr = std::move(*expr)}}};
     } else if (token->type == TokenType::identifier && peek(1) &&
                peek(1)->type == TokenType::equals) {
       auto identifier = consume();
@@ -267,15 +329,15 @@ public:
       }
       must_consume(TokenType::semicolon, "expected `;`");
 
-      return {
-          {.child = (ASTNodeAssign){.identifier = identifier, .expr = *expr}}};
+      return {{.child = (ASTNodeAssign){.identifier = identifier,
+                                        .expr = std::move(*expr)}}};
     } else if (token->type == TokenType::open_curly) {
       auto scope = parse_scope();
       if (!scope) {
         std::cerr << "expected scope" << std::endl;
         exit(EXIT_FAILURE);
       }
-      return {{.child = *scope}};
+      return {{.child = make(std::move(*scope))}};
     } else if (token->type == TokenType::kw_if) {
       consume();
 
@@ -293,8 +355,9 @@ public:
 
       ASTNodeIf::Rest rest = parse_if_rest();
 
-      return {{.child = (ASTNodeIf){
-                   .condition = *condition, .body = *body, rest = rest}}};
+      return {{.child = make(ASTNodeIf{.condition = std::move(*condition),
+                                       .body = std::move(*body),
+                                       .rest = rest})}};
     } else if (token->type == TokenType::kw_fn) {
       consume();
 
@@ -317,15 +380,23 @@ public:
 
       must_consume(TokenType::close_paren, "expected argument name or `)`");
 
+      if (options.skip_function_bodies) {
+        return {{.child = make(
+                     ASTNodeFunctionDef{.name = identifier,
+                                        .arg_names = std::move(arguments),
+                                        .skipped_body = skip_scope()})}};
+      }
+
       auto scope = parse_scope();
       if (!scope) {
         std::cerr << "expected scope for function body" << std::endl;
         exit(EXIT_FAILURE);
       }
 
-      return {{.child = (ASTNodeFunctionDef){.name = identifier,
-                                             .arg_names = arguments,
-                                             .body = *scope}}};
+      return {{.child = make(
+                   ASTNodeFunctionDef{.name = identifier,
+                                      .arg_names = std::move(arguments),
+                                      .body = std::move(*scope)})}};
     }
 
     return std::nullopt;
@@ -341,7 +412,7 @@ public:
 
     while (peek() && peek()->type != TokenType::close_curly) {
       if (auto stmt = parse_stmt()) {
-        body.push_back(*stmt);
+        body.push_back(std::move(*stmt));
       } else {
         std::cerr << "expected statement" << std::endl;
         exit(EXIT_FAILURE);
@@ -350,17 +421,26 @@ public:
 
     must_consume(TokenType::close_curly, "expected `}`");
 
-    return {{.body = body}};
+    return {{.body = std::move(body)}};
   }
 
+  /// Parses any `else if`s and `else` after an if.  The chain is parsed in a
+  /// loop, and linked up back to front once it's all been parsed.
   ASTNodeIf::Rest parse_if_rest() {
-    if (!peek() || peek()->type != TokenType::kw_else) {
-      return std::monostate{};
-    }
-    consume();
+    std::vector<ASTNodeElseIf> else_ifs;
+    ASTNodeIf::Rest rest = std::monostate{};
+
+    while (maybe_consume(TokenType::kw_else)) {
+      if (!maybe_consume(TokenType::kw_if)) {
+        auto else_body = parse_scope();
+        if (!else_body) {
+          std::cerr << "expected scope for `else` body" << std::endl;
+          exit(EXIT_FAILURE);
+        }
 
-    if (peek() && peek()->type == TokenType::kw_if) {
-      consume();
+        rest = make(ASTNodeElse{.body = std::move(*else_body)});
+        break;
+      }
 
       auto condition = parse_expr();
       if (!condition) {
@@ -374,63 +454,95 @@ public:
         exit(EXIT_FAILURE);
       }
 
-      ASTNodeIf::Rest rest = parse_if_rest();
-
-      return {(ASTNodeElseIf){
-          .condition = *condition, .body = *body, .rest = rest}};
-    } else {
-      auto else_body = parse_scope();
-      if (!else_body) {
-        std::cerr << "expected scope for `else` body" << std::endl;
-        exit(EXIT_FAILURE);
-      }
+      else_ifs.push_back(
+          {.condition = std::move(*condition), .body = std::move(*body)});
+    }
 
-      return {(ASTNodeElse){.body = *else_body}};
+    for (auto it = else_ifs.rbegin(); it != else_ifs.rend(); it++) {
+      it->rest = rest;
+      rest = make(std::move(*it));
     }
+    return rest;
   }
 
-  std::optional<ASTNodeExpr> parse_expr(int min_prec = 0) {
-    // Based on
-    // https://github.com/orosmatthew/hydrogen-cpp/blob/1e2d30d2c0f75313890f8faba78cedecf144b14e/src/parser.hpp#L144
-
-    auto term_lhs = parse_term();
-    if (!term_lhs)
-      return std::nullopt;
-
-    ASTNodeExpr expr_lhs{*term_lhs};
+  /// Parses an expression by precedence climbing, keeping operands and
+  /// operators waiting to be combined, and the parentheses and calls they're
+  /// in, on stacks of their own rather than recursing.  How deeply an
+  /// expression nests is only limited by memory.
+  std::optional<ASTNodeExpr> parse_expr() {
+    // whether an operand comes next, rather than an operator
+    bool operand = true;
 
     while (true) {
-      auto current_token = peek();
-      if (!current_token)
-        break;
-
-      auto bin_op = bin_op_for_token(current_token->type);
-      if (!bin_op)
-        break;
+      if (operand) {
+        if (auto term = parse_term()) {
+          expr_operands.push_back({std::move(*term)});
+          operand = false;
+        } else if (maybe_consume(TokenType::open_paren)) {
+          expr_groups.push_back({.operands = expr_operands.size(),
+                                 .operators = expr_operators.size()});
+        } else if (peek() && peek()->type == TokenType::identifier &&
+                   peek(1) && peek(1)->type == TokenType::open_paren) {
+          auto name = consume();
+          consume();
+          expr_groups.push_back({.name = name,
+                                 .operands = expr_operands.size(),
+                                 .operators = expr_operators.size()});
+          // a call without arguments closes straight away
+          operand = !peek() || peek()->type != TokenType::close_paren;
+        } else if (expr_groups.empty() && expr_operands.empty()) {
+          return std::nullopt;
+        } else {
+          std::cerr << "expected expression" << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        continue;
+      }
 
-      auto prec = bin_op_prec(*bin_op);
-      if (prec < min_prec)
-        break;
+      size_t base = expr_groups.empty() ? 0 : expr_groups.back().operators;
 
-      consume();
+      auto bin_op = peek() ? bin_op_for_token(peek()->type) : std::nullopt;
+      if (bin_op) {
+        consume();
+        // operators to the left that bind at least as tightly go first
+        combine(base, bin_op_prec(*bin_op));
+        expr_operators.push_back(*bin_op);
+        operand = true;
+        continue;
+      }
 
-      int next_min_prec = prec + 1;
-      auto expr_rhs = parse_expr(next_min_prec);
+      combine(base, 0);
+      if (expr_groups.empty()) {
+        ASTNodeExpr expr = std::move(expr_operands.back());
+        expr_operands.pop_back();
+        return expr;
+      }
 
-      if (!expr_rhs) {
-        std::cerr << "expected expression" << std::endl;
-        exit(EXIT_FAILURE);
+      Group &group = expr_groups.back();
+      if (expr_operands.size() > group.operands) {
+        group.exprs.push_back(std::move(expr_operands.back()));
+        expr_operands.pop_back();
       }
 
-      ASTNodeBinExpr bin_expr = {
-          .lhs = expr_lhs, .rhs = *expr_rhs, .op = *bin_op};
+      if (group.name && maybe_consume(TokenType::comma)) {
+        operand = true;
+        continue;
+      }
+      must_consume(TokenType::close_paren, "expected `)`");
 
-      expr_lhs = {bin_expr};
+      if (group.name) {
+        expr_operands.push_back({ASTNodeTerm{make(ASTNodeFunctionCall{
+            .name = *group.name, .arguments = std::move(group.exprs)})}});
+      } else {
+        expr_operands.push_back({ASTNodeTerm{make(ASTNodeParenExpr{
+            .child = make(std::move(group.exprs.front()))})}});
+      }
+      expr_groups.pop_back();
     }
-
-    return expr_lhs;
   }
 
+  /// Parses a term with nothing nested in it: a literal or a variable.
+  /// `parse_expr` parses parentheses and calls.
   std::optional<ASTNodeTerm> parse_term() {
     auto token = peek();
     if (!token)
@@ -450,70 +562,102 @@ public:
       return {{.child = (ASTNodeNullLiteral){.token = consume()}}};
     } else if (token->type == TokenType::string_literal) {
       return {{.child = (ASTNodeStringLiteral){.token = consume()}}};
-    } else if (token->type == TokenType::identifier && peek(1) &&
-               peek(1)->type == TokenType::open_paren) {
-      auto name = consume();
-      must_consume(TokenType::open_paren, "expected `(`");
-
-      std::vector<ASTNodeExpr> args;
+    } else if (token->type == TokenType::identifier &&
+               !(peek(1) && peek(1)->type == TokenType::open_paren)) {
+      return {{.child = (ASTNodeIdentifier){.token = consume()}}};
+    }
+    return std::nullopt;
+  }
 
-      if (peek() && peek()->type != TokenType::close_paren) {
-        auto first_arg = parse_expr();
-        if (!first_arg) {
-          std::cerr << "expected expression" << std::endl;
-          exit(EXIT_FAILURE);
-        }
+private:
+  template <typename T> T *make(T &&node) {
+    return arena->make(std::move(node));
+  }
 
-        args.push_back(*first_arg);
+  /// Parentheses or a call that `parse_expr` is in the middle of
+  struct Group {
+    /// The function called, or none for parentheses
+    std::optional<Token> name;
+    /// The expression in parentheses, or the arguments so far
+    std::vector<ASTNodeExpr> exprs;
+    /// Sizes of the operand and operator stacks when the group was opened:
+    /// those above them are the group's own
+    size_t operands;
+    size_t operators;
+  };
+
+  /// Combines the operators above `base` into binary expressions, from the
+  /// right, while they have at least `min_prec`
+  void combine(size_t base, int min_prec) {
+    while (expr_operators.size() > base &&
+           bin_op_prec(expr_operators.back()) >= min_prec) {
+      ASTNodeBinExpr bin_expr = {.rhs = make(std::move(expr_operands.back())),
+                                 .op = expr_operators.back()};
+      expr_operands.pop_back();
+      expr_operators.pop_back();
+      bin_expr.lhs = make(std::move(expr_operands.back()));
+      expr_operands.back() = {bin_expr};
+    }
+  }
 
-        while (peek() && peek()->type == TokenType::comma) {
-          consume();
+  /// Consumes a scope without parsing it, just matching braces, returning
+  /// where it is in the source
+  std::pair<size_t, size_t> skip_scope() {
+    if (!peek() || peek()->type != TokenType::open_curly) {
+      std::cerr << "expected scope for function body" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    size_t begin = starts[head];
+    consume();
 
-          auto arg = parse_expr();
-          if (!arg) {
-            std::cerr << "expected expression" << std::endl;
-            exit(EXIT_FAILURE);
-          }
-          args.push_back(*arg);
-        }
+    for (int depth = 1;;) {
+      const Token *token = peek();
+      if (!token) {
+        std::cerr << "expected `}`" << std::endl;
+        exit(EXIT_FAILURE);
       }
 
-      must_consume(TokenType::close_paren, "expected `)`");
-
-      return {
-          {.child = (ASTNodeFunctionCall){.name = name, .arguments = args}}};
-    } else if (token->type == TokenType::identifier) {
-      return {{.child = (ASTNodeIdentifier){.token = consume()}}};
-    } else if (token->type == TokenType::open_paren) {
-      consume();
-      if (auto expr = parse_expr()) {
-        must_consume(TokenType::close_paren, "expected `)`");
-        return {{.child = (ASTNodeParenExpr){.child = *expr}}};
-      } else {
-        std::cerr << "expected expression" << std::endl;
-        exit(EXIT_FAILURE);
+      if (token->type == TokenType::open_curly) {
+        depth++;
+      } else if (token->type == TokenType::close_curly && --depth == 0) {
+        // up to just past the `}`
+        size_t end = starts[head] + 1;
+        consume();
+        return {begin, end};
       }
+      consume();
     }
-    // TODO: Variables/etc.
-    return std::nullopt;
   }
 
-private:
-  [[nodiscard]] std::optional<Token> peek(int offset = 0) const {
-    if (current_position + offset >= tokens.size()) {
-      return std::nullopt;
-    } else {
-      return tokens.at(current_position + offset);
+  /// The token `offset` ahead, or null past the end.  It stays valid until
+  /// `LOOKAHEAD` more tokens have been consumed.
+  [[nodiscard]] const Token *peek(size_t offset = 0) {
+    while (buffered <= offset) {
+      std::optional<Token> token = lexer.next();
+      if (!token) {
+        return nullptr;
+      }
+      size_t i = (head + buffered) % LOOKAHEAD;
+      buffer[i] = *token;
+      starts[i] = lexer.start();
+      buffered++;
     }
+    return &buffer[(head + offset) % LOOKAHEAD];
   }
 
-  Token consume() { return tokens.at(current_position++); }
+  /// The next token, which must have been peeked at
+  Token consume() {
+    Token token = buffer[head];
+    head = (head + 1) % LOOKAHEAD;
+    buffered--;
+    consumed++;
+    return token;
+  }
 
   Token must_consume(TokenType type, const char *error_message) {
     auto t = peek();
     if (t && t->type == type) {
-      consume();
-      return *t;
+      return consume();
     } else {
       std::cerr << error_message << std::endl;
       exit(EXIT_FAILURE);
@@ -528,6 +672,20 @@ private:
     }
   }
 
-  std::vector<Token> tokens;
-  size_t current_position = 0;
+  /// Tokens buffered for lookahead, at most two of them at a time
+  static constexpr size_t LOOKAHEAD = 4;
+
+  Lexer &lexer;
+  ParserOptions options;
+  std::shared_ptr<ASTArena> arena;
+  std::array<Token, LOOKAHEAD> buffer;
+  /// Where each token in `buffer` starts in the source
+  std::array<size_t, LOOKAHEAD> starts;
+  size_t head = 0;
+  size_t buffered = 0;
+  size_t consumed = 0;
+  /// `parse_expr`'s stacks, empty between calls, kept to reuse their memory
+  std::vector<ASTNodeExpr> expr_operands;
+  std::vector<BinOp> expr_operators;
+  std::vector<Group> expr_groups;
 };
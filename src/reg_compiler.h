@@ -0,0 +1,488 @@
+#pragma once
+
+#include "compiler.h"
+
+/// Instructions for the register VM.  Registers are slots relative to the
+/// frame pointer: R[0] is the function being run, R[1..arity] its arguments,
+/// then its locals, then temporaries.
+enum class RegOp : int {
+  // load_const  A K :  R[A] = constant K
+  load_const,
+  // move  A B :  R[A] = R[B]
+  move,
+  // define_global  X A :  Define global in slot X as R[A]
+  define_global,
+  // get_global  A X :  R[A] = global in slot X
+  get_global,
+  // set_global  X A :  Sets global in slot X to R[A]
+  set_global,
+  // add  A B C :  R[A] = R[B] + R[C]
+  add,
+  subtract,
+  multiply,
+  divide,
+  // add_k  A B K :  R[A] = R[B] + constant K
+  add_k,
+  subtract_k,
+  multiply_k,
+  divide_k,
+  // jump N :  Jumps N instructions
+  jump,
+  // jump_if_zero A N :  Jumps N instructions if R[A] is zero
+  jump_if_zero,
+  // call A N :  Calls function R[A] with args R[A+1..A+N], result in R[A]
+  call,
+  // tail_call A N :  Like `call` followed by `return`, reusing the frame
+  tail_call,
+  // return A :  Returns R[A]
+  return_,
+
+  // constant for
+  OP_COUNT
+};
+
+inline std::string to_string(RegOp op) {
+  switch (op) {
+  case RegOp::load_const:
+    return "load_const";
+  case RegOp::move:
+    return "move";
+  case RegOp::define_global:
+    return "define_global";
+  case RegOp::get_global:
+    return "get_global";
+  case RegOp::set_global:
+    return "set_global";
+  case RegOp::add:
+    return "add";
+  case RegOp::subtract:
+    return "subtract";
+  case RegOp::multiply:
+    return "multiply";
+  case RegOp::divide:
+    return "divide";
+  case RegOp::add_k:
+    return "add_k";
+  case RegOp::subtract_k:
+    return "subtract_k";
+  case RegOp::multiply_k:
+    return "multiply_k";
+  case RegOp::divide_k:
+    return "divide_k";
+  case RegOp::jump:
+    return "jump";
+  case RegOp::jump_if_zero:
+    return "jump_if_zero";
+  case RegOp::call:
+    return "call";
+  case RegOp::tail_call:
+    return "tail_call";
+  case RegOp::return_:
+    return "return_";
+  case RegOp::OP_COUNT:
+    return "<invalid>";
+  }
+  return "<invalid>";
+}
+
+inline int op_n_args(RegOp op) {
+  switch (op) {
+  case RegOp::jump:
+  case RegOp::return_:
+    return 1;
+  case RegOp::load_const:
+  case RegOp::move:
+  case RegOp::define_global:
+  case RegOp::get_global:
+  case RegOp::set_global:
+  case RegOp::jump_if_zero:
+  case RegOp::call:
+  case RegOp::tail_call:
+    return 2;
+  case RegOp::add:
+  case RegOp::subtract:
+  case RegOp::multiply:
+  case RegOp::divide:
+  case RegOp::add_k:
+  case RegOp::subtract_k:
+  case RegOp::multiply_k:
+  case RegOp::divide_k:
+    return 3;
+  case RegOp::OP_COUNT:
+    return 0;
+  }
+  return 0;
+}
+
+struct RegChunk {
+  std::vector<int> code;
+  std::vector<Value> constants;
+  /// Registers the function uses, including R[0] and its arguments
+  int num_registers = 1;
+};
+
+/// Compiles the AST into register instructions.  Locals live in fixed
+/// registers and are used as operands in place, so `x = a + b` is a single
+/// `add` rather than four stack ops.
+class RegCompiler {
+public:
+  RegCompiler(GlobalTable &globals, CompilerKind kind = CompilerKind::script)
+      : globals(globals), locals(kind) {}
+
+  static Function compile(std::string_view source, GlobalTable &globals) {
+    Lexer lexer(source);
+    Parser parser(lexer);
+    RegCompiler compiler(globals, CompilerKind::script);
+    return compiler.compile(parser.parse());
+  }
+
+  Function compile(const ASTNodeProgram &node) {
+    for (const auto &stmt : node.body) {
+      (*this)(stmt);
+    }
+
+    return finish("(script)", 0);
+  }
+
+  Function compile(const ASTNodeFunctionDef &node) {
+    for (const auto &arg : node.arg_names) {
+      // args are effectively locals, so we can simply define them as locals
+      define_local(arg.value);
+    }
+
+    for (const auto &stmt : node.body.body) {
+      (*this)(stmt);
+    }
+
+    return finish(std::string(node.name.value), node.arg_names.size());
+  }
+
+  void operator()(const ASTNodeStmt &node) {
+    std::visit(*this, node.child);
+    // temporaries don't outlive a statement
+    next_reg = locals_top;
+  }
+
+  void operator()(const ASTNodeReturn &node) {
+    if (as_call(node.expr)) {
+      into(node.expr, temp(), RegOp::tail_call);
+      return;
+    }
+
+    emit(RegOp::return_, any(node.expr));
+  }
+
+  void operator()(const ASTNodeLet &node) {
+    int reg = temp();
+    into(node.expr, reg);
+
+    auto var = locals.define(node.identifier.value);
+    if (Vars::Local *local = std::get_if<Vars::Local>(&var)) {
+      // the next free register is the one the stack VM would push it to
+      assert(local->index + 1 == reg);
+      locals_top = reg + 1;
+    } else {
+      Vars::Global &global = std::get<Vars::Global>(var);
+      emit(RegOp::define_global, globals.resolve(global.name), reg);
+    }
+  }
+
+  void operator()(const ASTNodeAssign &node) {
+    auto var = locals.lookup(node.identifier.value);
+    if (Vars::Local *local = std::get_if<Vars::Local>(&var)) {
+      into(node.expr, local->index + 1);
+    } else {
+      Vars::Global &global = std::get<Vars::Global>(var);
+      emit(RegOp::set_global, globals.resolve(global.name), any(node.expr));
+    }
+  }
+
+  void operator()(const ASTNodeScope &node) {
+    locals.start_scope();
+
+    for (const auto &stmt : node.body) {
+      (*this)(stmt);
+    }
+
+    // registers of the scope's locals are reused, so needn't be cleared
+    locals_top -= locals.end_scope();
+    next_reg = locals_top;
+  }
+
+  void operator()(const ASTNodeIf &node) {
+    std::vector<int> end_jump_offsets;
+
+    emit(RegOp::jump_if_zero, any(node.condition), 0);
+    // the condition's temporary is dead once tested, and the body's locals
+    // must start at `locals_top`
+    next_reg = locals_top;
+    int i = chunk.code.size() - 1;
+
+    (*this)(node.body);
+
+    const ASTNodeIf::Rest *rest = &node.rest;
+    while (!std::holds_alternative<std::monostate>(*rest)) {
+      emit(RegOp::jump, 0);
+      end_jump_offsets.push_back(chunk.code.size() - 1);
+
+      // if previous condition was false, jump here
+      patch_jump(i);
+
+      if (auto *else_if = std::get_if<ast_ptr<ASTNodeElseIf>>(rest)) {
+        emit(RegOp::jump_if_zero, any((*else_if)->condition), 0);
+        next_reg = locals_top;
+        i = chunk.code.size() - 1;
+
+        (*this)((*else_if)->body);
+        rest = &(*else_if)->rest;
+      } else {
+        i = -1;
+
+        (*this)(std::get<ast_ptr<ASTNodeElse>>(*rest)->body);
+        break;
+      }
+    }
+
+    for (int offset : end_jump_offsets) {
+      patch_jump(offset);
+    }
+
+    if (i >= 0) {
+      // if previous condition was false, jump here
+      patch_jump(i);
+    }
+  }
+
+  void operator()(const ASTNodeFunctionDef &node) {
+    RegCompiler compiler(globals, CompilerKind::function);
+    int k = constant(Value::of(compiler.compile(node)));
+
+    int reg = temp();
+    emit(RegOp::load_const, reg, k);
+
+    auto var = locals.define(node.name.value);
+    if (Vars::Local *local = std::get_if<Vars::Local>(&var)) {
+      assert(local->index + 1 == reg);
+      locals_top = reg + 1;
+    } else {
+      Vars::Global &global = std::get<Vars::Global>(var);
+      emit(RegOp::define_global, globals.resolve(global.name), reg);
+    }
+  }
+
+  template <typename T> void operator()(const ast_ptr<T> &ptr) {
+    return (*this)(*ptr);
+  }
+
+private:
+  /// Evaluates `node` into register `dst`, which is either a local or the
+  /// most recently allocated temporary.  A call at `node` itself is made with
+  /// `call`.  Expressions wait on a stack while their operands are evaluated.
+  void into(const ASTNodeExpr &node, int dst, RegOp call = RegOp::call) {
+    pending_exprs.push_back({.node = &node, .dst = dst, .call = call});
+    while (!pending_exprs.empty()) {
+      PendingExpr &p = pending_exprs.back();
+
+      if (auto *bin = std::get_if<ASTNodeBinExpr>(&p.node->child)) {
+        binary(p, *bin);
+        continue;
+      }
+
+      const ASTNodeTerm &term = std::get<ASTNodeTerm>(p.node->child);
+      if (auto *paren = std::get_if<ast_ptr<ASTNodeParenExpr>>(&term.child)) {
+        p.node = (*paren)->child.get();
+      } else if (auto *c = std::get_if<ast_ptr<ASTNodeFunctionCall>>(
+                     &term.child)) {
+        function_call(p, **c);
+      } else {
+        if (std::optional<Value> k = literal(*p.node)) {
+          emit(RegOp::load_const, p.dst, constant(std::move(*k)));
+        } else {
+          variable(std::get<ASTNodeIdentifier>(term.child).token.value, p.dst);
+        }
+        pending_exprs.pop_back();
+      }
+    }
+  }
+
+  /// An expression `into` is part way through
+  struct PendingExpr {
+    const ASTNodeExpr *node;
+    int dst;
+    RegOp call = RegOp::call;
+    /// Operands evaluated so far
+    size_t done = 0;
+    /// `next_reg` before the operands' temporaries were allocated
+    int saved = 0;
+    /// Where the lhs or the function being called is
+    int reg = 0;
+    /// Where the rhs is
+    int rhs = 0;
+  };
+
+  /// Whether `dst` can be written before the expression going into it is
+  /// finished: nothing above it is live, and it's no local's
+  bool scratch(int dst) const {
+    return dst == next_reg - 1 && dst >= locals_top;
+  }
+
+  /// Steps through `lhs op rhs`, leaving the operands that aren't already in
+  /// registers to `into`
+  void binary(PendingExpr &p, const ASTNodeBinExpr &bin) {
+    switch (p.done++) {
+    case 0:
+      p.saved = next_reg;
+      if (std::optional<int> reg = local_slot(locals, *bin.lhs)) {
+        p.reg = *reg;
+      } else {
+        // a chain like `a + b + c` reuses one register all the way down
+        p.reg = scratch(p.dst) ? p.dst : temp();
+        pending_exprs.push_back({.node = bin.lhs.get(), .dst = p.reg});
+      }
+      return;
+    case 1:
+      if (std::optional<Value> k = literal(*bin.rhs)) {
+        emit(with_constant(arithmetic_op(bin.op)), p.dst, p.reg,
+             constant(std::move(*k)));
+        break;
+      } else if (std::optional<int> reg = local_slot(locals, *bin.rhs)) {
+        p.rhs = *reg;
+      } else {
+        p.rhs = temp();
+        pending_exprs.push_back({.node = bin.rhs.get(), .dst = p.rhs});
+        return;
+      }
+      [[fallthrough]];
+    default:
+      emit(arithmetic_op(bin.op), p.dst, p.reg, p.rhs);
+    }
+
+    next_reg = p.saved;
+    pending_exprs.pop_back();
+  }
+
+  /// Steps through a call, with the function in a register and its args
+  /// after it
+  void function_call(PendingExpr &p, const ASTNodeFunctionCall &node) {
+    if (p.done == 0) {
+      p.saved = next_reg;
+      // the call can be made in place if nothing above `dst` is live
+      p.reg = scratch(p.dst) ? p.dst : temp();
+      variable(node.name.value, p.reg);
+    }
+
+    if (p.done < node.arguments.size()) {
+      const ASTNodeExpr &arg = node.arguments[p.done++];
+      int reg = temp();
+      pending_exprs.push_back({.node = &arg, .dst = reg});
+      return;
+    }
+
+    emit(p.call, p.reg, node.arguments.size());
+    if (p.reg != p.dst) {
+      emit(RegOp::move, p.dst, p.reg);
+    }
+    next_reg = p.saved;
+    pending_exprs.pop_back();
+  }
+
+  /// Reads the variable `name` into `dst`
+  void variable(std::string_view name, int dst) {
+    auto var = locals.lookup(name);
+    if (Vars::Local *local = std::get_if<Vars::Local>(&var)) {
+      if (local->index + 1 != dst) {
+        emit(RegOp::move, dst, local->index + 1);
+      }
+    } else {
+      Vars::Global &global = std::get<Vars::Global>(var);
+      emit(RegOp::get_global, dst, globals.resolve(global.name));
+    }
+  }
+
+  /// Evaluates `node` into some register, which is the local's own if it's
+  /// just a local, otherwise a new temporary
+  int any(const ASTNodeExpr &node) {
+    if (std::optional<int> reg = local_slot(locals, node)) {
+      return *reg;
+    }
+
+    int reg = temp();
+    into(node, reg);
+    return reg;
+  }
+
+  static RegOp arithmetic_op(BinOp op) {
+    switch (op) {
+    case BinOp::add:
+      return RegOp::add;
+    case BinOp::subtract:
+      return RegOp::subtract;
+    case BinOp::multiply:
+      return RegOp::multiply;
+    case BinOp::divide:
+      return RegOp::divide;
+    }
+    return RegOp::add;
+  }
+
+  /// The variant of an arithmetic op taking a constant right hand side
+  static RegOp with_constant(RegOp op) {
+    return (RegOp)((int)op - (int)RegOp::add + (int)RegOp::add_k);
+  }
+
+  void define_local(std::string_view name) {
+    auto var = locals.define(name);
+    assert(std::holds_alternative<Vars::Local>(var));
+    locals_top = std::get<Vars::Local>(var).index + 2;
+    next_reg = locals_top;
+    chunk.num_registers = std::max(chunk.num_registers, next_reg);
+  }
+
+  int temp() {
+    int reg = next_reg++;
+    chunk.num_registers = std::max(chunk.num_registers, next_reg);
+    return reg;
+  }
+
+  int constant(Value v) {
+    chunk.constants.push_back(std::move(v));
+    return chunk.constants.size() - 1;
+  }
+
+  template <typename... Args> void emit(RegOp op, Args... args) {
+    chunk.code.push_back((int)op);
+    (chunk.code.push_back(args), ...);
+    last_op = op;
+  }
+
+  /// Points the jump with its offset at `offset` to the end of the code
+  void patch_jump(int offset) {
+    chunk.code[offset] = chunk.code.size() - offset - 1;
+    end_label = chunk.code.size();
+  }
+
+  Function finish(const std::string &name, int arity) {
+    if (last_op != RegOp::return_ || end_label == (int)chunk.code.size()) {
+      // TODO: Switch to returning a nil instead
+      int reg = temp();
+      emit(RegOp::load_const, reg, constant(Value::of(0)));
+      emit(RegOp::return_, reg);
+    }
+
+    return Function{.name = name,
+                    .arity = arity,
+                    .reg_chunk = std::make_shared<RegChunk>(chunk)};
+  }
+
+  RegChunk chunk{};
+  GlobalTable &globals;
+  Vars locals;
+  /// First register above the locals in scope
+  int locals_top = 1;
+  /// Next free temporary register
+  int next_reg = 1;
+  RegOp last_op = RegOp::OP_COUNT;
+  /// Offset most recently jumped to, to tell if the code can run off its end
+  int end_label = -1;
+  std::vector<PendingExpr> pending_exprs;
+};
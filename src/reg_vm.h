@@ -0,0 +1,242 @@
+#pragma once
+
+#include "frame.h"
+#include "reg_compiler.h"
+#include "vm.h"
+
+/// Runs code from `RegCompiler`.  Each instruction names its operands'
+/// registers, so arithmetic on locals needs no pushes or pops and takes a
+/// fraction of the dispatches the stack VM does.  Calls work as in the stack
+/// VM: the callee's frame starts at the register holding it, so the arguments
+/// are already in place.  Doesn't support the JIT.
+class RegVM : VMBase {
+public:
+  RegVM(VMOptions options = {}) : VMBase(options) {}
+
+  Value eval(std::string_view source) {
+    Function function = RegCompiler::compile(source, *global_table);
+    globals.resize(global_table->size());
+
+    if (stack_end - stack < function.reg_chunk->num_registers) {
+      grow_stack(frames.get(), function.reg_chunk->num_registers);
+    }
+
+    stack[0] = Value::of(function);
+    enter_function(frames.get(), stack);
+    run(frames.get());
+
+    Value result = std::move(stack[0]);
+    return result;
+  }
+
+  Value eval(const Source &source) { return eval(source.text); }
+
+private:
+  void enter_function(Frame *frame, Value *fp) {
+    const Function &function = fp->function_value();
+    frame->function = &function;
+    frame->ip = function.reg_chunk->code.data();
+    frame->fp = fp;
+  }
+
+  /// Interprets the function entered in `base` until it returns
+  void run(Frame *base) {
+    Frame *frame = base;
+    int *ip = frame->ip;
+    Value *fp = frame->fp;
+    Global *globals = this->globals.data();
+    const Value *constants = frame->function->reg_chunk->constants.data();
+
+#define READ_OP() (*ip++)
+#define READ_ARG() (*ip++)
+
+// Makes room for the registers of a function about to be entered at
+// `new_fp`, which is rebased (along with `fp`) if the stack moves
+#define ENSURE_REGISTERS(new_fp, n)                                            \
+  if (stack_end - (new_fp) < (n)) {                                            \
+    size_t fp_offset = (new_fp) - stack;                                       \
+    grow_stack(frame + 1, fp_offset + (n));                                    \
+    new_fp = stack + fp_offset;                                                \
+    fp = frame->fp;                                                            \
+  }
+
+// R[A] = R[B] op rhs, with ints handled inline
+#define ARITHMETIC(op, rhs)                                                    \
+  {                                                                            \
+    Value &dst = fp[READ_ARG()];                                               \
+    const Value &a = fp[READ_ARG()];                                           \
+    const Value &b = rhs;                                                      \
+    if (a.is_int() && b.is_int()) {                                            \
+      dst = Value::of(a.int_value() op b.int_value());                         \
+    } else {                                                                   \
+      dst = a op b;                                                            \
+    }                                                                          \
+  }
+
+#if THREADED_DISPATCH
+    // Order must match `RegOp`
+    static void *dispatch_table[] = {
+        &&op_load_const, &&op_move,       &&op_define_global,
+        &&op_get_global, &&op_set_global, &&op_add,
+        &&op_subtract,   &&op_multiply,   &&op_divide,
+        &&op_add_k,      &&op_subtract_k, &&op_multiply_k,
+        &&op_divide_k,   &&op_jump,       &&op_jump_if_zero,
+        &&op_call,       &&op_tail_call,  &&op_return_,
+    };
+    static_assert(sizeof(dispatch_table) / sizeof(dispatch_table[0]) ==
+                  (size_t)RegOp::OP_COUNT);
+
+// See `VM::run` on what handlers may hold across DISPATCH()
+#define TARGET(op) op_##op:
+#define DISPATCH() goto *dispatch_table[READ_OP()]
+
+    DISPATCH();
+#else
+#define TARGET(op) case RegOp::op:
+#define DISPATCH() continue
+
+    while (true) {
+      switch ((RegOp)READ_OP()) {
+#endif
+
+    TARGET(load_const) {
+      Value &dst = fp[READ_ARG()];
+      dst = constants[READ_ARG()];
+      DISPATCH();
+    }
+    TARGET(move) {
+      Value &dst = fp[READ_ARG()];
+      dst = fp[READ_ARG()];
+      DISPATCH();
+    }
+    TARGET(define_global) {
+      Global &global = globals[READ_ARG()];
+      if (global.defined) {
+        global_error(global, "already defined");
+      }
+      global.value = fp[READ_ARG()];
+      global.defined = true;
+      DISPATCH();
+    }
+    TARGET(get_global) {
+      Value &dst = fp[READ_ARG()];
+      Global &global = globals[READ_ARG()];
+      if (!global.defined) {
+        global_error(global, "not defined");
+      }
+      dst = global.value;
+      DISPATCH();
+    }
+    TARGET(set_global) {
+      Global &global = globals[READ_ARG()];
+      if (!global.defined) {
+        global_error(global, "not defined");
+      }
+      global.value = fp[READ_ARG()];
+      DISPATCH();
+    }
+    TARGET(add) {
+      ARITHMETIC(+, fp[READ_ARG()]);
+      DISPATCH();
+    }
+    TARGET(subtract) {
+      ARITHMETIC(-, fp[READ_ARG()]);
+      DISPATCH();
+    }
+    TARGET(multiply) {
+      ARITHMETIC(*, fp[READ_ARG()]);
+      DISPATCH();
+    }
+    TARGET(divide) {
+      ARITHMETIC(/, fp[READ_ARG()]);
+      DISPATCH();
+    }
+    TARGET(add_k) {
+      ARITHMETIC(+, constants[READ_ARG()]);
+      DISPATCH();
+    }
+    TARGET(subtract_k) {
+      ARITHMETIC(-, constants[READ_ARG()]);
+      DISPATCH();
+    }
+    TARGET(multiply_k) {
+      ARITHMETIC(*, constants[READ_ARG()]);
+      DISPATCH();
+    }
+    TARGET(divide_k) {
+      ARITHMETIC(/, constants[READ_ARG()]);
+      DISPATCH();
+    }
+    TARGET(jump) {
+      int n = READ_ARG();
+      ip += n;
+      DISPATCH();
+    }
+    TARGET(jump_if_zero) {
+      const Value &v = fp[READ_ARG()];
+      int n = READ_ARG();
+      ip += v ? 0 : n;
+      DISPATCH();
+    }
+    TARGET(call) {
+      Value *callee = fp + READ_ARG();
+      int arg_count = READ_ARG();
+      const Function &f = check_call(*callee, arg_count);
+      ENSURE_REGISTERS(callee, f.reg_chunk->num_registers);
+
+      frame->ip = ip;
+      if (++frame == frames_end) {
+        call_depth_error();
+      }
+      enter_function(frame, callee);
+
+      ip = frame->ip;
+      fp = callee;
+      constants = f.reg_chunk->constants.data();
+      DISPATCH();
+    }
+    TARGET(tail_call) {
+      Value *callee = fp + READ_ARG();
+      int arg_count = READ_ARG();
+      const Function &f = check_call(*callee, arg_count);
+
+      // move the function & args down over the current frame
+      for (int i = 0; i <= arg_count; i++) {
+        fp[i] = std::move(callee[i]);
+      }
+      ENSURE_REGISTERS(fp, f.reg_chunk->num_registers);
+      enter_function(frame, fp);
+
+      ip = frame->ip;
+      constants = f.reg_chunk->constants.data();
+      DISPATCH();
+    }
+    TARGET(return_) {
+      // result replaces the function being called
+      *fp = std::move(fp[READ_ARG()]);
+      if (frame == base) {
+        return;
+      }
+
+      frame--;
+      ip = frame->ip;
+      fp = frame->fp;
+      constants = frame->function->reg_chunk->constants.data();
+      DISPATCH();
+    }
+
+#if !THREADED_DISPATCH
+      case RegOp::OP_COUNT:
+        assert(false);
+      }
+    }
+#endif
+
+#undef READ_OP
+#undef READ_ARG
+#undef ENSURE_REGISTERS
+#undef ARITHMETIC
+#undef TARGET
+#undef DISPATCH
+  }
+};
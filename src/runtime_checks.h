@@ -0,0 +1,45 @@
+#pragma once
+
+#include "value.h"
+#include <cstdlib>
+#include <iostream>
+#include <string_view>
+
+// Checks every engine makes on calls and globals, so they all fail the same
+// way.  Included by `aot_runtime.h`, so depends on nothing but `value.h`.
+
+/// A global variable's slot
+struct Global {
+  Value value;
+  bool defined = false;
+};
+
+[[noreturn]] inline void global_error(std::string_view name,
+                                      const char *message) {
+  std::cerr << "global '" << name << "' " << message << std::endl;
+  exit(EXIT_FAILURE);
+}
+
+[[noreturn]] inline void call_depth_error(int max_call_depth) {
+  std::cerr << "stack overflow: exceeded maximum call depth of "
+            << max_call_depth << std::endl;
+  exit(EXIT_FAILURE);
+}
+
+/// The function `callee` holds, if it can be called with `arg_count` args
+inline const Function &check_call(const Value &callee, int arg_count) {
+  if (callee.type() != ValueType::function) {
+    std::cerr << "Cannot call non-function" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  const Function &f = callee.function_value();
+  if (arg_count != f.arity) {
+    std::cerr << "Incorrect number of arguments to `" << f.name
+              << "`, expected " << f.arity << " but got " << arg_count
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  return f;
+}
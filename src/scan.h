@@ -0,0 +1,121 @@
+#pragma once
+
+// Scan 16 bytes at a time with SSE2 where it's available, otherwise a byte at
+// a time
+#ifndef SIMD_SCAN
+#if defined(__SSE2__)
+#define SIMD_SCAN 1
+#else
+#define SIMD_SCAN 0
+#endif
+#endif
+
+#if SIMD_SCAN
+#include <emmintrin.h>
+#endif
+
+/// Finding where runs of characters end, for the lexer.  Each function returns
+/// the first character in `[p, end)` it stops at, or `end`.
+namespace scan {
+
+inline bool is_space(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+inline bool is_alpha(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+inline bool is_alnum(char c) { return is_alpha(c) || is_digit(c); }
+
+#if SIMD_SCAN
+/// Bytes of `v` from `lo` to `hi`.  Bytes from 0x80 compare as negative, so
+/// are never in range.
+inline __m128i in_range(__m128i v, char lo, char hi) {
+  return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                       _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+
+inline __m128i spaces(__m128i v) {
+  return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                      in_range(v, '\t', '\r'));
+}
+inline __m128i digits(__m128i v) { return in_range(v, '0', '9'); }
+inline __m128i alnums(__m128i v) {
+  // setting 0x20 lower-cases letters, without moving anything else into a-z
+  __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+  return _mm_or_si128(in_range(lower, 'a', 'z'), digits(v));
+}
+
+/// First character for which `stop` holds, where `stops` gives a bit per byte
+/// of a 16 byte block for which it does
+template <typename Stops, typename Stop>
+inline const char *first(const char *p, const char *end, Stops stops,
+                         Stop stop) {
+  while (end - p >= 16) {
+    unsigned mask = stops(_mm_loadu_si128((const __m128i *)p));
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+
+  while (p < end && !stop(*p)) {
+    p++;
+  }
+  return p;
+}
+
+/// First character outside of a class, given by `in_class` per byte
+template <typename InClass, typename Scalar>
+inline const char *skip(const char *p, const char *end, InClass in_class,
+                        Scalar scalar) {
+  return first(
+      p, end,
+      [&](__m128i v) { return ~_mm_movemask_epi8(in_class(v)) & 0xffff; },
+      [&](char c) { return !scalar(c); });
+}
+
+inline const char *skip_space(const char *p, const char *end) {
+  return skip(p, end, spaces, is_space);
+}
+inline const char *skip_digits(const char *p, const char *end) {
+  return skip(p, end, digits, is_digit);
+}
+inline const char *skip_alnum(const char *p, const char *end) {
+  return skip(p, end, alnums, is_alnum);
+}
+
+/// The first `c`
+inline const char *find(const char *p, const char *end, char c) {
+  __m128i needle = _mm_set1_epi8(c);
+  return first(
+      p, end,
+      [&](__m128i v) {
+        return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+      },
+      [&](char ch) { return ch == c; });
+}
+#else
+template <typename Scalar>
+inline const char *skip(const char *p, const char *end, Scalar scalar) {
+  while (p < end && scalar(*p)) {
+    p++;
+  }
+  return p;
+}
+
+inline const char *skip_space(const char *p, const char *end) {
+  return skip(p, end, is_space);
+}
+inline const char *skip_digits(const char *p, const char *end) {
+  return skip(p, end, is_digit);
+}
+inline const char *skip_alnum(const char *p, const char *end) {
+  return skip(p, end, is_alnum);
+}
+
+/// The first `c`
+inline const char *find(const char *p, const char *end, char c) {
+  return skip(p, end, [c](char ch) { return ch != c; });
+}
+#endif
+
+} // namespace scan
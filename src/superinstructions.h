@@ -0,0 +1,112 @@
+#pragma once
+
+#include "chunk.h"
+#include <cassert>
+#include <utility>
+#include <vector>
+
+struct Superinstruction {
+  std::vector<Op> sequence;
+  Op fused;
+};
+
+/// Opcode sequences to fuse, longest first.  Picked from `opcode_ngrams`
+/// counts over the example programs and benchmark workloads.
+inline const std::vector<Superinstruction> &superinstructions() {
+  static const std::vector<Superinstruction> table = {
+      {{Op::get_local, Op::load_const, Op::subtract},
+       Op::get_local_load_const_subtract},
+      {{Op::get_local, Op::get_local}, Op::get_local_get_local},
+      {{Op::get_local, Op::jump_if_zero}, Op::get_local_jump_if_zero},
+      {{Op::load_const, Op::return_}, Op::load_const_return},
+      {{Op::add, Op::return_}, Op::add_return},
+  };
+  return table;
+}
+
+/// The superinstruction `op` is, or nullptr if it isn't one
+inline const Superinstruction *superinstruction(Op op) {
+  for (const Superinstruction &s : superinstructions()) {
+    if (s.fused == op) {
+      return &s;
+    }
+  }
+  return nullptr;
+}
+
+inline bool is_jump(Op op) { return op == Op::jump || op == Op::jump_if_zero; }
+
+/// Rewrites `chunk.code`, replacing runs of ops that match a superinstruction
+/// with the fused op.  A run is only fused if nothing jumps into the middle of
+/// it, and jump offsets are relocated to account for the shorter code.
+inline void fuse_superinstructions(Chunk &chunk) {
+  const std::vector<int> &code = chunk.code;
+
+  std::vector<size_t> starts;
+  std::vector<bool> is_jump_target(code.size() + 1, false);
+  for (size_t offset = 0; offset < code.size();) {
+    starts.push_back(offset);
+    Op op = (Op)code[offset];
+    if (is_jump(op)) {
+      is_jump_target[offset + 2 + code[offset + 1]] = true;
+    }
+    offset += 1 + op_n_args(op);
+  }
+
+  auto matches = [&](size_t start, const std::vector<Op> &sequence) {
+    if (start + sequence.size() > starts.size()) {
+      return false;
+    }
+    for (size_t i = 0; i < sequence.size(); i++) {
+      if ((Op)code[starts[start + i]] != sequence[i]) {
+        return false;
+      }
+      if (i > 0 && is_jump_target[starts[start + i]]) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  std::vector<int> fused;
+  std::vector<int> new_offset(code.size() + 1, 0);
+  // (index of jump argument in `fused`, old jump target)
+  std::vector<std::pair<size_t, size_t>> jumps;
+
+  for (size_t i = 0; i < starts.size();) {
+    const Superinstruction *match = nullptr;
+    for (const Superinstruction &s : superinstructions()) {
+      if (matches(i, s.sequence)) {
+        match = &s;
+        break;
+      }
+    }
+
+    size_t count = match ? match->sequence.size() : 1;
+    new_offset[starts[i]] = fused.size();
+    fused.push_back(match ? match->fused : code[starts[i]]);
+
+    for (size_t j = i; j < i + count; j++) {
+      size_t offset = starts[j];
+      Op op = (Op)code[offset];
+      if (is_jump(op)) {
+        // offsets are relative to the end of the instruction, so a jump can
+        // only be the last op of a superinstruction
+        assert(j == i + count - 1);
+        jumps.push_back({fused.size(), offset + 2 + code[offset + 1]});
+      }
+      for (int arg = 0; arg < op_n_args(op); arg++) {
+        fused.push_back(code[offset + 1 + arg]);
+      }
+    }
+
+    i += count;
+  }
+  new_offset[code.size()] = fused.size();
+
+  for (auto [arg, old_target] : jumps) {
+    fused[arg] = new_offset[old_target] - (arg + 1);
+  }
+
+  chunk.code = std::move(fused);
+}
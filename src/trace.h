@@ -0,0 +1,213 @@
+#pragma once
+
+#include "jit.h"
+#include <deque>
+#include <memory>
+#include <vector>
+
+/// One step of a recorded trace.  Slots are indexes relative to the frame
+/// pointer of the function the trace was recorded from (the root), including
+/// the slots of calls inlined into the trace.
+struct TraceOp {
+  enum Kind {
+    // fp[a] = *value
+    load_const,
+    // fp[b] = fp[a]
+    copy,
+    // fp[a] = globals[b]
+    get_global,
+    // globals[b] = fp[a]
+    set_global,
+    define_global,
+    // fp[a] op= fp[a + 1], guarded on both being ints or both doubles
+    arith_int,
+    arith_double,
+    // fp[a] op= fp[a + 1], any types
+    arith_generic,
+    // exits unless fp[a] is truthy == `expected`
+    guard_truthy,
+    // exits unless fp[a] is `*value`, the function that was inlined
+    guard_callee,
+    // calls the function at fp[a] with b arguments
+    call,
+    // an inlined call returning: fp[b] = fp[a]
+    return_inline,
+    // returns fp[a] from the root
+    return_,
+    // tail call to the function at fp[a] with b arguments, looping back to
+    // the start of the trace if it's the root function again
+    tail_call,
+  };
+
+  Kind kind;
+  Op op = Op::add;
+  int a = 0;
+  int b = 0;
+  const Value *value = nullptr;
+  bool expected = false;
+  int exit = -1;
+};
+
+/// Where a guard leaves the trace.  Frames for the calls inlined at that point
+/// are materialized, and the interpreter carries on from `frames.back().ip`.
+struct TraceExit {
+  struct InlineFrame {
+    /// Slot of the called function, relative to the root's frame pointer
+    int fp;
+    /// Where to continue in this frame
+    int *ip;
+  };
+
+  /// The root frame first
+  std::vector<InlineFrame> frames;
+  /// Slot to resume the interpreter with as `sp`
+  int sp;
+  /// Times the exit has been taken
+  int count = 0;
+  /// Index into `TraceTree::paths` of the path recorded from this exit, or -1
+  /// if there isn't one (yet), or -2 if recording failed
+  int path = -1;
+};
+
+struct TracePath {
+  std::vector<TraceOp> ops;
+};
+
+/// The paths recorded through a function from its entry.  The first runs from
+/// the function's entry, and each of the others continues from a side exit
+/// that became hot, so they form a tree.
+struct TraceTree {
+  std::vector<TracePath> paths;
+  std::vector<TraceExit> exits;
+  /// Highest slot any path uses
+  int max_slot = 0;
+  /// Functions inlined into the trace, kept alive so guards can compare
+  /// against them by identity
+  std::deque<Value> inlined;
+  /// Set while a path is being recorded, so only one is recorded at a time
+  bool recording = false;
+
+  std::shared_ptr<NativeCode> native;
+};
+
+/// Compiles a trace tree into guarded, type specialized machine code.  Guards
+/// with a recorded path continue into it, others leave through a stub that
+/// materializes the frames of any inlined calls and returns to the VM.
+class TraceCompiler : CodeEmitter {
+public:
+  TraceCompiler(const JitHelpers &helpers) : CodeEmitter(helpers) {}
+
+  std::shared_ptr<NativeCode> compile(const TraceTree &tree) {
+#if JIT_SUPPORTED
+    this->tree = &tree;
+    exit_labels = std::vector<Label>(tree.exits.size());
+    exit_used = std::vector<bool>(tree.exits.size());
+
+    prologue();
+    emit_path(tree.paths[0]);
+    epilogue_and_cold_paths();
+    emitted_cold = cold.size();
+
+    // cold paths and exits may reach more exits
+    for (size_t i = 0; i < pending_exits.size(); i++) {
+      emit_exit(pending_exits[i]);
+      for (; emitted_cold < cold.size(); emitted_cold++) {
+        cold[emitted_cold]();
+      }
+    }
+
+    return NativeCode::load(a.code());
+#else
+    return nullptr;
+#endif
+  }
+
+private:
+  void emit_path(const TracePath &path) {
+    for (const TraceOp &op : path.ops) {
+      emit(op);
+    }
+  }
+
+  Label &exit_label(int exit) {
+    if (!exit_used[exit]) {
+      exit_used[exit] = true;
+      pending_exits.push_back(exit);
+    }
+    return exit_labels[exit];
+  }
+
+  void emit_exit(int exit) {
+    a.bind(exit_labels[exit]);
+
+    int path = tree->exits[exit].path;
+    if (path >= 0) {
+      emit_path(tree->paths[path]);
+      return;
+    }
+
+    a.mov(Reg::rdi, Reg::r12);
+    a.mov(Reg::rsi, Reg::r13);
+    a.mov(Reg::rdx, (uint64_t)exit);
+    a.call((const void *)helpers.exit);
+    a.mov(Reg::rax, (uint64_t)0);
+    a.jmp(epilogue);
+  }
+
+  void emit(const TraceOp &op) {
+    switch (op.kind) {
+    case TraceOp::load_const:
+      load_const(*op.value, slot(op.a));
+      break;
+    case TraceOp::copy:
+      copy(slot(op.a), slot(op.b));
+      break;
+    case TraceOp::get_global:
+      call_global(helpers.get_global, slot(op.a), op.b);
+      break;
+    case TraceOp::set_global:
+      call_global(helpers.set_global, slot(op.a), op.b);
+      break;
+    case TraceOp::define_global:
+      call_global(helpers.define_global, slot(op.a), op.b);
+      break;
+    case TraceOp::arith_int:
+      int_arithmetic(op.op, slot(op.a), exit_label(op.exit));
+      break;
+    case TraceOp::arith_double:
+      double_arithmetic(op.op, slot(op.a), exit_label(op.exit));
+      break;
+    case TraceOp::arith_generic:
+      call_arithmetic_helper(op.op, slot(op.a));
+      break;
+    case TraceOp::guard_truthy:
+      branch(slot(op.a), !op.expected, exit_label(op.exit));
+      break;
+    case TraceOp::guard_callee:
+      a.load(Reg::rax, Reg::rbx, slot(op.a));
+      a.mov(Reg::rcx, bits(*op.value));
+      a.cmp(Reg::rax, Reg::rcx);
+      a.jcc(Cond::ne, exit_label(op.exit));
+      break;
+    case TraceOp::call:
+      call(slot(op.a), op.b);
+      break;
+    case TraceOp::return_inline:
+      copy(slot(op.a), slot(op.b));
+      break;
+    case TraceOp::return_:
+      return_(slot(op.a));
+      break;
+    case TraceOp::tail_call:
+      tail_call(slot(op.a), op.b);
+      break;
+    }
+  }
+
+  const TraceTree *tree = nullptr;
+  std::vector<Label> exit_labels;
+  std::vector<bool> exit_used;
+  /// Exits jumped to but not yet emitted
+  std::vector<int> pending_exits;
+  size_t emitted_cold = 0;
+};
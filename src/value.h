@@ -1,7 +1,11 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <memory>
 #include <string>
-#include <variant>
 
 enum class ValueType { null_, int_, double_, boolean, string, function };
 
@@ -20,111 +24,222 @@ inline std::string to_string(ValueType t) {
   case ValueType::function:
     return "function";
   }
+  assert(false);
+  return "";
 }
 
 struct Chunk;
+struct ClosureCode;
+struct RegChunk;
+struct Value;
 
 struct Function {
   std::string name;
   int arity;
   std::shared_ptr<Chunk> chunk;
+  /// Code for the register VM, if compiled for it instead
+  std::shared_ptr<RegChunk> reg_chunk;
+  /// Code for the closure engine, if compiled for it instead
+  std::shared_ptr<ClosureCode> closure_code;
+  /// Entry point of a function compiled ahead of time by `dangc`, which has
+  /// no chunk.  Called with the function and its arguments at `fp[0..arity]`.
+  Value (*native)(Value *fp) = nullptr;
 
   bool operator==(const Function &) const = default;
 };
 
+/// Header for heap allocated values.  Objects are reference counted by the
+/// `Value`s that point at them (non-atomically - values are never shared
+/// between threads).
+struct Obj {
+  ValueType type;
+  int refcount = 0;
+};
+
+struct ObjString : Obj {
+  std::string value;
+};
+
+struct ObjFunction : Obj {
+  Function value;
+};
+
+static_assert(sizeof(void *) == 8, "NaN-boxing requires 64-bit pointers");
+
+/// An 8 byte NaN-boxed value.
+///
+/// Doubles are stored as-is.  Everything else is hidden in the payload of a
+/// quiet NaN (which real arithmetic never produces, as NaNs are canonicalized
+/// on the way in):
+///
+///   pointer:  1 11111111111 11 00 <48 bit pointer to Obj>
+///   int:      0 11111111111 11 01 0000000000000000 <32 bit int>
+///   null:     0 11111111111 11 00 ...0001
+///   false:    0 11111111111 11 00 ...0010
+///   true:     0 11111111111 11 00 ...0011
 struct Value {
-  /// Underlying value.  `std::monostate` represents null
-  std::variant<std::monostate, int, double, bool, std::string, Function> value;
+  Value() = default;
+
+  // Copies, moves and refcounting are forced inline: the interpreter loop is
+  // big enough that the compiler otherwise stops inlining into it, and an out
+  // of line call taking `this` keeps a value out of registers.
+
+  [[gnu::always_inline]] Value(const Value &other) : bits(other.bits) {
+    retain();
+  }
+
+  [[gnu::always_inline]] Value(Value &&other) noexcept : bits(other.bits) {
+    other.bits = NULL_BITS;
+  }
+
+  [[gnu::always_inline]] Value &operator=(const Value &other) {
+    other.retain();
+    release();
+    bits = other.bits;
+    return *this;
+  }
+
+  [[gnu::always_inline]] Value &operator=(Value &&other) noexcept {
+    // safe for self-moves without comparing addresses, which would stop
+    // locals being kept in registers
+    uint64_t b = other.bits;
+    other.bits = NULL_BITS;
+    release();
+    bits = b;
+    return *this;
+  }
+
+  [[gnu::always_inline]] ~Value() { release(); }
 
   ValueType type() const {
-    if (std::holds_alternative<std::monostate>(value)) {
-      return ValueType::null_;
-    } else if (std::holds_alternative<int>(value)) {
-      return ValueType::int_;
-    } else if (std::holds_alternative<double>(value)) {
+    if (is_double()) {
       return ValueType::double_;
-    } else if (std::holds_alternative<bool>(value)) {
-      return ValueType::boolean;
-    } else if (std::holds_alternative<std::string>(value)) {
-      return ValueType::string;
-    } else if (std::holds_alternative<Function>(value)) {
-      return ValueType::function;
+    } else if (is_int()) {
+      return ValueType::int_;
+    } else if (is_obj()) {
+      return as_obj()->type;
+    } else if (bits == NULL_BITS) {
+      return ValueType::null_;
     } else {
-      assert(false);
+      return ValueType::boolean;
     }
   }
 
-  bool is_numeric() const {
-    switch (type()) {
-    case ValueType::int_:
-    case ValueType::double_:
-      return true;
-    default:
-      return false;
-    }
-  }
+  bool is_int() const { return (bits & INT_MASK) == INT_TAG; }
+
+  bool is_double() const { return (bits & QNAN) != QNAN; }
+
+  bool is_numeric() const { return is_int() || is_double(); }
 
   double double_value() const {
-    if (const int *v = std::get_if<int>(&value)) {
-      return (double)*v;
+    if (is_int()) {
+      return (double)int_value();
     } else {
-      return std::get<double>(value);
+      return as_double();
     }
   }
 
-  int int_value() const { return std::get<int>(value); }
+  int int_value() const { return (int)(uint32_t)bits; }
 
-  int bool_value() const { return std::get<bool>(value); }
+  int bool_value() const { return bits == TRUE_BITS; }
 
-  std::string string_value() const { return std::get<std::string>(value); }
+  const std::string &string_value() const {
+    assert(type() == ValueType::string);
+    return static_cast<ObjString *>(as_obj())->value;
+  }
 
-  Function function_value() const { return std::get<Function>(value); }
+  const Function &function_value() const {
+    assert(type() == ValueType::function);
+    return static_cast<ObjFunction *>(as_obj())->value;
+  }
 
-  static Value of(int v) { return Value{.value = v}; }
+  static Value of(int v) { return from_bits(INT_TAG | (uint32_t)v); }
 
-  static Value of(double v) { return Value{.value = v}; }
+  static Value of(double v) {
+    if (v != v) {
+      // canonical NaN, so it can't be confused with a boxed value
+      return from_bits(0x7ff8'0000'0000'0000);
+    }
+    uint64_t bits;
+    std::memcpy(&bits, &v, sizeof(bits));
+    return from_bits(bits);
+  }
 
-  static Value of(bool v) { return Value{.value = v}; }
+  static Value of(bool v) { return from_bits(v ? TRUE_BITS : FALSE_BITS); }
 
-  static Value of(const char *v) { return Value{.value = v}; }
+  static Value of(const char *v) { return of(std::string(v)); }
 
-  static Value of(const std::string &v) { return Value{.value = v}; }
+  static Value of(const std::string &v) {
+    ObjString *obj = new ObjString();
+    obj->type = ValueType::string;
+    obj->value = v;
+    return from_obj(obj);
+  }
 
-  bool operator==(const Value &) const = default;
+  static Value of(const Function &v) {
+    ObjFunction *obj = new ObjFunction();
+    obj->type = ValueType::function;
+    obj->value = v;
+    return from_obj(obj);
+  }
 
-  std::string to_string() const {
-    struct ToStringVisitor {
-      std::string operator()(std::monostate v) const { return "null"; }
-      std::string operator()(int v) const { return std::to_string(v); }
-      std::string operator()(double v) const { return std::to_string(v); }
-      std::string operator()(bool v) const { return std::to_string(v); }
-      std::string operator()(const std::string &v) const { return v; }
-      std::string operator()(const Function &v) const {
-        return "#<Function(" + v.name + ")>;";
+  bool operator==(const Value &rhs) const {
+    if (is_double() && rhs.is_double()) {
+      return as_double() == rhs.as_double();
+    } else if (is_obj() && rhs.is_obj()) {
+      if (type() != rhs.type()) {
+        return false;
+      } else if (type() == ValueType::string) {
+        return string_value() == rhs.string_value();
+      } else {
+        return function_value() == rhs.function_value();
       }
-    };
-    return std::visit(ToStringVisitor{}, value);
+    } else {
+      return bits == rhs.bits;
+    }
+  }
+
+  std::string to_string() const {
+    switch (type()) {
+    case ValueType::null_:
+      return "null";
+    case ValueType::int_:
+      return std::to_string(int_value());
+    case ValueType::double_:
+      return std::to_string(as_double());
+    case ValueType::boolean:
+      return std::to_string((bool)bool_value());
+    case ValueType::string:
+      return string_value();
+    case ValueType::function:
+      return "#<Function(" + function_value().name + ")>;";
+    }
+    assert(false);
+    return "";
   }
 
   operator bool() const {
-    struct BoolVisitor {
-      bool operator()(std::monostate v) const { return false; }
-      bool operator()(int v) const { return v != 0; }
-      bool operator()(double v) const { return v != 0.0; }
-      bool operator()(bool v) const { return v; }
-      bool operator()(const std::string &v) const { return v.size() > 0; }
-      bool operator()(const Function &v) const { return true; }
-    };
-    return std::visit(BoolVisitor{}, value);
+    if (is_int()) {
+      return int_value() != 0;
+    } else if (is_double()) {
+      return as_double() != 0.0;
+    } else if (is_obj()) {
+      if (type() == ValueType::string) {
+        return string_value().size() > 0;
+      }
+      return true;
+    } else {
+      return bits == TRUE_BITS;
+    }
   }
 
   Value &operator+=(const Value &rhs) {
-    if (type() == ValueType::int_ && rhs.type() == ValueType::int_) {
-      *this = Value{.value = int_value() + rhs.int_value()};
+    if (is_int() && rhs.is_int()) {
+      *this = of(int_value() + rhs.int_value());
     } else if (is_numeric() && rhs.is_numeric()) {
-      *this = Value{.value = double_value() + rhs.double_value()};
+      *this = of(double_value() + rhs.double_value());
     } else if (type() == ValueType::string && rhs.type() == ValueType::string) {
-      *this = Value{.value = string_value() + rhs.string_value()};
+      *this = of(string_value() + rhs.string_value());
     } else {
       invalid_operands_error(rhs, "+");
     }
@@ -138,10 +253,10 @@ struct Value {
   }
 
   Value &operator-=(const Value &rhs) {
-    if (type() == ValueType::int_ && rhs.type() == ValueType::int_) {
-      *this = Value{.value = int_value() - rhs.int_value()};
+    if (is_int() && rhs.is_int()) {
+      *this = of(int_value() - rhs.int_value());
     } else if (is_numeric() && rhs.is_numeric()) {
-      *this = Value{.value = double_value() - rhs.double_value()};
+      *this = of(double_value() - rhs.double_value());
     } else {
       invalid_operands_error(rhs, "-");
     }
@@ -154,10 +269,10 @@ struct Value {
   }
 
   Value &operator*=(const Value &rhs) {
-    if (type() == ValueType::int_ && rhs.type() == ValueType::int_) {
-      *this = Value{.value = int_value() * rhs.int_value()};
+    if (is_int() && rhs.is_int()) {
+      *this = of(int_value() * rhs.int_value());
     } else if (is_numeric() && rhs.is_numeric()) {
-      *this = Value{.value = double_value() * rhs.double_value()};
+      *this = of(double_value() * rhs.double_value());
     } else {
       invalid_operands_error(rhs, "*");
     }
@@ -170,10 +285,10 @@ struct Value {
   }
 
   Value &operator/=(const Value &rhs) {
-    if (type() == ValueType::int_ && rhs.type() == ValueType::int_) {
-      *this = Value{.value = int_value() / rhs.int_value()};
+    if (is_int() && rhs.is_int()) {
+      *this = of(int_value() / rhs.int_value());
     } else if (is_numeric() && rhs.is_numeric()) {
-      *this = Value{.value = double_value() / rhs.double_value()};
+      *this = of(double_value() / rhs.double_value());
     } else {
       invalid_operands_error(rhs, "/");
     }
@@ -186,11 +301,76 @@ struct Value {
   }
 
 private:
+  // generates code that works on the boxed representation directly
+  friend class CodeEmitter;
+
+  static constexpr uint64_t SIGN_BIT = 0x8000'0000'0000'0000;
+  static constexpr uint64_t QNAN = 0x7ffc'0000'0000'0000;
+  static constexpr uint64_t TAG_BITS = 0x0003'0000'0000'0000;
+  static constexpr uint64_t PTR_MASK = 0x0000'ffff'ffff'ffff;
+
+  static constexpr uint64_t INT_TAG = QNAN | 0x0001'0000'0000'0000;
+  static constexpr uint64_t INT_MASK = SIGN_BIT | QNAN | TAG_BITS;
+  static constexpr uint64_t OBJ_TAG = SIGN_BIT | QNAN;
+
+  static constexpr uint64_t NULL_BITS = QNAN | 1;
+  static constexpr uint64_t FALSE_BITS = QNAN | 2;
+  static constexpr uint64_t TRUE_BITS = QNAN | 3;
+
+  static Value from_bits(uint64_t bits) {
+    Value v;
+    v.bits = bits;
+    return v;
+  }
+
+  static Value from_obj(Obj *obj) {
+    obj->refcount++;
+    return from_bits(OBJ_TAG | (uint64_t)(uintptr_t)obj);
+  }
+
+  bool is_obj() const { return (bits & INT_MASK) == OBJ_TAG; }
+
+  Obj *as_obj() const { return (Obj *)(uintptr_t)(bits & PTR_MASK); }
+
+  double as_double() const {
+    double v;
+    std::memcpy(&v, &bits, sizeof(v));
+    return v;
+  }
+
+  [[gnu::always_inline]] void retain() const {
+    if (is_obj()) {
+      as_obj()->refcount++;
+    }
+  }
+
+  [[gnu::always_inline]] void release() {
+    if (is_obj() && --as_obj()->refcount == 0) {
+      destroy(as_obj());
+    }
+  }
+
+  /// Kept out of line so `release` stays small enough to inline everywhere
+  [[gnu::noinline]] static void destroy(Obj *obj) {
+    switch (obj->type) {
+    case ValueType::string:
+      delete static_cast<ObjString *>(obj);
+      break;
+    case ValueType::function:
+      delete static_cast<ObjFunction *>(obj);
+      break;
+    default:
+      assert(false);
+    }
+  }
+
   [[noreturn]] void invalid_operands_error(const Value &rhs, const char *op) {
     std::cerr << "invalid operands to " << op << ": " << ::to_string(type())
               << " and " << ::to_string(rhs.type());
     exit(EXIT_FAILURE);
   }
+
+  uint64_t bits = NULL_BITS;
 };
 
 inline std::ostream &operator<<(std::ostream &os, Value const &value) {
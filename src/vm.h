@@ -2,210 +2,1553 @@
 
 #include "compiler.h"
 #include "disassembler.h"
+#include "frame.h"
+#include "jit.h"
+#include "native_stack.h"
+#include "runtime_checks.h"
+#include "trace.h"
+#include <cassert>
+#include <chrono>
+#include <cstdio>
 #include <iostream>
 #include <optional>
 
 #define DISASSEMBLE 0
 #define TRACE 0
 
-struct Frame {
-  Function function;
-  int *ip;
-  Value *fp; // correct name?
+// Use computed-goto (direct-threaded) dispatch in `VM::run` where the compiler
+// supports it, otherwise fall back to a `switch`
+#ifndef THREADED_DISPATCH
+#if defined(__GNUC__) || defined(__clang__)
+#define THREADED_DISPATCH 1
+#else
+#define THREADED_DISPATCH 0
+#endif
+#endif
+
+enum class JitMode { off, on, always, trace };
+
+/// Parses the value of a `--jit=` option
+inline std::optional<JitMode> parse_jit_mode(const std::string &s) {
+  if (s == "off") {
+    return JitMode::off;
+  } else if (s == "on") {
+    return JitMode::on;
+  } else if (s == "always") {
+    return JitMode::always;
+  } else if (s == "trace") {
+    return JitMode::trace;
+  }
+  return std::nullopt;
+}
+
+/// Which VM runs programs
+enum class Engine { stack, register_, closure };
+
+/// Parses the value of an `--engine=` option
+inline std::optional<Engine> parse_engine(const std::string &s) {
+  if (s == "stack") {
+    return Engine::stack;
+  } else if (s == "register") {
+    return Engine::register_;
+  } else if (s == "closure") {
+    return Engine::closure;
+  }
+  return std::nullopt;
+}
+
+struct VMOptions {
+  /// Calls nested deeper than this fail with a "stack overflow" error
+  int max_call_depth = 64 * 1024;
+  /// Number of value stack slots to start with.  The stack grows as needed.
+  int initial_stack_size = 256;
+  /// Whether to compile functions to machine code: never, once they've been
+  /// called `jit_threshold` times, or before they first run.  Or, with
+  /// `trace`, to record and compile traces through functions called from a
+  /// call site that has run `jit_threshold` times, extending them from side
+  /// exits taken as often.
+  JitMode jit = JitMode::off;
+  int jit_threshold = 1000;
+  /// Whether functions start out as plain bytecode, having superinstructions
+  /// fused in once they've been called `tier_threshold` times.  Otherwise
+  /// they're fused up front, as they always are when tracing (trace exits
+  /// point into the code, so it can't change under them).
+  bool tiered = true;
+  int tier_threshold = 100;
 };
 
-class VM {
+/// A function moving up a tier, for `--tier-stats`
+struct Promotion {
+  std::string function;
+  Tier tier;
+  /// Calls to the function so far
+  int calls;
+  /// Time since the VM started
+  double ms;
+};
+
+/// What the stack VM and the register VM have in common: the value stack,
+/// the preallocated call stack, globals, and the errors calls and globals
+/// fail with
+class VMBase {
+protected:
+  VMBase(VMOptions options)
+      : options(options), stack(new Value[options.initial_stack_size]),
+        stack_end(stack + options.initial_stack_size),
+        frames(new Frame[options.max_call_depth]),
+        frames_end(frames.get() + options.max_call_depth) {}
+  ~VMBase() { delete[] stack; }
+
+  VMBase(const VMBase &) = delete;
+  VMBase &operator=(const VMBase &) = delete;
+
+  [[noreturn]] void global_error(const Global &global, const char *message) {
+    int index = &global - globals.data();
+    ::global_error(global_table->name(index), message);
+  }
+
+  [[noreturn]] void call_depth_error() {
+    ::call_depth_error(options.max_call_depth);
+  }
+
+  /// Reallocates the value stack with room for at least `needed` slots,
+  /// rebasing the frame pointers of the frames below `frames_top`
+  void grow_stack(Frame *frames_top, size_t needed) {
+    size_t size = stack_end - stack;
+    while (size < needed) {
+      size *= 2;
+    }
+
+    Value *new_stack = new Value[size];
+    std::move(stack, stack_end, new_stack);
+    for (Frame *f = frames.get(); f < frames_top; f++) {
+      f->fp = new_stack + (f->fp - stack);
+    }
+
+    delete[] stack;
+    stack = new_stack;
+    stack_end = new_stack + size;
+  }
+
+  VMOptions options;
+
+  Value *stack;
+  Value *stack_end;
+
+  /// Preallocated call stack, so calls never allocate
+  std::unique_ptr<Frame[]> frames;
+  Frame *frames_end;
+
+  /// Shared with functions whose bodies are left to compile
+  std::shared_ptr<GlobalTable> global_table = std::make_shared<GlobalTable>();
+  std::vector<Global> globals;
+};
+
+class VM : VMBase {
 public:
-  VM() : stack(new Value[1024]), sp(stack) {}
-  ~VM() { delete[] stack; }
+  VM(VMOptions options = {})
+      : VMBase(options), start_time(std::chrono::steady_clock::now()) {}
+
+  Value eval(std::string_view source) { return eval(Source::copy(source)); }
 
-  Value eval(const std::string &source) {
-    sp = stack;
+  /// Runs `source`, which is kept alive while any of its functions are left
+  /// to compile
+  Value eval(Source source) {
+    Function function = Compiler::compile(
+        source, global_table, {.superinstructions = !tiered(), .lazy = true});
+    link();
 
-    Compiler compiler;
-    Function function = compiler.compile(source);
-    enter_function(function);
+    if (stack_end - stack < 1 + function.chunk->max_stack) {
+      grow_stack(frames.get(), 1 + function.chunk->max_stack);
+    }
+
+    // the script sits at the bottom of the stack, like any called function
+    stack[0] = Value::of(function);
+    enter_function(frames.get(), stack);
 
 #if DISASSEMBLE
     Disassembler d;
     std::cerr << d.disassemble(function) << std::endl;
 #endif
 
+    native_stack.start(NativeStack::DEFAULT_SIZE);
+    invoke(frames.get());
+    Value result = std::move(stack[0]);
+    return result;
+  }
+
+  /// Functions promoted so far, in order
+  const std::vector<Promotion> &promotions() const { return promotion_log; }
+
+  /// Prints which functions were promoted, and when
+  void print_tier_stats(std::ostream &out) const {
+    out << "tier promotions:" << std::endl;
+    if (promotion_log.empty()) {
+      out << "  (none)" << std::endl;
+    }
+
+    for (const Promotion &p : promotion_log) {
+      char line[128];
+      std::snprintf(line, sizeof(line),
+                    "  %-20s -> %-17s after %7d calls, at %9.3f ms",
+                    p.function.c_str(), to_string(p.tier).c_str(), p.calls,
+                    p.ms);
+      out << line << std::endl;
+    }
+  }
+
+private:
+  bool tiered() const {
+    return options.tiered && options.jit != JitMode::trace;
+  }
+
+  /// Allocates storage for any global slots the compiler has handed out since
+  /// the last link, so code can index `globals` without bounds checks
+  void link() { globals.resize(global_table->size()); }
+
+  void enter_function(Frame *frame, Value *fp) {
+    const Function &function = fp->function_value();
+    frame->function = &function;
+    frame->ip = function.chunk->code.data();
+    frame->fp = fp;
+  }
+
+  /// As `::check_call`, compiling the function's body if it hasn't been yet
+  const Function &check_call(const Value &callee, int arg_count) {
+    const Function &f = ::check_call(callee, arg_count);
+    ensure_compiled(f);
+    return f;
+  }
+
+  /// Compiles the body of `f` if it was left until its first call
+  void ensure_compiled(const Function &f) {
+    if (f.chunk->lazy) {
+      Compiler::compile_body(*f.chunk);
+      // the body may use globals nothing compiled so far has
+      link();
+    }
+  }
+
+  /// Calls the function at `callee` from `frame`, leaving the result in its
+  /// place.  This is how JIT compiled code makes calls.
+  void call(Frame *frame, Value *callee, int arg_count) {
+    const Function &f = check_call(*callee, arg_count);
+
+    Value *sp = callee + arg_count + 1;
+    if (stack_end - sp < f.chunk->max_stack) {
+      size_t callee_offset = callee - stack;
+      grow_stack(frame + 1, (sp - stack) + f.chunk->max_stack);
+      callee = stack + callee_offset;
+    }
+
+    if (++frame == frames_end) {
+      call_depth_error();
+    }
+    enter_function(frame, callee);
+    invoke(frame);
+  }
+
+  /// Runs the function just entered in `frame` until it returns, leaving the
+  /// result in place of the function at `frame->fp`
+  void invoke(Frame *frame) {
+    if (!run_compiled(frame)) {
+      run(frame);
+    }
+  }
+
+  /// Runs the function just entered in `frame` as machine code, if it's been
+  /// compiled or is hot enough to compile now.  `hot_site` is whether it was
+  /// called from a call site hot enough to trace from.  Returns false if it
+  /// still needs interpreting.
+  bool run_compiled(Frame *frame, bool hot_site = false) {
+    if (native_stack.exhausted()) {
+      // calls between compiled functions recurse on the native stack, so
+      // deeper calls are interpreted, which they can be to any depth
+      return false;
+    } else if (options.jit == JitMode::off &&
+        frame->function->chunk->tier != Tier::bytecode) {
+      // nothing left to promote it to
+      return false;
+    } else if (options.jit == JitMode::trace) {
+      return run_trace(frame, hot_site);
+    } else if (NativeCode *native = tier_up(frame)) {
+      call_native(frame, native);
+      return true;
+    }
+    return false;
+  }
+
+  /// Counts a call to the function entered in `frame`, promoting it to the
+  /// next tier if it's now hot enough.  Returns its machine code, if it has
+  /// some.
+  NativeCode *tier_up(Frame *frame) {
+    Chunk &chunk = *frame->function->chunk;
+    bool jit = (options.jit == JitMode::on || options.jit == JitMode::always) &&
+               !chunk.jit_failed;
+    if (chunk.native) {
+      return chunk.native.get();
+    } else if (!jit && chunk.tier != Tier::bytecode) {
+      // already as fast as it'll get
+      return nullptr;
+    }
+
+    int calls = ++chunk.call_count;
+    if (chunk.tier == Tier::bytecode && calls >= options.tier_threshold &&
+        options.jit != JitMode::always) {
+      fuse_hot_chunk(chunk);
+      frame->ip = chunk.code.data();
+      promoted(*frame->function, Tier::superinstructions);
+    }
+
+    if (!jit ||
+        (options.jit == JitMode::on && calls < options.jit_threshold)) {
+      return nullptr;
+    }
+
+    chunk.native = JitCompiler(jit_helpers()).compile(*frame->function);
+    chunk.jit_failed = !chunk.native;
+    if (chunk.native) {
+      chunk.tier = Tier::native;
+      promoted(*frame->function, Tier::native);
+    }
+    return chunk.native.get();
+  }
+
+  /// Fuses superinstructions into `chunk`.  Frames already running the old
+  /// code carry on in it, so it's kept around.
+  void fuse_hot_chunk(Chunk &chunk) {
+    std::vector<int> code = chunk.code;
+    for (size_t offset = 0; offset < code.size();) {
+      // superinstructions are matched against the generic ops
+      Op op = unquickened((Op)code[offset]);
+      code[offset] = op;
+      offset += 1 + op_n_args(op);
+    }
+
+    chunk.unfused_code = std::move(chunk.code);
+    chunk.code = std::move(code);
+    fuse_superinstructions(chunk);
+    chunk.tier = Tier::superinstructions;
+  }
+
+  void promoted(const Function &function, Tier tier) {
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start_time;
+    promotion_log.push_back({.function = function.name,
+                           .tier = tier,
+                           .calls = function.chunk->call_count,
+                           .ms = elapsed.count()});
+  }
+
+  void call_native(Frame *frame, NativeCode *native) {
     while (true) {
-      if (auto res = step()) {
-        return *res;
+      if (Value *result = native->entry(this, frame)) {
+        // the result may be the last reference to the function being run, so
+        // this can only happen once its code has returned
+        *frame->fp = std::move(*result);
+        return;
+      }
+
+      enter_pending_tail_call(frame);
+
+      native = tier_up(frame);
+      if (!native) {
+        run(frame);
+        return;
       }
     }
   }
 
-private:
-  void enter_function(const Function &function) {
-    enter_function(function, sp);
-  }
-
-  void enter_function(const Function &function, Value *fp) {
-    frames.push_back(Frame{
-        .function = function, .ip = function.chunk->code.data(), .fp = fp});
-  }
-
-  std::optional<Value> step() {
-    std::optional<Value> result = std::nullopt;
-
-    switch ((Op)*current_frame().ip++) {
-    case Op::load_const:
-      push(current_chunk().constants.at(read_arg()));
-      trace("load_const  ");
-      break;
-    case Op::define_global: {
-      std::string name =
-          current_chunk().constants.at(read_arg()).string_value();
-      auto it = globals.find(name);
-      if (it != globals.end()) {
-        std::cerr << "global '" << name << "' already defined" << std::endl;
-        exit(EXIT_FAILURE);
-      }
-      globals[name] = pop();
-      trace("define_global  ");
-      break;
-    }
-    case Op::get_global: {
-      std::string name =
-          current_chunk().constants.at(read_arg()).string_value();
-      auto it = globals.find(name);
-      if (it == globals.end()) {
-        std::cerr << "global '" << name << "' not defined" << std::endl;
-        exit(EXIT_FAILURE);
-      }
-      push(it->second);
-      trace("get_global  ");
-      break;
-    }
-    case Op::set_global: {
-      std::string name =
-          current_chunk().constants.at(read_arg()).string_value();
-      auto it = globals.find(name);
-      if (it == globals.end()) {
-        std::cerr << "global '" << name << "' not defined" << std::endl;
-        exit(EXIT_FAILURE);
-      }
-      it->second = pop();
-      trace("set_global  ");
-      break;
-    }
-    case Op::get_local:
+  /// Makes the tail call native code returned to make, see
+  /// `JitHelpers::tail_call`
+  void enter_pending_tail_call(Frame *frame) {
+    Value *fp = frame->fp;
+    Value *callee = stack + pending_tail_call.callee_offset;
+    for (int i = 0; i <= pending_tail_call.arg_count; i++) {
+      fp[i] = std::move(callee[i]);
+    }
+
+    const Function &f = fp->function_value();
+    Value *sp = fp + pending_tail_call.arg_count + 1;
+    if (stack_end - sp < f.chunk->max_stack) {
+      grow_stack(frame + 1, (sp - stack) + f.chunk->max_stack);
+    }
+    enter_function(frame, frame->fp);
+  }
+
+  bool run_trace(Frame *frame, bool hot_site) {
+#if JIT_SUPPORTED
+    Chunk &chunk = *frame->function->chunk;
+    if (chunk.trace) {
+      // without code, recording failed or is still in progress further up
+      // the stack
+      if (!chunk.trace->native) {
+        return false;
+      }
+      call_trace(frame);
+      return true;
+    } else if (!hot_site) {
+      return false;
+    }
+
+    auto tree = std::make_shared<TraceTree>();
+    chunk.trace = tree;
+    tree->recording = true;
+    Value *sp = frame->fp + 1 + frame->function->arity;
+    bool tail_called = record_trace(*tree, -1, frame, frame, sp);
+    tree->recording = false;
+
+    if (tail_called) {
+      invoke(frame);
+    }
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  /// Counts a run of the call op at `site` in the code of the function
+  /// running in `frame`, when tracing.  Returns whether the site is now hot
+  /// enough to trace the function it calls.  Counted before the call, which
+  /// may be a tail call that frees the caller's chunk.
+  bool count_call_site(Frame *frame, const int *site) {
+    if (options.jit != JitMode::trace) {
+      return false;
+    }
+
+    Chunk &chunk = *frame->function->chunk;
+    size_t offset = site - chunk.code.data();
+    // superinstructions are fused up front when tracing, so the code never
+    // changes under a running frame
+    assert(offset < chunk.code.size());
+    if (chunk.call_site_counts.empty()) {
+      chunk.call_site_counts.resize(chunk.code.size());
+    }
+    return ++chunk.call_site_counts[offset] >= options.jit_threshold;
+  }
+
+  /// Runs the trace tree of the function entered in `frame`
+  void call_trace(Frame *frame) {
+    while (true) {
+      // hold on to the code, in case a call from it records a new path and
+      // replaces it
+      std::shared_ptr<TraceTree> tree = frame->function->chunk->trace;
+      std::shared_ptr<NativeCode> native = tree->native;
+
+      if (stack_end - frame->fp <= tree->max_slot) {
+        grow_stack(frame + 1, (frame->fp - stack) + tree->max_slot + 1);
+      }
+
+      if (Value *result = native->entry(this, frame)) {
+        *frame->fp = std::move(*result);
+        return;
+      }
+
+      int exit_index = pending_exit;
+      pending_exit = -1;
+
+      if (exit_index < 0) {
+        enter_pending_tail_call(frame);
+        const TraceTree *next = frame->function->chunk->trace.get();
+        if (!next || !next->native) {
+          invoke(frame);
+          return;
+        }
+        continue;
+      }
+
+      // side exit, with frames for the calls inlined at that point already
+      // materialized by `JitHelpers::exit`
+      const TraceExit &exit = tree->exits[exit_index];
+      Frame *top = frame + exit.frames.size() - 1;
+      Value *sp = frame->fp + exit.sp;
+
+      if (exit.path == -1 && exit.count >= options.jit_threshold &&
+          !tree->recording && tree->paths.size() < MAX_TRACE_PATHS) {
+        tree->recording = true;
+        bool tail_called = record_trace(*tree, exit_index, frame, top, sp);
+        tree->recording = false;
+
+        if (tail_called) {
+          continue;
+        }
+        return;
+      }
+
+      run(frame, top, sp);
+      return;
+    }
+  }
+
+  static constexpr size_t MAX_TRACE_PATHS = 32;
+  static constexpr size_t MAX_TRACE_OPS = 1000;
+  static constexpr int MAX_INLINE_DEPTH = 4;
+
+  /// Interprets the function entered in `root` from `frame` and `sp` until it
+  /// returns, recording the path taken as a new path in `tree`, continuing
+  /// from side exit `from_exit` (or from the function's entry if -1).
+  ///
+  /// Calls to other functions are inlined into the path, except when too
+  /// deep or recursive.  Returns true if the function ended in a tail call to
+  /// itself, in which case that call still needs running.
+  bool record_trace(TraceTree &tree, int from_exit, Frame *root, Frame *frame,
+                    Value *sp_ptr) {
+    TracePath path;
+    size_t first_exit = tree.exits.size();
+    size_t first_inlined = tree.inlined.size();
+
+    int *ip = frame->ip;
+    // slots are relative to `root->fp`, which stays correct as the stack grows
+    int sp = sp_ptr - root->fp;
+    auto slot = [&](int n) -> Value & { return root->fp[n]; };
+    auto fp_slot = [&](const Frame *f) { return (int)(f->fp - root->fp); };
+
+    auto make_exit = [&](int *resume_ip, int resume_sp) {
+      TraceExit exit{.sp = resume_sp};
+      for (Frame *f = root; f <= frame; f++) {
+        exit.frames.push_back({fp_slot(f), f == frame ? resume_ip : f->ip});
+      }
+      tree.exits.push_back(exit);
+      return (int)tree.exits.size() - 1;
+    };
+
+    enum { running, returned, tail_called, aborted } state = running;
+    while (state == running) {
+      if (path.ops.size() >= MAX_TRACE_OPS) {
+        state = aborted;
+        break;
+      }
+
+      int *start = ip;
+      int start_sp = sp;
+      Op op = (Op)*ip;
+      int *next = ip + 1 + op_n_args(op);
+      const int *args = ip + 1;
+      ip = next;
+
+      const Superinstruction *fused = superinstruction(op);
+      size_t n_components = fused ? fused->sequence.size() : 1;
+      for (size_t i = 0; i < n_components && state == running; i++) {
+        Op component = fused ? fused->sequence[i] : op;
+        int arg = op_n_args(component) ? *args++ : 0;
+        const Chunk &chunk = *frame->function->chunk;
+
+        switch (unquickened(component)) {
+        case Op::load_const: {
+          const Value &constant = chunk.constants[arg];
+          path.ops.push_back(
+              {.kind = TraceOp::load_const, .a = sp, .value = &constant});
+          slot(sp++) = constant;
+          break;
+        }
+        case Op::get_local: {
+          int local = fp_slot(frame) + arg + 1;
+          path.ops.push_back({.kind = TraceOp::copy, .a = local, .b = sp});
+          slot(sp) = slot(local);
+          sp++;
+          break;
+        }
+        case Op::set_local: {
+          int local = fp_slot(frame) + arg + 1;
+          sp--;
+          path.ops.push_back({.kind = TraceOp::copy, .a = sp, .b = local});
+          slot(local) = slot(sp);
+          break;
+        }
+        case Op::define_global:
+          sp--;
+          path.ops.push_back(
+              {.kind = TraceOp::define_global, .a = sp, .b = arg});
+          jit_helpers().define_global(this, &slot(sp), arg);
+          break;
+        case Op::get_global:
+          path.ops.push_back({.kind = TraceOp::get_global, .a = sp, .b = arg});
+          jit_helpers().get_global(this, &slot(sp), arg);
+          sp++;
+          break;
+        case Op::set_global:
+          sp--;
+          path.ops.push_back({.kind = TraceOp::set_global, .a = sp, .b = arg});
+          jit_helpers().set_global(this, &slot(sp), arg);
+          break;
+        case Op::add:
+        case Op::subtract:
+        case Op::multiply:
+        case Op::divide: {
+          Op base = unquickened(component);
+          sp--;
+          const Value &lhs = slot(sp - 1), &rhs = slot(sp);
+
+          // specialize on the types seen, leaving the trace if they change
+          TraceOp traced = {.kind = TraceOp::arith_generic, .op = base,
+                            .a = sp - 1};
+          if (lhs.is_int() && rhs.is_int()) {
+            traced.kind = TraceOp::arith_int;
+          } else if (lhs.is_double() && rhs.is_double()) {
+            traced.kind = TraceOp::arith_double;
+          }
+          if (traced.kind != TraceOp::arith_generic) {
+            traced.exit = make_exit(start, start_sp);
+          }
+          path.ops.push_back(traced);
+
+          if (base == Op::add) {
+            slot(sp - 1) += slot(sp);
+          } else if (base == Op::subtract) {
+            slot(sp - 1) -= slot(sp);
+          } else if (base == Op::multiply) {
+            slot(sp - 1) *= slot(sp);
+          } else {
+            slot(sp - 1) /= slot(sp);
+          }
+          break;
+        }
+        case Op::pop:
+          sp--;
+          break;
+        case Op::jump:
+          ip = next + arg;
+          break;
+        case Op::jump_if_zero: {
+          sp--;
+          bool truthy = (bool)slot(sp);
+          int *taken = next + arg;
+          int exit = make_exit(truthy ? taken : next, sp);
+          path.ops.push_back({.kind = TraceOp::guard_truthy,
+                              .a = sp,
+                              .expected = truthy,
+                              .exit = exit});
+          ip = truthy ? next : taken;
+          break;
+        }
+        case Op::call: {
+          int callee = sp - arg - 1;
+          const Value &f = slot(callee);
+          frame->ip = next;
+
+          bool inline_call =
+              f.type() == ValueType::function &&
+              f.function_value().arity == arg &&
+              f.function_value().chunk != root->function->chunk &&
+              frame - root < MAX_INLINE_DEPTH && frame + 1 < frames_end;
+          if (!inline_call) {
+            path.ops.push_back({.kind = TraceOp::call, .a = callee, .b = arg});
+            call(frame, &slot(callee), arg);
+            sp = callee + 1;
+            break;
+          }
+
+          const Function &function = f.function_value();
+          ensure_compiled(function);
+          if (stack_end - &slot(sp) < function.chunk->max_stack) {
+            grow_stack(frame + 1, (&slot(sp) - stack) +
+                                      function.chunk->max_stack);
+          }
+
+          tree.inlined.push_back(f);
+          int exit = make_exit(start, start_sp);
+          path.ops.push_back({.kind = TraceOp::guard_callee,
+                              .a = callee,
+                              .value = &tree.inlined.back(),
+                              .exit = exit});
+
+          frame++;
+          enter_function(frame, &slot(callee));
+          ip = frame->ip;
+          tree.max_slot = std::max(tree.max_slot,
+                                   sp + function.chunk->max_stack);
+          break;
+        }
+        case Op::return_: {
+          sp--;
+          if (frame == root) {
+            path.ops.push_back({.kind = TraceOp::return_, .a = sp});
+            *root->fp = std::move(slot(sp));
+            state = returned;
+            break;
+          }
+
+          int result = fp_slot(frame);
+          path.ops.push_back(
+              {.kind = TraceOp::return_inline, .a = sp, .b = result});
+          slot(result) = std::move(slot(sp));
+          sp = result + 1;
+          frame--;
+          ip = frame->ip;
+          break;
+        }
+        case Op::tail_call: {
+          int callee = sp - arg - 1;
+          const Value &f = slot(callee);
+          if (frame != root || f.type() != ValueType::function ||
+              f.function_value().chunk != root->function->chunk ||
+              f.function_value().arity != arg) {
+            state = aborted;
+            break;
+          }
+
+          path.ops.push_back(
+              {.kind = TraceOp::tail_call, .a = callee, .b = arg});
+          for (int i = 0; i <= arg; i++) {
+            slot(i) = std::move(slot(callee + i));
+          }
+          enter_function(root, root->fp);
+          state = tail_called;
+          break;
+        }
+        default:
+          assert(false);
+        }
+      }
+
+      if (state == aborted) {
+        // nothing of the op has run yet, so the interpreter can take over
+        ip = start;
+        sp = start_sp;
+      }
+      tree.max_slot = std::max(tree.max_slot, sp);
+    }
+
+    if (state == aborted) {
+      tree.exits.resize(first_exit);
+      tree.inlined.resize(first_inlined);
+      if (from_exit >= 0) {
+        tree.exits[from_exit].path = -2;
+      }
+
+      frame->ip = ip;
+      run(root, frame, &slot(sp));
+      return false;
+    }
+
+    tree.paths.push_back(std::move(path));
+    if (from_exit >= 0) {
+      tree.exits[from_exit].path = tree.paths.size() - 1;
+    }
+    tree.native = TraceCompiler(jit_helpers()).compile(tree);
+
+    return state == tail_called;
+  }
+
+  static const JitHelpers &jit_helpers() {
+    static const JitHelpers helpers = {
+        .copy = [](Value *dst, const Value *src) { *dst = *src; },
+        .add = [](Value *lhs) { lhs[0] += lhs[1]; },
+        .subtract = [](Value *lhs) { lhs[0] -= lhs[1]; },
+        .multiply = [](Value *lhs) { lhs[0] *= lhs[1]; },
+        .divide = [](Value *lhs) { lhs[0] /= lhs[1]; },
+        .truthy = [](const Value *v) -> int { return (bool)*v; },
+        .define_global =
+            [](VM *vm, Value *v, int index) {
+              Global &global = vm->globals[index];
+              if (global.defined) {
+                vm->global_error(global, "already defined");
+              }
+              global.value = *v;
+              global.defined = true;
+            },
+        .get_global =
+            [](VM *vm, Value *v, int index) {
+              Global &global = vm->globals[index];
+              if (!global.defined) {
+                vm->global_error(global, "not defined");
+              }
+              *v = global.value;
+            },
+        .set_global =
+            [](VM *vm, Value *v, int index) {
+              Global &global = vm->globals[index];
+              if (!global.defined) {
+                vm->global_error(global, "not defined");
+              }
+              global.value = *v;
+            },
+        .call = [](VM *vm, Frame *frame, Value *callee,
+                   int arg_count) { vm->call(frame, callee, arg_count); },
+        .tail_call =
+            [](VM *vm, Frame *frame, Value *callee, int arg_count) -> int {
+              const Function &f = vm->check_call(*callee, arg_count);
+              if (f.chunk != frame->function->chunk) {
+                vm->pending_tail_call = {(int)(callee - vm->stack), arg_count};
+                return 0;
+              }
+
+              // same code and arity, so it already has room on the stack
+              for (int i = 0; i <= arg_count; i++) {
+                frame->fp[i] = std::move(callee[i]);
+              }
+              vm->enter_function(frame, frame->fp);
+              return 1;
+            },
+        .exit =
+            [](VM *vm, Frame *frame, int exit_index) {
+              TraceTree &tree = *frame->function->chunk->trace;
+              TraceExit &exit = tree.exits[exit_index];
+              exit.count++;
+
+              frame->ip = exit.frames[0].ip;
+              for (size_t i = 1; i < exit.frames.size(); i++) {
+                Frame *f = frame + i;
+                if (f == vm->frames_end) {
+                  vm->call_depth_error();
+                }
+                vm->enter_function(f, frame->fp + exit.frames[i].fp);
+                f->ip = exit.frames[i].ip;
+              }
+
+              vm->pending_exit = exit_index;
+            },
+    };
+    return helpers;
+  }
+
+  /// Interprets the function entered in `base` until it returns.  Re-entered
+  /// for calls made from JIT compiled code.
+  void run(Frame *base) {
+    run(base, base, base->fp + 1 + base->function->arity);
+  }
+
+  /// Interprets from `top`, which is `base` or a frame called from it, until
+  /// `base` returns.  Used to pick up where a trace left off.
+  void run(Frame *base, Frame *top, Value *top_sp) {
+    // Interpreter state is kept in locals so the compiler can hold it in
+    // registers.  It's only written back to the `Frame` on call/return.
+    Frame *frame = top;
+    int *ip = frame->ip;
+    Value *fp = frame->fp;
+    Value *sp = top_sp;
+    Global *globals = this->globals.data();
+    const Value *constants = frame->function->chunk->constants.data();
+    // Top of stack cache.  Handlers come in two variants: those reached by
+    // DISPATCH() have the whole stack in memory, those reached by
+    // DISPATCH_TOS() have its top value here, above `sp`.  Ops that push a
+    // value leave it here, so expressions don't round trip through memory.
+    Value tos;
+
+#define READ_OP() (*ip++)
+#define READ_ARG() (*ip++)
+#define PUSH(v) (*sp++ = (v))
+#define POP() (*--sp)
+// Pops a value nothing uses, releasing it rather than leaving it in its slot
+#define DROP() (*--sp = Value())
+#define SPILL() (*sp++ = std::move(tos))
+#define TRACE_OP(name) trace(name, frame, ip, sp)
+
+// Checked once per call using the callee's precomputed `max_stack`, so pushes
+// themselves never need a bounds check
+#define ENSURE_STACK(n)                                                        \
+  if (stack_end - sp < (n)) {                                                  \
+    size_t sp_offset = sp - stack;                                             \
+    grow_stack(frame + 1, sp_offset + (n));                                    \
+    sp = stack + sp_offset;                                                    \
+    fp = frame->fp;                                                            \
+  }
+
+#if THREADED_DISPATCH
+    // Order must match `Op`
+    static void *dispatch_table[] = {
+        &&op_load_const,
+        &&op_define_global,
+        &&op_get_global,
+        &&op_set_global,
+        &&op_get_local,
+        &&op_set_local,
+        &&op_add,
+        &&op_subtract,
+        &&op_multiply,
+        &&op_divide,
+        &&op_pop,
+        &&op_jump,
+        &&op_jump_if_zero,
+        &&op_call,
+        &&op_return_,
+        &&op_tail_call,
+        &&op_add_int_int,
+        &&op_add_double_double,
+        &&op_subtract_int_int,
+        &&op_subtract_double_double,
+        &&op_multiply_int_int,
+        &&op_multiply_double_double,
+        &&op_divide_int_int,
+        &&op_divide_double_double,
+        &&op_get_local_load_const_subtract,
+        &&op_get_local_get_local,
+        &&op_get_local_jump_if_zero,
+        &&op_load_const_return,
+        &&op_add_return,
+    };
+    static_assert(sizeof(dispatch_table) / sizeof(dispatch_table[0]) ==
+                  Op::OP_COUNT);
+
+    // Order must match `Op`
+    static void *tos_dispatch_table[] = {
+        &&tos_load_const,
+        &&tos_define_global,
+        &&tos_get_global,
+        &&tos_set_global,
+        &&tos_get_local,
+        &&tos_set_local,
+        &&tos_add,
+        &&tos_subtract,
+        &&tos_multiply,
+        &&tos_divide,
+        &&tos_pop,
+        &&tos_jump,
+        &&tos_jump_if_zero,
+        &&tos_call,
+        &&tos_return_,
+        &&tos_tail_call,
+        &&tos_add_int_int,
+        &&tos_add_double_double,
+        &&tos_subtract_int_int,
+        &&tos_subtract_double_double,
+        &&tos_multiply_int_int,
+        &&tos_multiply_double_double,
+        &&tos_divide_int_int,
+        &&tos_divide_double_double,
+        &&tos_get_local_load_const_subtract,
+        &&tos_get_local_get_local,
+        &&tos_get_local_jump_if_zero,
+        &&tos_load_const_return,
+        &&tos_add_return,
+    };
+    static_assert(sizeof(tos_dispatch_table) / sizeof(tos_dispatch_table[0]) ==
+                  Op::OP_COUNT);
+
+// Computed goto doesn't run destructors when leaving a scope, so handlers must
+// not hold non-trivially destructible locals (e.g. `Value`) across DISPATCH()
+#define TARGET(op) op_##op:
+#define TOS_TARGET(op) tos_##op:
+#define DISPATCH() goto *dispatch_table[READ_OP()]
+#define DISPATCH_TOS() goto *tos_dispatch_table[READ_OP()]
+
+    DISPATCH();
+#else
+    // Added to the op to pick its cached top of stack variant
+    int cached = 0;
+
+#define TARGET(op) case Op::op:
+#define TOS_TARGET(op) case Op::OP_COUNT + Op::op:
+#define DISPATCH()                                                             \
+  {                                                                            \
+    cached = 0;                                                                \
+    continue;                                                                  \
+  }
+#define DISPATCH_TOS()                                                         \
+  {                                                                            \
+    cached = Op::OP_COUNT;                                                     \
+    continue;                                                                  \
+  }
+
+    while (true) {
+      switch (READ_OP() + cached) {
+#endif
+
+    TARGET(load_const) {
+      tos = constants[READ_ARG()];
+      TRACE_OP("load_const  ");
+      DISPATCH_TOS();
+    }
+    TARGET(define_global) {
+      Global &global = globals[READ_ARG()];
+      if (global.defined) {
+        global_error(global, "already defined");
+      }
+      global.value = std::move(POP());
+      global.defined = true;
+      TRACE_OP("define_global  ");
+      DISPATCH();
+    }
+    TARGET(get_global) {
+      Global &global = globals[READ_ARG()];
+      if (!global.defined) {
+        global_error(global, "not defined");
+      }
+      tos = global.value;
+      TRACE_OP("get_global  ");
+      DISPATCH_TOS();
+    }
+    TARGET(set_global) {
+      Global &global = globals[READ_ARG()];
+      if (!global.defined) {
+        global_error(global, "not defined");
+      }
+      global.value = std::move(POP());
+      TRACE_OP("set_global  ");
+      DISPATCH();
+    }
+    TARGET(get_local) {
       // +1 because function is at fp
-      push(*(current_frame().fp + read_arg() + 1));
-      trace("get_local  ");
-      break;
-    case Op::set_local: {
+      tos = fp[READ_ARG() + 1];
+      TRACE_OP("get_local  ");
+      DISPATCH_TOS();
+    }
+    TARGET(set_local) {
       // +1 because function is at fp
-      *(current_frame().fp + read_arg() + 1) = pop();
-      trace("set_local  ");
-      break;
-    }
-    case Op::add: {
-      Value a = pop();
-      Value b = pop();
-      push(b + a);
-      trace("add   ");
-      break;
-    }
-    case Op::subtract: {
-      Value a = pop();
-      Value b = pop();
-      push(b - a);
-      trace("subtract   ");
-      break;
-    }
-    case Op::multiply: {
-      Value a = pop();
-      Value b = pop();
-      push(b * a);
-      trace("multiply   ");
-      break;
-    }
-    case Op::divide: {
-      Value a = pop();
-      Value b = pop();
-      push(b / a);
-      trace("divide   ");
-      break;
-    }
-    case Op::pop:
-      pop();
-      trace("pop   ");
-      break;
-    case Op::jump: {
-      int n = read_arg();
-      current_frame().ip += n;
-      trace("jump  ");
-      break;
-    }
-    case Op::jump_if_zero: {
-      int n = read_arg();
-      current_frame().ip += pop() ? 0 : n;
-      trace("jump_if_zero  ");
-      break;
-    }
-    case Op::call: {
-      int arg_count = read_arg();
-      Value v = *(sp - arg_count - 1);
-      if (v.type() != ValueType::function) {
-        std::cerr << "Cannot call non-function" << std::endl;
-        exit(EXIT_FAILURE);
-      }
-
-      Function f = v.function_value();
-      if (arg_count != f.arity) {
-        std::cerr << "Incorrect number of arguments to `" << f.name
-                  << "`, expected " << f.arity << " but got " << arg_count
-                  << std::endl;
-        exit(EXIT_FAILURE);
-      }
-
-      enter_function(f, sp - arg_count - 1);
-      trace("call     ");
-      break;
-    }
-    case Op::return_: {
-      Value r = pop();
-      sp = current_frame().fp;
-      frames.pop_back();
-      if (frames.size() == 0) {
-        result = r;
+      fp[READ_ARG() + 1] = std::move(POP());
+      TRACE_OP("set_local  ");
+      DISPATCH();
+    }
+    TARGET(add) {
+      if (sp[-2].is_int() && sp[-1].is_int()) {
+        ip[-1] = Op::add_int_int;
+      } else if (sp[-2].is_double() && sp[-1].is_double()) {
+        ip[-1] = Op::add_double_double;
+      }
+      sp[-2] += sp[-1];
+      DROP();
+      TRACE_OP("add   ");
+      DISPATCH();
+    }
+    TARGET(subtract) {
+      if (sp[-2].is_int() && sp[-1].is_int()) {
+        ip[-1] = Op::subtract_int_int;
+      } else if (sp[-2].is_double() && sp[-1].is_double()) {
+        ip[-1] = Op::subtract_double_double;
+      }
+      sp[-2] -= sp[-1];
+      DROP();
+      TRACE_OP("subtract   ");
+      DISPATCH();
+    }
+    TARGET(multiply) {
+      if (sp[-2].is_int() && sp[-1].is_int()) {
+        ip[-1] = Op::multiply_int_int;
+      } else if (sp[-2].is_double() && sp[-1].is_double()) {
+        ip[-1] = Op::multiply_double_double;
+      }
+      sp[-2] *= sp[-1];
+      DROP();
+      TRACE_OP("multiply   ");
+      DISPATCH();
+    }
+    TARGET(divide) {
+      if (sp[-2].is_int() && sp[-1].is_int()) {
+        ip[-1] = Op::divide_int_int;
+      } else if (sp[-2].is_double() && sp[-1].is_double()) {
+        ip[-1] = Op::divide_double_double;
+      }
+      sp[-2] /= sp[-1];
+      DROP();
+      TRACE_OP("divide   ");
+      DISPATCH();
+    }
+    TARGET(pop) {
+      DROP();
+      TRACE_OP("pop   ");
+      DISPATCH();
+    }
+    TARGET(jump) {
+      int n = READ_ARG();
+      ip += n;
+      TRACE_OP("jump  ");
+      DISPATCH();
+    }
+    TARGET(jump_if_zero) {
+      int n = READ_ARG();
+      ip += sp[-1] ? 0 : n;
+      DROP();
+      TRACE_OP("jump_if_zero  ");
+      DISPATCH();
+    }
+    TARGET(call) {
+    do_call:
+      int arg_count = READ_ARG();
+      const Function &f = check_call(*(sp - arg_count - 1), arg_count);
+      ENSURE_STACK(f.chunk->max_stack);
+      // compiling the callee (here, or from native code) can grow the globals
+      globals = this->globals.data();
+      bool hot_site = count_call_site(frame, ip - 2);
+
+      frame->ip = ip;
+      if (++frame == frames_end) {
+        call_depth_error();
+      }
+      enter_function(frame, sp - arg_count - 1);
+
+      if (run_compiled(frame, hot_site)) {
+        size_t result_offset = frame->fp - stack;
+
+        globals = this->globals.data();
+        frame--;
+        fp = frame->fp;
+        sp = stack + result_offset + 1;
+        TRACE_OP("call     ");
+        DISPATCH();
+      }
+
+      ip = frame->ip;
+      fp = frame->fp;
+      constants = frame->function->chunk->constants.data();
+
+      TRACE_OP("call     ");
+      DISPATCH();
+    }
+    TARGET(return_) {
+    do_return:
+      if (frame == base) {
+        *fp = std::move(sp[-1]);
+        trace("return     ", nullptr, ip, fp + 1);
+        return;
+      }
+
+      // result replaces the function being called
+      *fp = std::move(sp[-1]);
+      sp = fp + 1;
+
+      frame--;
+      ip = frame->ip;
+      fp = frame->fp;
+      constants = frame->function->chunk->constants.data();
+
+      TRACE_OP("return     ");
+      DISPATCH();
+    }
+
+    TARGET(tail_call) {
+    do_tail_call:
+      int arg_count = READ_ARG();
+      Value *callee = sp - arg_count - 1;
+      const Function &f = check_call(*callee, arg_count);
+      globals = this->globals.data();
+      bool hot_site = count_call_site(frame, ip - 2);
+
+      // slide the function & args down over the current frame
+      for (int i = 0; i <= arg_count; i++) {
+        fp[i] = std::move(callee[i]);
+      }
+      sp = fp + arg_count + 1;
+      ENSURE_STACK(f.chunk->max_stack);
+      enter_function(frame, fp);
+
+      if (run_compiled(frame, hot_site)) {
+        // the result ends up at `fp`, ready to return
+        globals = this->globals.data();
+        fp = frame->fp;
+        sp = fp + 1;
+        goto do_return;
+      }
+
+      ip = frame->ip;
+      constants = frame->function->chunk->constants.data();
+
+      TRACE_OP("tail_call     ");
+      DISPATCH();
+    }
+
+    TARGET(add_int_int) {
+      if (sp[-2].is_int() && sp[-1].is_int()) {
+        sp--;
+        sp[-1] = Value::of(sp[-1].int_value() + sp->int_value());
+      } else {
+        // operand types changed, fall back to the generic op
+        ip[-1] = Op::add;
+        sp[-2] += sp[-1];
+        DROP();
+      }
+      TRACE_OP("add_int_int   ");
+      DISPATCH();
+    }
+    TARGET(add_double_double) {
+      if (sp[-2].is_double() && sp[-1].is_double()) {
+        sp--;
+        sp[-1] = Value::of(sp[-1].double_value() + sp->double_value());
       } else {
-        push(r);
+        // operand types changed, fall back to the generic op
+        ip[-1] = Op::add;
+        sp[-2] += sp[-1];
+        DROP();
       }
-      trace("return     ");
-      break;
+      TRACE_OP("add_double_double   ");
+      DISPATCH();
     }
-    case Op::OP_COUNT:
-      assert(false);
+    TARGET(subtract_int_int) {
+      if (sp[-2].is_int() && sp[-1].is_int()) {
+        sp--;
+        sp[-1] = Value::of(sp[-1].int_value() - sp->int_value());
+      } else {
+        // operand types changed, fall back to the generic op
+        ip[-1] = Op::subtract;
+        sp[-2] -= sp[-1];
+        DROP();
+      }
+      TRACE_OP("subtract_int_int   ");
+      DISPATCH();
+    }
+    TARGET(subtract_double_double) {
+      if (sp[-2].is_double() && sp[-1].is_double()) {
+        sp--;
+        sp[-1] = Value::of(sp[-1].double_value() - sp->double_value());
+      } else {
+        // operand types changed, fall back to the generic op
+        ip[-1] = Op::subtract;
+        sp[-2] -= sp[-1];
+        DROP();
+      }
+      TRACE_OP("subtract_double_double   ");
+      DISPATCH();
+    }
+    TARGET(multiply_int_int) {
+      if (sp[-2].is_int() && sp[-1].is_int()) {
+        sp--;
+        sp[-1] = Value::of(sp[-1].int_value() * sp->int_value());
+      } else {
+        // operand types changed, fall back to the generic op
+        ip[-1] = Op::multiply;
+        sp[-2] *= sp[-1];
+        DROP();
+      }
+      TRACE_OP("multiply_int_int   ");
+      DISPATCH();
+    }
+    TARGET(multiply_double_double) {
+      if (sp[-2].is_double() && sp[-1].is_double()) {
+        sp--;
+        sp[-1] = Value::of(sp[-1].double_value() * sp->double_value());
+      } else {
+        // operand types changed, fall back to the generic op
+        ip[-1] = Op::multiply;
+        sp[-2] *= sp[-1];
+        DROP();
+      }
+      TRACE_OP("multiply_double_double   ");
+      DISPATCH();
+    }
+    TARGET(divide_int_int) {
+      if (sp[-2].is_int() && sp[-1].is_int()) {
+        sp--;
+        sp[-1] = Value::of(sp[-1].int_value() / sp->int_value());
+      } else {
+        // operand types changed, fall back to the generic op
+        ip[-1] = Op::divide;
+        sp[-2] /= sp[-1];
+        DROP();
+      }
+      TRACE_OP("divide_int_int   ");
+      DISPATCH();
+    }
+    TARGET(divide_double_double) {
+      if (sp[-2].is_double() && sp[-1].is_double()) {
+        sp--;
+        sp[-1] = Value::of(sp[-1].double_value() / sp->double_value());
+      } else {
+        // operand types changed, fall back to the generic op
+        ip[-1] = Op::divide;
+        sp[-2] /= sp[-1];
+        DROP();
+      }
+      TRACE_OP("divide_double_double   ");
+      DISPATCH();
     }
 
-    return result;
-  }
+    TARGET(get_local_load_const_subtract) {
+      const Value &a = fp[READ_ARG() + 1];
+      const Value &b = constants[READ_ARG()];
+      if (a.is_int() && b.is_int()) {
+        tos = Value::of(a.int_value() - b.int_value());
+      } else {
+        tos = a - b;
+      }
+      TRACE_OP("get_local_load_const_subtract  ");
+      DISPATCH_TOS();
+    }
+    TARGET(get_local_get_local) {
+      PUSH(fp[READ_ARG() + 1]);
+      tos = fp[READ_ARG() + 1];
+      TRACE_OP("get_local_get_local  ");
+      DISPATCH_TOS();
+    }
+    TARGET(get_local_jump_if_zero) {
+      const Value &v = fp[READ_ARG() + 1];
+      int n = READ_ARG();
+      ip += v ? 0 : n;
+      TRACE_OP("get_local_jump_if_zero  ");
+      DISPATCH();
+    }
+    TARGET(load_const_return) {
+      PUSH(constants[READ_ARG()]);
+      TRACE_OP("load_const_return  ");
+      goto do_return;
+    }
+    TARGET(add_return) {
+      if (sp[-2].is_int() && sp[-1].is_int()) {
+        sp--;
+        sp[-1] = Value::of(sp[-1].int_value() + sp->int_value());
+      } else {
+        sp[-2] += sp[-1];
+        DROP();
+      }
+      TRACE_OP("add_return  ");
+      goto do_return;
+    }
+
+
+    // Variants for when the top of the stack is in `tos`.  Like the handlers
+    // above, but with sp[-1] replaced by `tos`.
+
+    TOS_TARGET(load_const) {
+      SPILL();
+      tos = constants[READ_ARG()];
+      TRACE_OP("load_const  ");
+      DISPATCH_TOS();
+    }
+    TOS_TARGET(define_global) {
+      Global &global = globals[READ_ARG()];
+      if (global.defined) {
+        global_error(global, "already defined");
+      }
+      global.value = std::move(tos);
+      global.defined = true;
+      TRACE_OP("define_global  ");
+      DISPATCH();
+    }
+    TOS_TARGET(get_global) {
+      Global &global = globals[READ_ARG()];
+      if (!global.defined) {
+        global_error(global, "not defined");
+      }
+      SPILL();
+      tos = global.value;
+      TRACE_OP("get_global  ");
+      DISPATCH_TOS();
+    }
+    TOS_TARGET(set_global) {
+      Global &global = globals[READ_ARG()];
+      if (!global.defined) {
+        global_error(global, "not defined");
+      }
+      global.value = std::move(tos);
+      TRACE_OP("set_global  ");
+      DISPATCH();
+    }
+    TOS_TARGET(get_local) {
+      // spilled first, as the local may be the cached value
+      SPILL();
+      tos = fp[READ_ARG() + 1];
+      TRACE_OP("get_local  ");
+      DISPATCH_TOS();
+    }
+    TOS_TARGET(set_local) {
+      fp[READ_ARG() + 1] = std::move(tos);
+      TRACE_OP("set_local  ");
+      DISPATCH();
+    }
+
+// Generic arithmetic on sp[-1] and `tos` (through memory, so `tos` never has
+// its address taken and can live in a register), quickening to the operand
+// types
+#define TOS_GENERIC(op)                                                        \
+  *sp = std::move(tos);                                                        \
+  sp[-1] op##= *sp;                                                            \
+  *sp = Value();                                                               \
+  tos = std::move(sp[-1]);                                                     \
+  sp--;
 
-  int read_arg() { return *current_frame().ip++; }
+#define TOS_ARITHMETIC(op, sym)                                                \
+  if (sp[-1].is_int() && tos.is_int()) {                                       \
+    ip[-1] = Op::op##_int_int;                                                 \
+  } else if (sp[-1].is_double() && tos.is_double()) {                          \
+    ip[-1] = Op::op##_double_double;                                           \
+  }                                                                            \
+  TOS_GENERIC(sym)
 
-  void push(Value value) {
-    *sp = value;
-    sp++;
+// Quickened arithmetic on sp[-1] and `tos`, falling back to the generic op if
+// they aren't of type `type`
+#define TOS_QUICKENED(op, sym, type)                                           \
+  if (sp[-1].is_##type() && tos.is_##type()) {                                 \
+    sp--;                                                                      \
+    tos = Value::of(sp->type##_value() sym tos.type##_value());                \
+  } else {                                                                     \
+    ip[-1] = Op::op;                                                           \
+    TOS_GENERIC(sym)                                                           \
   }
 
-  Value pop() { return *--sp; }
+    TOS_TARGET(add) {
+      TOS_ARITHMETIC(add, +);
+      TRACE_OP("add   ");
+      DISPATCH_TOS();
+    }
+    TOS_TARGET(subtract) {
+      TOS_ARITHMETIC(subtract, -);
+      TRACE_OP("subtract   ");
+      DISPATCH_TOS();
+    }
+    TOS_TARGET(multiply) {
+      TOS_ARITHMETIC(multiply, *);
+      TRACE_OP("multiply   ");
+      DISPATCH_TOS();
+    }
+    TOS_TARGET(divide) {
+      TOS_ARITHMETIC(divide, /);
+      TRACE_OP("divide   ");
+      DISPATCH_TOS();
+    }
+    TOS_TARGET(pop) {
+      tos = Value();
+      TRACE_OP("pop   ");
+      DISPATCH();
+    }
+    TOS_TARGET(jump) {
+      int n = READ_ARG();
+      ip += n;
+      TRACE_OP("jump  ");
+      DISPATCH_TOS();
+    }
+    TOS_TARGET(jump_if_zero) {
+      int n = READ_ARG();
+      ip += tos ? 0 : n;
+      tos = Value();
+      TRACE_OP("jump_if_zero  ");
+      DISPATCH();
+    }
+    TOS_TARGET(call) {
+      // calls see the whole stack
+      SPILL();
+      goto do_call;
+    }
+    TOS_TARGET(tail_call) {
+      SPILL();
+      goto do_tail_call;
+    }
+    TOS_TARGET(return_) {
+    tos_do_return:
+      // result replaces the function being called
+      *fp = std::move(tos);
+      if (frame == base) {
+        trace("return     ", nullptr, ip, fp + 1);
+        return;
+      }
+      sp = fp + 1;
+
+      frame--;
+      ip = frame->ip;
+      fp = frame->fp;
+      constants = frame->function->chunk->constants.data();
+
+      TRACE_OP("return     ");
+      DISPATCH();
+    }
+    TOS_TARGET(add_int_int) {
+      TOS_QUICKENED(add, +, int);
+      TRACE_OP("add_int_int   ");
+      DISPATCH_TOS();
+    }
+    TOS_TARGET(add_double_double) {
+      TOS_QUICKENED(add, +, double);
+      TRACE_OP("add_double_double   ");
+      DISPATCH_TOS();
+    }
+    TOS_TARGET(subtract_int_int) {
+      TOS_QUICKENED(subtract, -, int);
+      TRACE_OP("subtract_int_int   ");
+      DISPATCH_TOS();
+    }
+    TOS_TARGET(subtract_double_double) {
+      TOS_QUICKENED(subtract, -, double);
+      TRACE_OP("subtract_double_double   ");
+      DISPATCH_TOS();
+    }
+    TOS_TARGET(multiply_int_int) {
+      TOS_QUICKENED(multiply, *, int);
+      TRACE_OP("multiply_int_int   ");
+      DISPATCH_TOS();
+    }
+    TOS_TARGET(multiply_double_double) {
+      TOS_QUICKENED(multiply, *, double);
+      TRACE_OP("multiply_double_double   ");
+      DISPATCH_TOS();
+    }
+    TOS_TARGET(divide_int_int) {
+      TOS_QUICKENED(divide, /, int);
+      TRACE_OP("divide_int_int   ");
+      DISPATCH_TOS();
+    }
+    TOS_TARGET(divide_double_double) {
+      TOS_QUICKENED(divide, /, double);
+      TRACE_OP("divide_double_double   ");
+      DISPATCH_TOS();
+    }
+    TOS_TARGET(add_return) {
+      if (sp[-1].is_int() && tos.is_int()) {
+        sp--;
+        tos = Value::of(sp->int_value() + tos.int_value());
+      } else {
+        TOS_GENERIC(+)
+      }
+      TRACE_OP("add_return  ");
+      goto tos_do_return;
+    }
+
+    TOS_TARGET(get_local_load_const_subtract) {
+      SPILL();
+      const Value &a = fp[READ_ARG() + 1];
+      const Value &b = constants[READ_ARG()];
+      if (a.is_int() && b.is_int()) {
+        tos = Value::of(a.int_value() - b.int_value());
+      } else {
+        tos = a - b;
+      }
+      TRACE_OP("get_local_load_const_subtract  ");
+      DISPATCH_TOS();
+    }
+    TOS_TARGET(get_local_get_local) {
+      SPILL();
+      PUSH(fp[READ_ARG() + 1]);
+      tos = fp[READ_ARG() + 1];
+      TRACE_OP("get_local_get_local  ");
+      DISPATCH_TOS();
+    }
+    TOS_TARGET(get_local_jump_if_zero) {
+      SPILL();
+      const Value &v = fp[READ_ARG() + 1];
+      int n = READ_ARG();
+      ip += v ? 0 : n;
+      TRACE_OP("get_local_jump_if_zero  ");
+      DISPATCH();
+    }
+    TOS_TARGET(load_const_return) {
+      // the rest of the stack is discarded, so needn't be spilled
+      tos = constants[READ_ARG()];
+      TRACE_OP("load_const_return  ");
+      goto tos_do_return;
+    }
 
-  void trace(const char *op) {
+#if !THREADED_DISPATCH
+      default:
+        assert(false);
+      }
+    }
+#endif
+
+#undef READ_OP
+#undef READ_ARG
+#undef PUSH
+#undef POP
+#undef DROP
+#undef SPILL
+#undef TRACE_OP
+#undef ENSURE_STACK
+#undef TOS_GENERIC
+#undef TOS_ARITHMETIC
+#undef TOS_QUICKENED
+#undef TARGET
+#undef TOS_TARGET
+#undef DISPATCH
+#undef DISPATCH_TOS
+  }
+
+  void trace(const char *op, const Frame *frame, const int *ip,
+             const Value *sp) {
 #if TRACE
     std::cerr << op << "   stack:";
 
-    for (Value *i = stack; i < sp; i++) {
+    for (const Value *i = stack; i < sp; i++) {
       std::cerr << " " << i->to_string();
     }
 
-    if (frames.size() > 0) {
-      std::cerr << "  [ip: "
-                << (current_frame().ip - current_chunk().code.data()) << "]";
+    if (frame) {
+      std::cerr << "  [ip: " << (ip - frame->function->chunk->code.data())
+                << "]";
     } else {
       std::cerr << "  [ip: null]";
     }
@@ -214,13 +1557,17 @@ private:
 #endif
   }
 
-  std::vector<Frame> frames;
-
-  Value *stack;
-  Value *sp;
-
-  Frame &current_frame() { return frames.back(); }
-  const Chunk &current_chunk() { return *current_frame().function.chunk; }
+  /// Where JIT compiled code left a tail call for `call_native` to make
+  struct {
+    int callee_offset;
+    int arg_count;
+  } pending_tail_call;
+  /// Side exit a trace left through, or -1
+  int pending_exit = -1;
+  /// Native stack compiled code may use, below `eval`, before calls fall back
+  /// to the interpreter
+  NativeStack native_stack;
 
-  std::unordered_map<std::string, Value> globals;
+  std::chrono::steady_clock::time_point start_time;
+  std::vector<Promotion> promotion_log;
 };
@@ -0,0 +1,85 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include "../src/aot.h"
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <unistd.h>
+
+#ifndef DANG_RUNTIME_DIR
+#define DANG_RUNTIME_DIR "src"
+#endif
+
+static std::string compile(const std::string &source) {
+  GlobalTable globals;
+  Function script =
+      Compiler::compile(source, globals, {.superinstructions = false});
+  return AotCompiler().compile(script, globals);
+}
+
+/// Builds `source` into an executable, like `dangc`, and returns what it
+/// prints
+static std::string build_and_run(const std::string &source) {
+  std::filesystem::path exe = std::filesystem::temp_directory_path() /
+                              ("dang_aot_test_" + std::to_string(getpid()));
+  std::filesystem::path cpp = exe;
+  cpp += ".cpp";
+  std::ofstream(cpp) << compile(source);
+
+  const char *cxx = getenv("CXX");
+  std::string command = std::string(cxx ? cxx : "c++") +
+                        " -std=c++20 -I " DANG_RUNTIME_DIR " " + cpp.string() +
+                        " -o " + exe.string();
+  int status = std::system(command.c_str());
+  std::filesystem::remove(cpp);
+  REQUIRE(status == 0);
+
+  std::string output;
+  FILE *pipe = popen(exe.c_str(), "r");
+  char buffer[256];
+  while (size_t n = fread(buffer, 1, sizeof(buffer), pipe)) {
+    output.append(buffer, n);
+  }
+  pclose(pipe);
+  std::filesystem::remove(exe);
+  return output;
+}
+
+static bool contains(const std::string &str, const std::string &substr) {
+  return str.find(substr) != std::string::npos;
+}
+
+TEST_CASE("functions are emitted with their stack slots as locals",
+          "[aot]") {
+  std::string cpp = compile("fn f(a, b) { let c = a + b; return c * 2; } "
+                            "return f(1, 2.5);");
+
+  REQUIRE(contains(cpp, "static Value fn_0(Value *fp)"));
+  REQUIRE(contains(cpp, "static Value fn_1(Value *fp)"));
+  REQUIRE(contains(cpp, "{\"f\"},"));
+  REQUIRE(contains(cpp, "Value::of(Function{.name = \"f\", .arity = 2, "
+                        ".native = fn_1})"));
+  // args are the caller's slots, `c` is the first local
+  REQUIRE(contains(cpp, "s[0] = fp[1];\n  s[1] = fp[2];\n  s[0] += s[1];"));
+  REQUIRE(contains(cpp, "Value::of(0x1.4p+1)"));
+  REQUIRE(contains(cpp, "int main() { return aot::run(fn_0); }"));
+}
+
+TEST_CASE("self tail calls are emitted as loops", "[aot]") {
+  std::string cpp = compile("fn sum(n, acc) { "
+                            "  if n { return sum(n - 1, acc + n); } "
+                            "  return acc; "
+                            "} "
+                            "return sum(10, 0);");
+
+  REQUIRE(contains(cpp, "if (aot::is_function(s[0], fn_1)) {"));
+  REQUIRE(contains(cpp, "fp[2] = std::move(s[2]);\n    goto start;"));
+}
+
+TEST_CASE("ifs ending a function build and run", "[aot]") {
+  // both jump to the implicit return at the end of the code
+  REQUIRE(build_and_run("fn f(n) { if n { return 1; } else { return 2; } } "
+                        "fn g(n) { if n { return 3; } } "
+                        "return f(1) * 100 + f(0) * 10 + g(1) + g(0);") ==
+          "123\n");
+}
@@ -3,12 +3,12 @@
 
 #include "../src/compiler.h"
 #include "../src/disassembler.h"
+#include "../src/reg_compiler.h"
 
 using Catch::Matchers::RangeEquals;
 
 static Function compile(const std::string &source) {
-  Compiler c{};
-  return c.compile(source);
+  return Compiler::compile(source);
 }
 
 TEST_CASE("Vars", "[compiler]") {
@@ -106,14 +106,14 @@ TEST_CASE("correct bytecode is generated for nested scopes", "[compiler]") {
   // clang-format off
   const int expected[] = {
     Op::load_const, 0,
-    Op::define_global, 1,
-    Op::get_global, 2,
+    Op::define_global, 0,
+    Op::get_global, 0,
     Op::get_local, 0,
-    Op::load_const, 3,
+    Op::load_const, 1,
     Op::multiply,
-    Op::set_global, 4,
+    Op::set_global, 0,
     Op::pop,
-    Op::get_global, 5,
+    Op::get_global, 0,
     Op::return_
   };
   // clang-format on
@@ -131,17 +131,227 @@ TEST_CASE("correct bytecode is generated for if statement", "[compiler]") {
   // clang-format off
   const int expected[] = {
     Op::load_const, 0,
-    Op::define_global, 1,
-    Op::get_global, 2,
+    Op::define_global, 0,
+    Op::get_global, 0,
     Op::jump_if_zero, 7,
-    Op::get_global, 3,
-    Op::load_const, 4,
+    Op::get_global, 0,
+    Op::load_const, 1,
     Op::multiply,
-    Op::set_global, 5,
-    Op::get_global, 6,
+    Op::set_global, 0,
+    Op::get_global, 0,
     Op::return_
   };
   // clang-format on
 
   CHECK_THAT(compiled.chunk->code, RangeEquals(expected));
 }
+
+TEST_CASE("ifs ending a function jump to an implicit return", "[compiler]") {
+  GlobalTable globals;
+  Function script = Compiler::compile("fn g(n) { if n { return 1; } }",
+                                      globals, {.superinstructions = false});
+
+  // clang-format off
+  const int expected[] = {
+    Op::get_local, 0,
+    Op::jump_if_zero, 3,
+    Op::load_const, 0,
+    Op::return_,
+    Op::load_const, 1,
+    Op::return_,
+  };
+  // clang-format on
+
+  Function g = script.chunk->constants.at(0).function_value();
+  CHECK_THAT(g.chunk->code, RangeEquals(expected));
+}
+
+TEST_CASE("globals are assigned dense slot indices", "[compiler]") {
+  GlobalTable globals;
+
+  Compiler::compile("let a = 1; let b = 2; fn f() { return c; }", globals);
+  REQUIRE(globals.size() == 4);
+  REQUIRE(globals.resolve("a") == 0);
+  REQUIRE(globals.resolve("b") == 1);
+  REQUIRE(globals.resolve("f") == 3);
+
+  SECTION("names referenced before definition share a slot") {
+    REQUIRE(globals.resolve("c") == 2);
+
+    Function later = Compiler::compile("let c = 3; return c;", globals);
+
+    // clang-format off
+    const int expected[] = {
+      Op::load_const, 0,
+      Op::define_global, 2,
+      Op::get_global, 2,
+      Op::return_
+    };
+    // clang-format on
+
+    CHECK_THAT(later.chunk->code, RangeEquals(expected));
+  }
+}
+
+TEST_CASE("superinstructions are fused and jumps relocated", "[compiler]") {
+  std::string source = "fn f(n) { if n { return n - 1; } return 0; }";
+
+  GlobalTable globals;
+  Function script = Compiler::compile(source, globals);
+  Function f = script.chunk->constants.at(0).function_value();
+
+  // clang-format off
+  const int expected[] = {
+    Op::get_local_jump_if_zero, 0, 4,
+    Op::get_local_load_const_subtract, 0, 0,
+    Op::return_,
+    Op::load_const_return, 1,
+  };
+  // clang-format on
+
+  CHECK_THAT(f.chunk->code, RangeEquals(expected));
+
+  SECTION("not when disabled") {
+    Function script = Compiler::compile(source, globals,
+                                        {.superinstructions = false});
+    Function f = script.chunk->constants.at(0).function_value();
+
+    // clang-format off
+    const int expected[] = {
+      Op::get_local, 0,
+      Op::jump_if_zero, 6,
+      Op::get_local, 0,
+      Op::load_const, 0,
+      Op::subtract,
+      Op::return_,
+      Op::load_const, 1,
+      Op::return_,
+    };
+    // clang-format on
+
+    CHECK_THAT(f.chunk->code, RangeEquals(expected));
+  }
+}
+
+TEST_CASE("runs containing a jump target are not fused", "[compiler]") {
+  // the jump lands on `return_`, so it can't be fused with the `load_const`
+  // before it
+  // clang-format off
+  Chunk chunk{.code = {
+    Op::get_local, 0,
+    Op::jump_if_zero, 2,
+    Op::load_const, 0,
+    Op::return_,
+  }};
+  // clang-format on
+
+  fuse_superinstructions(chunk);
+
+  // clang-format off
+  const int expected[] = {
+    Op::get_local_jump_if_zero, 0, 2,
+    Op::load_const, 0,
+    Op::return_,
+  };
+  // clang-format on
+
+  CHECK_THAT(chunk.code, RangeEquals(expected));
+}
+
+TEST_CASE("function bodies can be left until they're first called",
+          "[compiler]") {
+  std::string source = "fn f(n) { fn g() { return 2; } return n * g(); }";
+  Function script = Compiler::compile(
+      Source::copy(source), std::make_shared<GlobalTable>(), {.lazy = true});
+
+  Function f = script.chunk->constants.at(0).function_value();
+  REQUIRE(f.name == "f");
+  REQUIRE(f.arity == 1);
+  REQUIRE(f.chunk->lazy);
+  REQUIRE(f.chunk->code.empty());
+
+  Compiler::compile_body(*f.chunk);
+  REQUIRE_FALSE(f.chunk->lazy);
+
+  GlobalTable eager_globals;
+  Function eager = Compiler::compile(source, eager_globals)
+                       .chunk->constants.at(0)
+                       .function_value();
+  CHECK_THAT(f.chunk->code, RangeEquals(eager.chunk->code));
+  REQUIRE(f.chunk->max_stack == eager.chunk->max_stack);
+
+  // nested functions are left lazy in turn
+  REQUIRE(f.chunk->constants.at(0).function_value().chunk->lazy);
+}
+
+TEST_CASE("returning a function call compiles to a tail call", "[compiler]") {
+  GlobalTable globals;
+  Function script =
+      Compiler::compile("fn f(n) { return f(n); } return 1 + f(2);", globals,
+                        {.superinstructions = false});
+
+  // clang-format off
+  const int expected_f[] = {
+    Op::get_global, 0,
+    Op::get_local, 0,
+    Op::tail_call, 1,
+    // implicit `return 0` at the end of every function
+    Op::load_const, 0,
+    Op::return_,
+  };
+  // clang-format on
+
+  Function f = script.chunk->constants.at(0).function_value();
+  CHECK_THAT(f.chunk->code, RangeEquals(expected_f));
+
+  // not in tail position
+  // clang-format off
+  const int expected_script[] = {
+    Op::load_const, 0,
+    Op::define_global, 0,
+    Op::load_const, 1,
+    Op::get_global, 0,
+    Op::load_const, 2,
+    Op::call, 1,
+    Op::add,
+    Op::return_,
+  };
+  // clang-format on
+
+  CHECK_THAT(script.chunk->code, RangeEquals(expected_script));
+}
+
+TEST_CASE("chunks record their maximum stack depth", "[compiler]") {
+  Function script = Compiler::compile("fn f(a) { return a; } "
+                                      "return 1 + 2 * (3 - f(4));");
+
+  CHECK(script.chunk->max_stack == 5);
+
+  Function f = script.chunk->constants.at(0).function_value();
+  CHECK(f.chunk->max_stack == 1);
+}
+
+TEST_CASE("register code uses locals as operands in place", "[compiler]") {
+  GlobalTable globals;
+  Function script = RegCompiler::compile(
+      "fn f(a, b) { let c = a + b; c = c * 2; return g(c, 1); }", globals);
+
+  using enum RegOp;
+  // clang-format off
+  const int expected[] = {
+    (int)add, 3, 1, 2,
+    (int)multiply_k, 3, 3, 0,
+    (int)get_global, 4, 0,
+    (int)move, 5, 3,
+    (int)load_const, 6, 1,
+    (int)tail_call, 4, 2,
+    // implicit `return 0` at the end of every function
+    (int)load_const, 4, 2,
+    (int)return_, 4,
+  };
+  // clang-format on
+
+  Function f = script.reg_chunk->constants.at(0).function_value();
+  CHECK_THAT(f.reg_chunk->code, RangeEquals(expected));
+  CHECK(f.reg_chunk->num_registers == 7);
+}
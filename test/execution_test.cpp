@@ -1,10 +1,37 @@
 #include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
 
+#include "../src/closure_vm.h"
+#include "../src/reg_vm.h"
 #include "../src/vm.h"
 
+/// Runs `source` in the interpreter, again with superinstructions fused up
+/// front and promoted to from the second call, again with every function JIT
+/// compiled before it runs, again tracing from the first call, and again on
+/// the register VM and as closures, checking all agree
 static Value compile_and_run(const std::string &source) {
-  VM vm;
-  return vm.eval(source);
+  VM interpreter;
+  Value result = interpreter.eval(source);
+
+  VM untiered({.tiered = false});
+  REQUIRE(untiered.eval(source) == result);
+
+  VM promoted({.tier_threshold = 2});
+  REQUIRE(promoted.eval(source) == result);
+
+  RegVM registers;
+  REQUIRE(registers.eval(source) == result);
+
+  ClosureVM closures;
+  REQUIRE(closures.eval(source) == result);
+
+  VM jit({.jit = JitMode::always});
+  REQUIRE(jit.eval(source) == result);
+
+  VM tracing({.jit = JitMode::trace, .jit_threshold = 1});
+  REQUIRE(tracing.eval(source) == result);
+
+  return result;
 }
 
 TEST_CASE("basic program can be run", "[execution]") {
@@ -100,3 +127,348 @@ TEST_CASE("complex if else if changes evaluate correctly", "[execution]") {
     REQUIRE(compile_and_run(program) == Value::of(3));
   }
 }
+
+TEST_CASE("globals persist between evals", "[execution]") {
+  VM vm({.jit = GENERATE(JitMode::off, JitMode::always, JitMode::trace)});
+
+  vm.eval("fn get() { return later; }");
+  vm.eval("let later = 42;");
+
+  REQUIRE(vm.eval("return get();") == Value::of(42));
+}
+
+TEST_CASE("arithmetic is quickened to the operand types seen",
+          "[execution]") {
+  VM vm;
+
+  Value f = vm.eval("fn f(a, b) { let c = a + b; return c; } return f;");
+  const std::vector<int> &code = f.function_value().chunk->code;
+  auto has_op = [&](Op op) {
+    return std::find(code.begin(), code.end(), op) != code.end();
+  };
+
+  // not compiled until its first call, which quickens it straight away
+  REQUIRE(code.empty());
+
+  REQUIRE(vm.eval("return f(1, 2);") == Value::of(3));
+  REQUIRE(has_op(Op::add_int_int));
+
+  SECTION("falls back when operand types change") {
+    REQUIRE(vm.eval("return f(1.5, 2.0);") == Value::of(3.5));
+    REQUIRE(has_op(Op::add));
+    REQUIRE(vm.eval("return f(1.5, 2.0);") == Value::of(3.5));
+    REQUIRE(has_op(Op::add_double_double));
+
+    REQUIRE(vm.eval("return f(\"a\", \"b\");") == Value::of("ab"));
+    REQUIRE(vm.eval("return f(2, 0.5);") == Value::of(2.5));
+    REQUIRE(vm.eval("return f(2, 5);") == Value::of(7));
+  }
+}
+
+TEST_CASE("locals in scopes at the top level of a script", "[execution]") {
+  std::string source = "let x = 1; { let y = 2; let z = 3; x = y * z; } "
+                       "return x;";
+
+  REQUIRE(compile_and_run(source) == Value::of(6));
+}
+
+TEST_CASE("code ending in an operand equal to a return still returns",
+          "[execution]") {
+  // the fifteenth global defined is `define_global 14`, and 14 is the
+  // `return_` opcode
+  std::string source;
+  for (int i = 0; i < 15; i++) {
+    source += "let g" + std::to_string(i) + " = " + std::to_string(i) + "; ";
+  }
+
+  REQUIRE(compile_and_run(source) == Value::of(0));
+}
+
+TEST_CASE("ifs ending a function fall through to the implicit return",
+          "[execution]") {
+  std::string source = "fn f(n) { if n { return 1; } else { return 2; } } "
+                       "fn g(n) { if n { return 3; } } "
+                       "return f(1) * 100 + f(0) * 10 + g(1) + g(0);";
+
+  REQUIRE(compile_and_run(source) == Value::of(123));
+}
+
+TEST_CASE("locals defined in branches taken on computed conditions",
+          "[execution]") {
+  std::string source = "fn f(p) { "
+                       "  if p + 1 { let v = 40; return v; } "
+                       "  return 0; "
+                       "} "
+                       "fn g(p) { "
+                       "  if p - 1 { return 1; } "
+                       "  else if p * 2 { fn h() { return 2; } let w = h(); "
+                       "    return w + p; } "
+                       "  return 3; "
+                       "} "
+                       "return f(1) + g(1);";
+
+  REQUIRE(compile_and_run(source) == Value::of(43));
+}
+
+TEST_CASE("recursion up to the maximum call depth", "[execution]") {
+  VM vm({.max_call_depth = 64,
+         .jit = GENERATE(JitMode::off, JitMode::always, JitMode::trace)});
+
+  std::string source = "fn down(n) { if n { return down(n - 1) + 1; } "
+                       "return 0; } "
+                       "return down(62);";
+
+  REQUIRE(vm.eval(source) == Value::of(62));
+}
+
+TEST_CASE("tail calls run in constant stack space", "[execution]") {
+  VM vm({.max_call_depth = 8,
+         .jit = GENERATE(JitMode::off, JitMode::always, JitMode::trace)});
+
+  std::string source = "fn sum(n, acc) { "
+                       "  if n { return sum(n - 1, acc + n); } "
+                       "  return acc; "
+                       "} "
+                       "return sum(10000, 0);";
+
+  REQUIRE(vm.eval(source) == Value::of(50005000));
+}
+
+TEST_CASE("tail calls between functions", "[execution]") {
+  std::string source = "fn even(n) { if n { return (odd(n - 1)); } "
+                       "  return true; } "
+                       "fn odd(n) { if n { return even(n - 1); } "
+                       "  return false; } "
+                       "return even(5001);";
+
+  REQUIRE(compile_and_run(source) == Value::of(false));
+}
+
+TEST_CASE("the value stack grows for deep recursion", "[execution]") {
+  VM vm({.initial_stack_size = 4,
+         .jit = GENERATE(JitMode::off, JitMode::always, JitMode::trace)});
+
+  std::string source = "fn down(n) { if n { return down(n - 1) + 1; } "
+                       "return 0; } "
+                       "fn fib(n) { if n - 1 { if n { "
+                       "  return fib(n - 1) + fib(n - 2); } return 0; } "
+                       "  return 1; } "
+                       "return down(20000) + fib(15);";
+
+  REQUIRE(vm.eval(source) == Value::of(20610));
+}
+
+TEST_CASE("compiled code recurses as deep as the interpreter", "[execution]") {
+  VM vm({.jit = GENERATE(JitMode::off, JitMode::on, JitMode::always,
+                         JitMode::trace),
+         .jit_threshold = 2});
+
+  // deeper than compiled code's native stack allows, so the deepest calls
+  // are interpreted
+  std::string source = "fn deep(n) { if n { return deep(n - 1) + 1; } "
+                       "return 0; } "
+                       "return deep(60000);";
+
+  REQUIRE(vm.eval(source) == Value::of(60000));
+}
+
+TEST_CASE("deeply nested expressions and long else-if chains run everywhere",
+          "[execution]") {
+  // enough to overflow the native stack, were they compiled recursively
+  const int depth = 100000;
+  std::string source = "let r = 0; if 0 { r = 1; } ";
+  for (int i = 0; i < depth; i++) {
+    source += "else if 0 { r = 1; } ";
+  }
+  source += "else if 1 { r = 2; } else { r = 3; } return r";
+  for (int i = 0; i < depth; i++) {
+    source += " + (1";
+  }
+  source += std::string(depth, ')') + ";";
+
+  // and a long chain of operators, which nests the other way
+  std::string chain = "return 0";
+  for (int i = 0; i < 2 * depth; i++) {
+    chain += " + 1";
+  }
+  chain += ";";
+
+  VM vm;
+  REQUIRE(vm.eval(source) == Value::of(depth + 2));
+  REQUIRE(vm.eval(chain) == Value::of(2 * depth));
+
+  RegVM registers;
+  REQUIRE(registers.eval(source) == Value::of(depth + 2));
+  REQUIRE(registers.eval(chain) == Value::of(2 * depth));
+
+  ClosureVM closures;
+  REQUIRE(closures.eval(source) == Value::of(depth + 2));
+  REQUIRE(closures.eval(chain) == Value::of(2 * depth));
+}
+
+TEST_CASE("functions are JIT compiled once they're hot", "[execution]") {
+  VM vm({.jit = JitMode::on, .jit_threshold = 10});
+
+  vm.eval("fn f(a, b) { if a { return a * b - 1; } return \"zero\"; }");
+
+  auto f = [&] { return vm.eval("return f;").function_value(); };
+
+  REQUIRE(vm.eval("return f(3, 4);") == Value::of(11));
+  REQUIRE_FALSE(f().chunk->native);
+
+  for (int i = 0; i < 10; i++) {
+    vm.eval("{ let x = f(2, 2); }");
+  }
+  REQUIRE(f().chunk->native);
+
+  REQUIRE(vm.eval("return f(3, 4);") == Value::of(11));
+  REQUIRE(vm.eval("return f(0, 4);") == Value::of("zero"));
+  REQUIRE(vm.eval("return f(1.5, 2);") == Value::of(2.0));
+}
+
+TEST_CASE("function bodies are compiled when first called", "[execution]") {
+  VM vm;
+  vm.eval("let g = 2; "
+          "fn unused() { return 1; } "
+          "fn f(n) { if n { return missing; } return 40; }");
+  auto chunk = [&](const std::string &name) {
+    return vm.eval("return " + name + ";").function_value().chunk;
+  };
+
+  REQUIRE(chunk("unused")->lazy);
+  REQUIRE(chunk("f")->lazy);
+
+  // compiling `f` adds a global slot while the script calling it is running
+  REQUIRE(vm.eval("return f(0) + g;") == Value::of(42));
+  REQUIRE_FALSE(chunk("f")->lazy);
+  REQUIRE(chunk("unused")->lazy);
+}
+
+TEST_CASE("functions are promoted a tier at a time as they get hot",
+          "[execution]") {
+  VM vm({.jit = JitMode::on, .jit_threshold = 20, .tier_threshold = 5});
+
+  vm.eval("fn down(n) { if n { return down(n - 1) + 1; } return 0; }");
+  auto down = [&] { return vm.eval("return down;").function_value(); };
+
+  REQUIRE(vm.eval("return down(2);") == Value::of(2));
+  REQUIRE(down().chunk->tier == Tier::bytecode);
+
+  // promoted part way down, while the outer calls are still running the
+  // unfused code
+  REQUIRE(vm.eval("return down(10);") == Value::of(10));
+  REQUIRE(down().chunk->tier == Tier::superinstructions);
+
+  REQUIRE(vm.eval("return down(10);") == Value::of(10));
+  REQUIRE(down().chunk->tier == Tier::native);
+
+  REQUIRE(vm.promotions().size() == 2);
+  REQUIRE(vm.promotions()[0].function == "down");
+  REQUIRE(vm.promotions()[0].tier == Tier::superinstructions);
+  REQUIRE(vm.promotions()[0].calls == 5);
+  REQUIRE(vm.promotions()[1].tier == Tier::native);
+  REQUIRE(vm.promotions()[1].calls == 20);
+}
+
+TEST_CASE("traces are recorded through hot call sites", "[execution]") {
+  VM vm({.jit = JitMode::trace, .jit_threshold = 5});
+
+  vm.eval("fn dec(n) { return n - 1; } "
+          "fn fib(n) { if dec(n) { if n { "
+          "  return fib(dec(n)) + fib(n - 2); } return 0; } "
+          "  return 1; }");
+
+  auto trace = [&] {
+    return vm.eval("return fib;").function_value().chunk->trace;
+  };
+
+  REQUIRE(vm.eval("return fib(20);") == Value::of(6765));
+  REQUIRE(trace());
+  REQUIRE(trace()->native);
+  // the base cases were recorded as side paths once their exits got hot
+  REQUIRE(trace()->paths.size() >= 3);
+  // call sites are counted on the chunk calling from them
+  const Chunk &fib = *vm.eval("return fib;").function_value().chunk;
+  REQUIRE(fib.call_site_counts.size() == fib.code.size());
+
+  SECTION("guards leave the trace when types change") {
+    REQUIRE(vm.eval("return fib(5.0);") == Value::of(5));
+  }
+
+  SECTION("inlined calls are guarded on the function called") {
+    vm.eval("fn dec2(n) { return n - 2; } dec = dec2;");
+    REQUIRE(vm.eval("return fib(10);") == Value::of(16));
+  }
+}
+
+TEST_CASE("the register VM grows, tail calls and keeps globals like the "
+          "stack VM",
+          "[execution]") {
+  SECTION("globals persist between evals") {
+    RegVM vm;
+    vm.eval("fn get() { return later; }");
+    vm.eval("let later = 42;");
+    REQUIRE(vm.eval("return get();") == Value::of(42));
+  }
+
+  SECTION("tail calls run in constant stack space") {
+    RegVM vm({.max_call_depth = 8});
+    REQUIRE(vm.eval("fn sum(n, acc) { "
+                    "  if n { return sum(n - 1, acc + n); } "
+                    "  return acc; "
+                    "} "
+                    "return sum(10000, 0);") == Value::of(50005000));
+  }
+
+  SECTION("the value stack grows for deep recursion") {
+    RegVM vm({.initial_stack_size = 4});
+    REQUIRE(vm.eval("fn down(n) { if n { return down(n - 1) + 1; } "
+                    "return 0; } "
+                    "return down(20000);") == Value::of(20000));
+  }
+}
+
+TEST_CASE("closures tail call, keep globals and resolve slots like the VMs",
+          "[execution]") {
+  SECTION("globals persist between evals") {
+    ClosureVM vm;
+    vm.eval("fn get() { return later; }");
+    vm.eval("let later = 42;");
+    REQUIRE(vm.eval("return get();") == Value::of(42));
+  }
+
+  SECTION("tail calls run in constant stack space") {
+    ClosureVM vm({.max_call_depth = 8});
+    REQUIRE(vm.eval("fn sum(n, acc) { "
+                    "  if n { return sum(n - 1, acc + n); } "
+                    "  return acc; "
+                    "} "
+                    "return sum(10000, 0);") == Value::of(50005000));
+  }
+
+  SECTION("a tail call's args may make tail calls of their own") {
+    ClosureVM vm;
+    REQUIRE(vm.eval("fn id(x) { return x; } "
+                    "fn g(x) { return id(x); } "
+                    "fn add(a, b) { return a + b; } "
+                    "fn f(n) { return add(g(n), g(n + 1)); } "
+                    "return f(20);") == Value::of(41));
+  }
+
+  SECTION("calls recurse as deep as in the VMs") {
+    ClosureVM vm;
+    REQUIRE(vm.eval("fn deep(n) { if n { return deep(n - 1) + 1; } "
+                    "return 0; } "
+                    "return deep(60000);") == Value::of(60000));
+  }
+
+  SECTION("functions with many locals keep them off the native stack") {
+    ClosureVM vm;
+    REQUIRE(vm.eval("fn f(a, b, c, d, e) { "
+                    "  let g = a + b; let h = c + d; let i = e + g; "
+                    "  let j = h + i; return j * 2; "
+                    "} "
+                    "fn t(n) { return f(n, n, n, n, n); } "
+                    "return t(3);") == Value::of(30));
+  }
+}
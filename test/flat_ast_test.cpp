@@ -0,0 +1,173 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include "../src/ast_printer.h"
+#include "../src/flat_ast.h"
+
+static FlatAST flatten(std::string_view source) {
+  Lexer lexer(source);
+  return FlatAST::flatten(Parser(lexer).parse());
+}
+
+TEST_CASE("programs are flattened in pre-order", "[flat_ast]") {
+  using Kind = FlatAST::Kind;
+  FlatAST ast = flatten("let x = 1 + 2; fn f(a) { return a; }");
+
+  const std::vector<Kind> kinds = {
+      Kind::program,
+      Kind::let,
+      Kind::bin_expr,
+      Kind::integer_literal,
+      Kind::integer_literal,
+      Kind::function_def,
+      Kind::parameter,
+      Kind::scope,
+      Kind::return_,
+      Kind::identifier,
+  };
+  REQUIRE(ast.kinds == kinds);
+
+  REQUIRE(ast.first_child(0) == 1);
+  REQUIRE(ast.next_sibling(1) == 5);
+  REQUIRE(ast.token(1).value == "x");
+  REQUIRE(ast.token(2).type == TokenType::plus);
+  REQUIRE(ast.child(2, 1) == 4);
+  REQUIRE(ast.child_count(5) == 2);
+  REQUIRE(ast.token(9).value == "a");
+}
+
+TEST_CASE("skipped function bodies keep their source range", "[flat_ast]") {
+  std::string_view source = "fn f(a) { return a; }";
+  Lexer lexer(source);
+  ASTNodeProgram program =
+      Parser(lexer, {.skip_function_bodies = true}).parse();
+  FlatAST ast = FlatAST::flatten(program);
+
+  auto &def = std::get<ast_ptr<ASTNodeFunctionDef>>(program.body[0].child);
+  REQUIRE(ast.kind(3) == FlatAST::Kind::skipped_body);
+  REQUIRE(ast.skipped_body(3) == def->skipped_body);
+}
+
+TEST_CASE("flat ASTs print as the tree they came from", "[flat_ast]") {
+  FlatAST ast = flatten("if x { return (1); } else { return f(y, 2.5); }");
+
+  const char *expected = R"((ASTNodeProgram){
+ .body = {
+  (ASTNodeStmt){
+   .child = {
+    (ASTNodeIf){
+     .condition = 
+      (ASTNodeExpr){
+       .child = {
+        (ASTNodeTerm){
+         .child = {
+          (ASTNodeIdentifier){
+           .token = (Token){.type = TokenType::identifier, .value = "x"},
+          }
+         }
+        }
+       }
+      }
+      ,
+     .body = 
+      (ASTNodeScope){
+       .body = {
+        (ASTNodeStmt){
+         .child = {
+          (ASTNodeReturn){
+           .expr = 
+            (ASTNodeExpr){
+             .child = {
+              (ASTNodeTerm){
+               .child = {
+                (ASTNodeParenExpr){
+                 .child = 
+                  (ASTNodeExpr){
+                   .child = {
+                    (ASTNodeTerm){
+                     .child = {
+                      (ASTNodeIntegerLiteral){
+                       .token = (Token){.type = TokenType::integer_literal, .value = "1"},
+                      }
+                     }
+                    }
+                   }
+                  }
+                  ,
+                }
+               }
+              }
+             }
+            }
+            ,
+          }
+         }
+        }
+        ,
+       }
+      }
+      ,
+     .rest = {
+      (ASTNodeElse){
+       .body = 
+        (ASTNodeScope){
+         .body = {
+          (ASTNodeStmt){
+           .child = {
+            (ASTNodeReturn){
+             .expr = 
+              (ASTNodeExpr){
+               .child = {
+                (ASTNodeTerm){
+                 .child = {
+                  (ASTNodeFunctionCall){
+                   .name = (Token){.type = TokenType::identifier, .value = "f"},
+                   .body = {
+                    (ASTNodeExpr){
+                     .child = {
+                      (ASTNodeTerm){
+                       .child = {
+                        (ASTNodeIdentifier){
+                         .token = (Token){.type = TokenType::identifier, .value = "y"},
+                        }
+                       }
+                      }
+                     }
+                    }
+                    ,
+                    (ASTNodeExpr){
+                     .child = {
+                      (ASTNodeTerm){
+                       .child = {
+                        (ASTNodeDoubleLiteral){
+                         .token = (Token){.type = TokenType::double_literal, .value = "2.5"},
+                        }
+                       }
+                      }
+                     }
+                    }
+                    ,
+                   }
+                  }
+                 }
+                }
+               }
+              }
+              ,
+            }
+           }
+          }
+          ,
+         }
+        }
+        ,
+      }
+     }
+    }
+   }
+  }
+  ,
+ }
+}
+)";
+  REQUIRE(ASTPrinter(ast).print() == expected);
+}
@@ -106,3 +106,67 @@ TEST_CASE("slash-star comments are skipped over", "[lexer]") {
 
   CHECK_THAT(lexer.lex(), RangeEquals(expected));
 }
+
+TEST_CASE("token values are views into the source", "[lexer]") {
+  std::string source = "let name = \"str\";";
+  std::vector<Token> tokens = Lexer(source).lex();
+
+  REQUIRE(tokens[1].value.data() == source.data() + 4);
+  REQUIRE(tokens[3].value.data() == source.data() + 12);
+  REQUIRE(tokens[3].value == "str");
+}
+
+TEST_CASE("long runs are scanned to their ends", "[lexer]") {
+  Lexer lexer("let averyveryverylongname0123 =              \t\n"
+              "  12345678901234567.123456789012345678 + "
+              "\"a string that's longer than sixteen bytes\"; "
+              "// a comment that's longer than sixteen bytes\n"
+              "/* and * another ** one, with a / or two */ x");
+
+  const std::array<Token, 8> expected{{
+      {.type = TokenType::kw_let},
+      {.type = TokenType::identifier, .value = "averyveryverylongname0123"},
+      {.type = TokenType::equals},
+      {.type = TokenType::double_literal,
+       .value = "12345678901234567.123456789012345678"},
+      {.type = TokenType::plus},
+      {.type = TokenType::string_literal,
+       .value = "a string that's longer than sixteen bytes"},
+      {.type = TokenType::semicolon},
+      {.type = TokenType::identifier, .value = "x"},
+  }};
+
+  CHECK_THAT(lexer.lex(), RangeEquals(expected));
+}
+
+TEST_CASE("only whole keywords are keywords", "[lexer]") {
+  Lexer lexer("fn fnord true truth null nul ifelse else");
+
+  const std::array<Token, 8> expected{{
+      {.type = TokenType::kw_fn},
+      {.type = TokenType::identifier, .value = "fnord"},
+      {.type = TokenType::kw_true},
+      {.type = TokenType::identifier, .value = "truth"},
+      {.type = TokenType::kw_null},
+      {.type = TokenType::identifier, .value = "nul"},
+      {.type = TokenType::identifier, .value = "ifelse"},
+      {.type = TokenType::kw_else},
+  }};
+
+  CHECK_THAT(lexer.lex(), RangeEquals(expected));
+}
+
+TEST_CASE("tokens can be pulled one at a time", "[lexer]") {
+  Lexer lexer("let x = /* one */ 1;");
+
+  REQUIRE(lexer.next() == Token{.type = TokenType::kw_let});
+  REQUIRE(lexer.start() == 0);
+  REQUIRE(lexer.next() == Token{.type = TokenType::identifier, .value = "x"});
+  REQUIRE(lexer.next() == Token{.type = TokenType::equals});
+  REQUIRE(lexer.start() == 6);
+  REQUIRE(lexer.next() ==
+          Token{.type = TokenType::integer_literal, .value = "1"});
+  REQUIRE(lexer.start() == 18);
+  REQUIRE(lexer.next() == Token{.type = TokenType::semicolon});
+  REQUIRE(lexer.next() == std::nullopt);
+}
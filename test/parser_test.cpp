@@ -3,14 +3,10 @@
 #include "../src/lexer.h"
 #include "../src/parser.h"
 
-static std::vector<Token> tokens(std::string input) {
-  Lexer l(input);
-  return l.lex();
-}
-
 TEST_CASE("basic program can be parsed", "[parser]") {
 
-  Parser p(tokens("return 123;"));
+  Lexer l("return 123;");
+  Parser p(l);
 
   ASTNodeProgram expected = (ASTNodeProgram){
       .body = {(ASTNodeStmt){
@@ -27,7 +23,9 @@ TEST_CASE("basic program can be parsed", "[parser]") {
 }
 
 TEST_CASE("can parse scopes", "[parser]") {
-  Parser p(tokens("let x = 1; { let y = 2; }"));
+  Lexer l("let x = 1; { let y = 2; }");
+  Parser p(l);
+  ASTArena arena;
 
   ASTNodeProgram expected = (ASTNodeProgram){
    .body = {
@@ -52,7 +50,7 @@ TEST_CASE("can parse scopes", "[parser]") {
     },
     (ASTNodeStmt){
      .child = {
-      (ASTNodeScope){
+      arena.make(ASTNodeScope{
        .body = {
         (ASTNodeStmt){
          .child = {
@@ -74,7 +72,7 @@ TEST_CASE("can parse scopes", "[parser]") {
          }
         },
        }
-      }
+      })
      }
     },
    }
@@ -82,3 +80,88 @@ TEST_CASE("can parse scopes", "[parser]") {
 
   REQUIRE(p.parse() == expected);
 }
+
+TEST_CASE("a pre-parse skips function bodies, to be parsed later",
+          "[parser]") {
+  std::string source = "fn f(a) { if a { { let b = a; } } return a * 2; } "
+                       "return f(1);";
+  Lexer lexer(source);
+  ASTNodeProgram program =
+      Parser(lexer, {.skip_function_bodies = true}).parse();
+
+  REQUIRE(program.body.size() == 2);
+  auto &f = *std::get<ast_ptr<ASTNodeFunctionDef>>(
+      program.body[0].child);
+  REQUIRE(f.name.value == "f");
+  REQUIRE(f.arg_names.size() == 1);
+  REQUIRE(f.body.body.empty());
+  // from `{` to just past its matching `}`
+  REQUIRE(f.skipped_body == std::pair<size_t, size_t>{8, 49});
+
+  Lexer full_lexer(source);
+  ASTNodeProgram full = Parser(full_lexer).parse();
+  auto &full_f =
+      *std::get<ast_ptr<ASTNodeFunctionDef>>(full.body[0].child);
+  auto arena = std::make_shared<ASTArena>();
+  REQUIRE(Parser::parse_function_body(f, source, arena, {}) == full_f.body);
+}
+
+TEST_CASE("long operator chains are parsed without copying subtrees",
+          "[parser]") {
+  // each `+` used to copy the whole chain to its left
+  std::string source = "return 1";
+  for (int i = 0; i < 10000; i++) {
+    source += " + 1";
+  }
+  source += ";";
+
+  Lexer lexer(source);
+  ASTNodeProgram program = Parser(lexer).parse();
+
+  const ASTNodeExpr *expr =
+      &std::get<ASTNodeReturn>(program.body[0].child).expr;
+  int depth = 0;
+  while (auto *bin_expr = std::get_if<ASTNodeBinExpr>(&expr->child)) {
+    expr = bin_expr->lhs.get();
+    depth++;
+  }
+  REQUIRE(depth == 10000);
+}
+
+TEST_CASE("deep nesting and long else-if chains are parsed without recursing",
+          "[parser]") {
+  // enough to overflow the native stack, one call per level
+  const int depth = 100000;
+  std::string source = "if 1 {} ";
+  for (int i = 0; i < depth; i++) {
+    source += "else if 1 {} ";
+  }
+  source += "return " + std::string(depth, '(') + "1 + 2" +
+            std::string(depth, ')') + " * 3;";
+
+  Lexer lexer(source);
+  ASTNodeProgram program = Parser(lexer).parse();
+  REQUIRE(program.body.size() == 2);
+
+  auto &if_stmt = *std::get<ast_ptr<ASTNodeIf>>(program.body[0].child);
+  const ASTNodeIf::Rest *rest = &if_stmt.rest;
+  int arms = 0;
+  while (auto *else_if = std::get_if<ast_ptr<ASTNodeElseIf>>(rest)) {
+    rest = &(*else_if)->rest;
+    arms++;
+  }
+  REQUIRE(arms == depth);
+  REQUIRE(std::holds_alternative<std::monostate>(*rest));
+
+  auto &product = std::get<ASTNodeBinExpr>(
+      std::get<ASTNodeReturn>(program.body[1].child).expr.child);
+  REQUIRE(product.op == BinOp::multiply);
+  const ASTNodeExpr *expr = product.lhs.get();
+  int parens = 0;
+  while (auto *term = std::get_if<ASTNodeTerm>(&expr->child)) {
+    expr = std::get<ast_ptr<ASTNodeParenExpr>>(term->child)->child.get();
+    parens++;
+  }
+  REQUIRE(parens == depth);
+  REQUIRE(std::get<ASTNodeBinExpr>(expr->child).op == BinOp::add);
+}
@@ -7,3 +7,61 @@ TEST_CASE("adding strings works correctly", "[value]") {
 
   REQUIRE(res == Value::of("Hello, world"));
 }
+
+TEST_CASE("values are 8 bytes", "[value]") {
+  REQUIRE(sizeof(Value) == 8);
+}
+
+TEST_CASE("values round trip through NaN-boxing", "[value]") {
+  SECTION("ints") {
+    for (int i : {0, 1, -1, 123456, INT32_MAX, INT32_MIN}) {
+      Value v = Value::of(i);
+      REQUIRE(v.type() == ValueType::int_);
+      REQUIRE(v.int_value() == i);
+    }
+  }
+
+  SECTION("doubles") {
+    for (double d : {0.0, -0.0, 1.5, -3.25, 1e300, -1e-300}) {
+      Value v = Value::of(d);
+      REQUIRE(v.type() == ValueType::double_);
+      REQUIRE(v.double_value() == d);
+    }
+
+    REQUIRE(Value::of(0.0 / 0.0).type() == ValueType::double_);
+  }
+
+  SECTION("booleans and null") {
+    REQUIRE(Value::of(true).type() == ValueType::boolean);
+    REQUIRE(Value::of(true).bool_value());
+    REQUIRE(Value::of(false).type() == ValueType::boolean);
+    REQUIRE(!Value::of(false).bool_value());
+    REQUIRE(Value().type() == ValueType::null_);
+  }
+
+  SECTION("strings") {
+    Value v = Value::of("hello");
+    REQUIRE(v.type() == ValueType::string);
+    REQUIRE(v.string_value() == "hello");
+  }
+}
+
+TEST_CASE("values of different types are not equal", "[value]") {
+  REQUIRE(Value::of(1) != Value::of(1.0));
+  REQUIRE(Value::of(1) != Value::of(true));
+  REQUIRE(Value::of(0) != Value());
+  REQUIRE(Value::of("1") != Value::of(1));
+}
+
+TEST_CASE("copies of heap values share the object", "[value]") {
+  Value a = Value::of("shared");
+  Value b = a;
+  Value c;
+  c = b;
+
+  REQUIRE(&a.string_value() == &c.string_value());
+
+  a = Value::of(1);
+  b = Value();
+  REQUIRE(c.string_value() == "shared");
+}
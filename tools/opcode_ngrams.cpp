@@ -0,0 +1,101 @@
+// Counts opcode n-grams in the bytecode compiled from a corpus of .dang
+// programs, to help pick which sequences are worth fusing into
+// superinstructions.
+//
+// usage: opcode_ngrams [-n N] [-top K] file.dang...
+
+#include "../src/compiler.h"
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+static std::string read_file(const char *path) {
+  std::ifstream f(path);
+  if (!f) {
+    std::cerr << "failed to open file: " << path << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  std::stringstream s;
+  s << f.rdbuf();
+  return s.str();
+}
+
+/// Opcodes of every instruction in `function` and any functions nested in its
+/// constants, one sequence per chunk
+static void collect(const Function &function,
+                    std::vector<std::vector<Op>> &sequences) {
+  const Chunk &chunk = *function.chunk;
+
+  std::vector<Op> ops;
+  for (size_t offset = 0; offset < chunk.code.size();) {
+    Op op = (Op)chunk.code[offset];
+    ops.push_back(op);
+    offset += 1 + op_n_args(op);
+  }
+  sequences.push_back(ops);
+
+  for (const Value &v : chunk.constants) {
+    if (v.type() == ValueType::function) {
+      collect(v.function_value(), sequences);
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int n = 0;
+  int top = 20;
+  std::vector<const char *> paths;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-n" && i + 1 < argc) {
+      n = std::atoi(argv[++i]);
+    } else if (arg == "-top" && i + 1 < argc) {
+      top = std::atoi(argv[++i]);
+    } else {
+      paths.push_back(argv[i]);
+    }
+  }
+
+  if (paths.empty()) {
+    std::cerr << "usage: " << argv[0] << " [-n N] [-top K] file.dang..."
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // count what the compiler emits before any fusing
+  CompilerOptions options{.superinstructions = false};
+
+  std::vector<std::vector<Op>> sequences;
+  for (const char *path : paths) {
+    GlobalTable globals;
+    collect(Compiler::compile(read_file(path), globals, options), sequences);
+  }
+
+  // n = 0 reports both bigrams and trigrams
+  for (int len : n > 0 ? std::vector<int>{n} : std::vector<int>{2, 3}) {
+    std::map<std::vector<Op>, int> counts;
+    for (const auto &ops : sequences) {
+      for (size_t i = 0; i + len <= ops.size(); i++) {
+        counts[std::vector<Op>(ops.begin() + i, ops.begin() + i + len)]++;
+      }
+    }
+
+    std::vector<std::pair<std::vector<Op>, int>> sorted(counts.begin(),
+                                                        counts.end());
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [](auto &a, auto &b) { return a.second > b.second; });
+
+    std::cout << "== " << len << "-grams ==" << std::endl;
+    for (int i = 0; i < top && i < (int)sorted.size(); i++) {
+      std::cout << sorted[i].second << "\t";
+      for (Op op : sorted[i].first) {
+        std::cout << " " << to_string(op);
+      }
+      std::cout << std::endl;
+    }
+    std::cout << std::endl;
+  }
+}